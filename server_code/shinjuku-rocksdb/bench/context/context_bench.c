@@ -0,0 +1,195 @@
+/*
+ * context_bench.c - cost of task context primitives
+ *
+ * Compares the coroutine switch of dp/core/context_fast.S with the previous
+ * ucontext_t based primitives (legacy_context.S) on the paths the worker
+ * uses:
+ *   create: prepare a context for a new packet and enter it once
+ *           (getcontext_fast + makecontext + swapcontext_very_fast vs
+ *            context_make + context_switch)
+ *   switch: leave a running context for the worker main loop
+ *           (swapcontext_fast_to_control vs context_switch)
+ *   resume: re-enter a preempted context
+ *           (swapcontext_fast vs context_switch)
+ *
+ * Runs as a plain process; reports the best of several trials in TSC cycles.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ucontext.h>
+
+#include <ix/context.h>
+#include <asm/cpu.h>
+
+#define ITERS	1000000
+#define TRIALS	7
+
+extern int legacy_getcontext_fast(ucontext_t *ucp);
+extern int legacy_swapcontext_fast(ucontext_t *ouctx, ucontext_t *uctx);
+extern int legacy_swapcontext_very_fast(ucontext_t *ouctx, ucontext_t *uctx);
+extern int legacy_swapcontext_fast_to_control(ucontext_t *ouctx,
+					      ucontext_t *uctx);
+
+static char stack_mem[CONTEXT_STACK_SIZE] __attribute__((aligned(64)));
+
+/* legacy primitives */
+
+static ucontext_t legacy_main, legacy_task;
+static uint64_t legacy_switch_cycles, legacy_resume_cycles, legacy_stamp;
+
+/* set_context_link() with the stack top computed in bytes, like makecontext */
+static void legacy_set_context_link(ucontext_t *c, ucontext_t *uc_link)
+{
+	uintptr_t *sp;
+
+	sp = (uintptr_t *) ((char *) c->uc_stack.ss_sp + c->uc_stack.ss_size);
+	sp -= 1;
+	sp = (uintptr_t *) ((((uintptr_t) sp) & -16L) - 8);
+	c->uc_link = uc_link;
+	sp[1] = (uintptr_t) c->uc_link;
+}
+
+static void legacy_empty(void)
+{
+	legacy_swapcontext_very_fast(&legacy_task, &legacy_main);
+}
+
+static void legacy_pingpong(void)
+{
+	int i;
+
+	for (i = 0; i < ITERS; i++) {
+		legacy_stamp = rdtsc();
+		legacy_swapcontext_fast_to_control(&legacy_task, &legacy_main);
+		legacy_resume_cycles += rdtsc() - legacy_stamp;
+	}
+	legacy_swapcontext_very_fast(&legacy_task, &legacy_main);
+}
+
+static uint64_t legacy_create(void)
+{
+	uint64_t start;
+	int i;
+
+	start = rdtsc();
+	for (i = 0; i < ITERS; i++) {
+		legacy_getcontext_fast(&legacy_task);
+		legacy_task.uc_stack.ss_sp = stack_mem;
+		legacy_task.uc_stack.ss_size = sizeof(stack_mem);
+		legacy_set_context_link(&legacy_task, &legacy_main);
+		makecontext(&legacy_task, legacy_empty, 0);
+		legacy_swapcontext_very_fast(&legacy_main, &legacy_task);
+	}
+	return (rdtsc() - start) / ITERS;
+}
+
+static void legacy_switch_resume(uint64_t *sw, uint64_t *res)
+{
+	int i;
+
+	legacy_getcontext_fast(&legacy_task);
+	legacy_task.uc_stack.ss_sp = stack_mem;
+	legacy_task.uc_stack.ss_size = sizeof(stack_mem);
+	legacy_set_context_link(&legacy_task, &legacy_main);
+	makecontext(&legacy_task, legacy_pingpong, 0);
+
+	legacy_switch_cycles = legacy_resume_cycles = 0;
+	legacy_swapcontext_very_fast(&legacy_main, &legacy_task);
+	for (i = 0; i < ITERS; i++) {
+		legacy_switch_cycles += rdtsc() - legacy_stamp;
+		legacy_stamp = rdtsc();
+		legacy_swapcontext_fast(&legacy_main, &legacy_task);
+	}
+	*sw = legacy_switch_cycles / ITERS;
+	*res = legacy_resume_cycles / ITERS;
+}
+
+/* coroutine primitives */
+
+static struct context ctx_main, ctx_task;
+static uint64_t ctx_switch_cycles, ctx_resume_cycles, ctx_stamp;
+
+static void ctx_empty(void *arg)
+{
+	context_switch(&ctx_task, &ctx_main);
+}
+
+static void ctx_pingpong(void *arg)
+{
+	int i;
+
+	for (i = 0; i < ITERS; i++) {
+		ctx_stamp = rdtsc();
+		context_switch(&ctx_task, &ctx_main);
+		ctx_resume_cycles += rdtsc() - ctx_stamp;
+	}
+	context_switch(&ctx_task, &ctx_main);
+}
+
+static uint64_t ctx_create(void)
+{
+	uint64_t start;
+	int i;
+
+	start = rdtsc();
+	for (i = 0; i < ITERS; i++) {
+		context_make(&ctx_task, ctx_empty, NULL);
+		context_switch(&ctx_main, &ctx_task);
+	}
+	return (rdtsc() - start) / ITERS;
+}
+
+static void ctx_switch_resume(uint64_t *sw, uint64_t *res)
+{
+	int i;
+
+	context_make(&ctx_task, ctx_pingpong, NULL);
+	ctx_switch_cycles = ctx_resume_cycles = 0;
+	context_switch(&ctx_main, &ctx_task);
+	for (i = 0; i < ITERS; i++) {
+		ctx_switch_cycles += rdtsc() - ctx_stamp;
+		ctx_stamp = rdtsc();
+		context_switch(&ctx_main, &ctx_task);
+	}
+	*sw = ctx_switch_cycles / ITERS;
+	*res = ctx_resume_cycles / ITERS;
+}
+
+static void keep_min(uint64_t *best, uint64_t v)
+{
+	if (v < *best)
+		*best = v;
+}
+
+int main(void)
+{
+	uint64_t lc = UINT64_MAX, ls = UINT64_MAX, lr = UINT64_MAX;
+	uint64_t cc = UINT64_MAX, cs = UINT64_MAX, cr = UINT64_MAX;
+	uint64_t sw, res;
+	int t;
+
+	ctx_task.stack = stack_mem;
+	ctx_task.stack_size = sizeof(stack_mem);
+
+	for (t = 0; t < TRIALS; t++) {
+		keep_min(&lc, legacy_create());
+		legacy_switch_resume(&sw, &res);
+		keep_min(&ls, sw);
+		keep_min(&lr, res);
+
+		keep_min(&cc, ctx_create());
+		ctx_switch_resume(&sw, &res);
+		keep_min(&cs, sw);
+		keep_min(&cr, res);
+	}
+
+	printf("sizeof(ucontext_t) %zu, sizeof(struct context) %zu\n",
+	       sizeof(ucontext_t), sizeof(struct context));
+	printf("%-8s %10s %10s\n", "cycles", "ucontext", "coroutine");
+	printf("%-8s %10lu %10lu\n", "create", lc, cc);
+	printf("%-8s %10lu %10lu\n", "switch", ls, cs);
+	printf("%-8s %10lu %10lu\n", "resume", lr, cr);
+	return 0;
+}
@@ -0,0 +1,441 @@
+/*
+ * rocksdb_bench.c - GET and SCAN service times of a RocksDB tuning profile
+ *
+ * Opens a database built by db/load_db with the options of a profile of
+ * ix/rocksdb.h and serves GETs and SCANs from one thread, the way a worker
+ * does: pinned GETs, and one iterator reused by all SCANs. Keys are drawn
+ * uniformly or from a Zipf distribution of popularity ranks, and rebuilt
+ * with dataset.h, so -n, -k and -s must be those given to load_db.
+ *
+ * Reports the distribution of the service times of each request kind, to
+ * compare profiles on the same dataset (see "make run"), and the throughput.
+ *
+ * With -t, as many threads serve -g GETs and -S SCANs each at once, to
+ * compare one database shared by all of them against -D shards built by
+ * load_db -D: GETs go to the shard of their key, and SCANs merge the
+ * iterators of all shards, as the server does (see "make run-shards").
+ *
+ * With -c it measures nothing and checks instead that SCANs from a key, in
+ * total order as the server runs them, return the keys of the next ids:
+ * every key has its own prefix, so they all cross prefixes ("make check"
+ * runs it on the default profile).
+ *
+ * usage: rocksdb_bench [-d path] [-P profile] [-n keys] [-k key dist]
+ *                      [-s seed] [-g gets] [-S scans] [-L scan length]
+ *                      [-z zipf theta] [-W warmup] [-t threads] [-D shards]
+ *                      [-c]
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <ix/rocksdb.h>
+
+#include "dataset.h"
+
+static const char *db_path = "./my_db";
+static struct rocksdb_profile profile;
+static uint64_t nr_keys = 1000000;
+static struct dataset_dist key_dist = { DATASET_FIXED, 16, 0 };
+static uint64_t seed = 1;
+static uint64_t nr_gets = 1000000, nr_scans = 100000, nr_warmup = 100000;
+static int scan_len = 100;
+static double theta;
+static int nr_threads = 1, nr_shards = 1;
+static int check;
+static rocksdb_t **dbs;
+
+struct bench_thread {
+	pthread_t tid;
+	uint64_t rng;
+	rocksdb_readoptions_t *ro;
+	rocksdb_readoptions_t *scan_ro;	/* total order, scans cross prefixes */
+	rocksdb_iterator_t **iters;	/* one per shard */
+	uint64_t *ns;
+	uint64_t found;
+};
+
+/* Zipf ranks as in YCSB (Gray et al., "Quickly generating billion-record
+ * synthetic databases") */
+static double zipf_alpha, zipf_eta, zipf_zetan;
+
+static void zipf_init(void)
+{
+	double zeta2 = 1 + pow(0.5, theta);
+	uint64_t i;
+
+	for (i = 1; i <= nr_keys; i++)
+		zipf_zetan += 1 / pow(i, theta);
+	zipf_alpha = 1 / (1 - theta);
+	zipf_eta = (1 - pow(2.0 / nr_keys, 1 - theta)) / (1 - zeta2 / zipf_zetan);
+}
+
+static uint64_t next_id(uint64_t *rng)
+{
+	double u, uz;
+	uint64_t rank;
+
+	*rng = dataset_hash(*rng);
+	if (!theta)
+		return *rng % nr_keys;
+	u = (*rng >> 11) / 9007199254740992.0;
+	uz = u * zipf_zetan;
+	if (uz < 1)
+		rank = 0;
+	else if (uz < 1 + pow(0.5, theta))
+		rank = 1;
+	else
+		rank = nr_keys * pow(zipf_eta * u - zipf_eta + 1, zipf_alpha);
+	if (rank >= nr_keys)
+		rank = nr_keys - 1;
+	return dataset_key_id(rank, nr_keys);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* @ns holds the service times of all threads, @secs the wall time */
+static void report(const char *kind, uint64_t *ns, uint64_t n, uint64_t found,
+		   double secs)
+{
+	static const double pct[] = { 50, 90, 99, 99.9 };
+	uint64_t i, sum = 0;
+
+	if (!n)
+		return;
+	qsort(ns, n, sizeof(*ns), cmp_u64);
+	for (i = 0; i < n; i++)
+		sum += ns[i];
+	printf("%-6s %2d shards %2d threads %-5s n %-8lu found %-8lu mean %8.2f",
+	       profile.name, nr_shards, nr_threads, kind, n, found,
+	       sum / 1000.0 / n);
+	for (i = 0; i < sizeof(pct) / sizeof(pct[0]); i++)
+		printf("  p%-4g %8.2f", pct[i], ns[(uint64_t) (n * pct[i] / 100)] /
+		       1000.0);
+	printf("  max %8.2f us  %8.1f kops/s\n", ns[n - 1] / 1000.0,
+	       n / secs / 1000);
+}
+
+static uint64_t do_get(rocksdb_readoptions_t *ro, uint64_t id)
+{
+	char key[DATASET_KEY_MAX], *err = NULL;
+	rocksdb_pinnableslice_t *v;
+	size_t len = dataset_key_len(&key_dist, seed, id);
+
+	dataset_key(id, key, len);
+	v = rocksdb_get_pinned(dbs[rocksdb_shard(key, len, nr_shards)], ro, key,
+			       len, &err);
+	if (err) {
+		fprintf(stderr, "rocksdb_bench: get: %s\n", err);
+		exit(1);
+	}
+	if (!v)
+		return 0;
+	rocksdb_pinnableslice_value(v, &len);
+	rocksdb_pinnableslice_destroy(v);
+	return 1;
+}
+
+/* bytewise order, the default comparator */
+static int key_cmp(const char *a, size_t alen, const char *b, size_t blen)
+{
+	int ret = memcmp(a, b, alen < blen ? alen : blen);
+
+	return ret ? ret : (alen > blen) - (alen < blen);
+}
+
+/* the shard at the smallest key, or -1; the shards hold disjoint keys */
+static int scan_next(rocksdb_iterator_t **iters, const char **min,
+		     size_t *min_len)
+{
+	const char *k;
+	size_t klen;
+	int i, cur = -1;
+
+	for (i = 0; i < nr_shards; i++) {
+		if (!rocksdb_iter_valid(iters[i]))
+			continue;
+		k = rocksdb_iter_key(iters[i], &klen);
+		if (cur < 0 || key_cmp(k, klen, *min, *min_len) < 0) {
+			cur = i;
+			*min = k;
+			*min_len = klen;
+		}
+	}
+	return cur;
+}
+
+static void scan_seek(rocksdb_iterator_t **iters, uint64_t id)
+{
+	char key[DATASET_KEY_MAX];
+	size_t len = dataset_key_len(&key_dist, seed, id);
+	int i;
+
+	dataset_key(id, key, len);
+	for (i = 0; i < nr_shards; i++)
+		rocksdb_iter_seek(iters[i], key, len);
+}
+
+/*
+ * The error of the last seek, NULL if none. Iterators only report a seek
+ * they do not support, such as a total order seek in a plain table with a
+ * prefix extractor, once it is done.
+ */
+static char *scan_error(rocksdb_iterator_t **iters)
+{
+	char *err = NULL;
+	int i;
+
+	for (i = 0; i < nr_shards && !err; i++)
+		rocksdb_iter_get_error(iters[i], &err);
+	return err;
+}
+
+/* merges the shards, returns -1 and sets @err if the seek failed */
+static int do_scan(rocksdb_iterator_t **iters, uint64_t id, char **err)
+{
+	const char *k = NULL;
+	size_t klen = 0, len;
+	int cur, n = 0;
+
+	scan_seek(iters, id);
+	*err = scan_error(iters);
+	if (*err)
+		return -1;
+	while (n < scan_len) {
+		cur = scan_next(iters, &k, &klen);
+		if (cur < 0)
+			break;
+		rocksdb_iter_value(iters[cur], &len);
+		rocksdb_iter_next(iters[cur]);
+		n++;
+	}
+	return n;
+}
+
+/* -c: returns 0 if a scan from the key of @id finds the keys that follow */
+static int check_scan(rocksdb_iterator_t **iters, uint64_t id)
+{
+	char want[DATASET_KEY_MAX], *err;
+	const char *k = NULL;
+	size_t klen = 0, len;
+	uint64_t n;
+	int cur;
+
+	scan_seek(iters, id);
+	err = scan_error(iters);
+	if (err) {
+		fprintf(stderr, "rocksdb_bench: %s: scan from id %lu: %s\n",
+			profile.name, id, err);
+		free(err);
+		return -1;
+	}
+	for (n = 0; n < (uint64_t) scan_len && id + n < nr_keys; n++) {
+		len = dataset_key_len(&key_dist, seed, id + n);
+		dataset_key(id + n, want, len);
+		cur = scan_next(iters, &k, &klen);
+		if (cur < 0 || key_cmp(k, klen, want, len)) {
+			fprintf(stderr, "rocksdb_bench: %s: scan from id %lu "
+				"misses id %lu\n", profile.name, id, id + n);
+			return -1;
+		}
+		rocksdb_iter_next(iters[cur]);
+	}
+	return 0;
+}
+
+static void *get_thread(void *arg)
+{
+	struct bench_thread *t = arg;
+	uint64_t i, start;
+
+	for (i = 0; i < nr_gets; i++) {
+		start = now_ns();
+		t->found += do_get(t->ro, next_id(&t->rng));
+		t->ns[i] = now_ns() - start;
+	}
+	return NULL;
+}
+
+static void *scan_thread(void *arg)
+{
+	struct bench_thread *t = arg;
+	uint64_t i, start;
+	char *err;
+	int n;
+
+	for (i = 0; i < nr_scans; i++) {
+		start = now_ns();
+		n = do_scan(t->iters, next_id(&t->rng), &err);
+		t->ns[i] = now_ns() - start;
+		if (n < 0) {
+			fprintf(stderr, "rocksdb_bench: scan: %s\n", err);
+			exit(1);
+		}
+		t->found += n;
+	}
+	return NULL;
+}
+
+/* runs @fn on all threads, which store their times in a slice of @ns */
+static void run(const char *kind, void *(*fn)(void *), uint64_t n,
+		struct bench_thread *threads, uint64_t *ns)
+{
+	uint64_t found = 0, start;
+	int i;
+
+	start = now_ns();
+	for (i = 0; i < nr_threads; i++) {
+		threads[i].ns = ns + i * n;
+		threads[i].found = 0;
+		if (pthread_create(&threads[i].tid, NULL, fn, &threads[i])) {
+			fprintf(stderr, "rocksdb_bench: pthread_create failed\n");
+			exit(1);
+		}
+	}
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(threads[i].tid, NULL);
+		found += threads[i].found;
+	}
+	report(kind, ns, n * nr_threads, found, (now_ns() - start) / 1e9);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: rocksdb_bench [-d path] [-P plain|point|scan] [-n keys] "
+		"[-k key dist]\n"
+		"                     [-s seed] [-g gets] [-S scans] "
+		"[-L scan length]\n"
+		"                     [-z zipf theta] [-W warmup] [-t threads] "
+		"[-D shards] [-c]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_thread *threads;
+	rocksdb_options_t *options;
+	uint64_t *ns, i, rng;
+	char *err = NULL, path[4096];
+	int opt, t, s, ret = 0;
+
+	rocksdb_profile_find("plain", &profile);
+	while ((opt = getopt(argc, argv, "d:P:n:k:s:g:S:L:z:W:t:D:c")) != -1) {
+		switch (opt) {
+		case 'd': db_path = optarg; break;
+		case 'P': if (rocksdb_profile_find(optarg, &profile)) usage(); break;
+		case 'n': nr_keys = strtoull(optarg, NULL, 0); break;
+		case 'k': if (dataset_dist_parse(optarg, &key_dist)) usage(); break;
+		case 's': seed = strtoull(optarg, NULL, 0); break;
+		case 'g': nr_gets = strtoull(optarg, NULL, 0); break;
+		case 'S': nr_scans = strtoull(optarg, NULL, 0); break;
+		case 'L': scan_len = atoi(optarg); break;
+		case 'z': theta = atof(optarg); break;
+		case 'W': nr_warmup = strtoull(optarg, NULL, 0); break;
+		case 't': nr_threads = atoi(optarg); break;
+		case 'D': nr_shards = atoi(optarg); break;
+		case 'c': check = 1; break;
+		default: usage();
+		}
+	}
+	if (!nr_keys || scan_len < 1 || theta < 0 || theta >= 1 ||
+	    nr_threads < 1 || nr_shards < 1)
+		usage();
+	if (theta)
+		zipf_init();
+
+	/* the shards split the block cache, as on the server */
+	if (profile.block_cache_mb && nr_shards > 1) {
+		profile.block_cache_mb /= nr_shards;
+		if (!profile.block_cache_mb)
+			profile.block_cache_mb = 1;
+	}
+	options = rocksdb_profile_options(&profile, 0);
+	dbs = calloc(nr_shards, sizeof(*dbs));
+	threads = calloc(nr_threads, sizeof(*threads));
+	ns = malloc(sizeof(*ns) * nr_threads *
+		    (nr_gets > nr_scans ? nr_gets : nr_scans));
+	if (!dbs || !threads || !ns) {
+		fprintf(stderr, "rocksdb_bench: out of memory\n");
+		return 1;
+	}
+	for (s = 0; s < nr_shards; s++) {
+		rocksdb_shard_path(path, sizeof(path), db_path, s, nr_shards);
+		dbs[s] = rocksdb_open_for_read_only(options, path, 0, &err);
+		if (err) {
+			fprintf(stderr, "rocksdb_bench: %s: %s\n", path, err);
+			return 1;
+		}
+	}
+	for (t = 0; t < nr_threads; t++) {
+		threads[t].rng = dataset_hash(seed + t);
+		threads[t].ro = rocksdb_readoptions_create();
+		threads[t].scan_ro = rocksdb_readoptions_create();
+		rocksdb_readoptions_set_total_order_seek(threads[t].scan_ro, 1);
+		threads[t].iters = calloc(nr_shards, sizeof(*threads[t].iters));
+		for (s = 0; s < nr_shards; s++)
+			threads[t].iters[s] = rocksdb_create_iterator(dbs[s],
+							threads[t].scan_ro);
+	}
+
+	if (check) {
+		/* the start, the middle and the end of the keyspace */
+		if (check_scan(threads[0].iters, 0) ||
+		    check_scan(threads[0].iters, nr_keys / 2) ||
+		    check_scan(threads[0].iters, nr_keys - 1))
+			ret = 1;
+		else
+			printf("%s: scans across prefixes ok\n", profile.name);
+		goto out;
+	}
+
+	/* fills the caches and the page cache with the hot keys */
+	rng = seed;
+	for (i = 0; i < nr_warmup; i++)
+		do_get(threads[0].ro, next_id(&rng));
+
+	run("get", get_thread, nr_gets, threads, ns);
+	/* no numbers for scans that fail at once */
+	if (nr_scans && do_scan(threads[0].iters, 0, &err) < 0) {
+		printf("%-6s %2d shards %2d threads scan  unsupported: %s\n",
+		       profile.name, nr_shards, nr_threads, err);
+		free(err);
+		nr_scans = 0;
+	}
+	run("scan", scan_thread, nr_scans, threads, ns);
+
+out:
+
+	for (t = 0; t < nr_threads; t++) {
+		for (s = 0; s < nr_shards; s++)
+			rocksdb_iter_destroy(threads[t].iters[s]);
+		free(threads[t].iters);
+		rocksdb_readoptions_destroy(threads[t].ro);
+		rocksdb_readoptions_destroy(threads[t].scan_ro);
+	}
+	for (s = 0; s < nr_shards; s++)
+		rocksdb_close(dbs[s]);
+	rocksdb_options_destroy(options);
+	free(ns);
+	free(threads);
+	free(dbs);
+	return ret;
+}
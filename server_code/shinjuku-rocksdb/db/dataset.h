@@ -0,0 +1,126 @@
+/*
+ * dataset.h - key layout of the datasets built by load_db
+ *
+ * Key ids run from 0 to nr_keys - 1. A key starts with its id as 8 big
+ * endian bytes, so keys sort by id and the 8 byte prefix extractor of the
+ * server sees a distinct prefix per key. Keys longer than 8 bytes are padded
+ * with filler bytes that depend on the id only.
+ *
+ * Clients that draw popularity ranks from a Zipf distribution map a rank to
+ * a key id with dataset_key_id(): rank 0 is the hottest key, and hot keys
+ * are spread over the key space instead of sharing a few blocks.
+ */
+
+#pragma once
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define DATASET_KEY_MIN		8
+#define DATASET_KEY_MAX		255
+/* multiplier of the rank to id permutation, coprime with any nr_keys that
+ * is not a multiple of it */
+#define DATASET_SPREAD		2654435761ULL
+
+static inline uint64_t dataset_hash(uint64_t x)
+{
+  /* splitmix64 finalizer */
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+enum {
+  DATASET_FIXED,
+  DATASET_UNIFORM,
+  DATASET_NORMAL,
+  DATASET_PARETO,
+};
+
+struct dataset_dist {
+  int type;
+  double a, b;
+};
+
+/* parses a size distribution, returns 0 if successful */
+static inline int dataset_dist_parse(const char *spec, struct dataset_dist *d)
+{
+  static const char *const names[] = {
+    [DATASET_FIXED] = "fixed", [DATASET_UNIFORM] = "uniform",
+    [DATASET_NORMAL] = "normal", [DATASET_PARETO] = "pareto",
+  };
+  char name[16] = "";
+  int i, n;
+
+  d->b = 0;
+  n = sscanf(spec, "%15[a-z]:%lf:%lf", name, &d->a, &d->b);
+  for (i = 0; i < 4; i++) {
+    if (strcmp(name, names[i]))
+      continue;
+    d->type = i;
+    if (n != (i == DATASET_FIXED ? 2 : 3) || d->a < 0 || d->b < 0)
+      return -1;
+    return i == DATASET_UNIFORM && d->b < d->a ? -1 : 0;
+  }
+  return -1;
+}
+
+/* a size from @d clamped to [@min, @max], @h is a random 64 bit value */
+static inline size_t dataset_dist_sample(const struct dataset_dist *d,
+                                         uint64_t h, size_t min, size_t max)
+{
+  /* two uniforms in (0, 1) */
+  double u = ((h >> 32) + 0.5) / 4294967296.0;
+  double v = ((h & 0xffffffff) + 0.5) / 4294967296.0;
+  double x;
+
+  switch (d->type) {
+  case DATASET_UNIFORM:
+    x = d->a + u * (d->b - d->a + 1);
+    break;
+  case DATASET_NORMAL:
+    x = d->a + d->b * sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+    break;
+  case DATASET_PARETO:
+    /* generalized Pareto from the minimum */
+    x = min + (d->b ? d->a * (pow(u, -d->b) - 1) / d->b : -d->a * log(u));
+    break;
+  default:
+    x = d->a;
+  }
+  if (x < min)
+    return min;
+  return x > max ? max : (size_t) x;
+}
+
+/* the length of the key of @id */
+static inline size_t dataset_key_len(const struct dataset_dist *d,
+                                     uint64_t seed, uint64_t id)
+{
+  return dataset_dist_sample(d, dataset_hash(seed ^ dataset_hash(id)),
+                             DATASET_KEY_MIN, DATASET_KEY_MAX);
+}
+
+/* the id of the key of popularity rank @rank, a permutation of the ids */
+static inline uint64_t dataset_key_id(uint64_t rank, uint64_t nr_keys)
+{
+  if (nr_keys % DATASET_SPREAD == 0)
+    return rank;
+  return (unsigned __int128) rank * DATASET_SPREAD % nr_keys;
+}
+
+/* writes the @len byte key of @id to @buf */
+static inline void dataset_key(uint64_t id, char *buf, size_t len)
+{
+  uint64_t fill = dataset_hash(id);
+  size_t i;
+
+  for (i = 0; i < DATASET_KEY_MIN; i++)
+    buf[i] = id >> (56 - 8 * i);
+  for (; i < len; i++)
+    buf[i] = 'a' + (fill >> (i % 8 * 8)) % 26;
+}
@@ -0,0 +1,336 @@
+/*
+ * load_db.c - builds large RocksDB datasets through SST file ingestion
+ *
+ * Instead of a put per key, threads write sorted, non-overlapping SST files
+ * of consecutive key ids in parallel, and the database ingests all of them
+ * in one call, straight into the bottom level. Optional overwrites through
+ * the write path then fill the memtable, L0 and the upper levels, as on a
+ * server that has taken writes for a while.
+ *
+ * Keys and value sizes follow dataset.h. The files use the table format and
+ * options of a tuning profile (ix/rocksdb.h), which must be the profile the
+ * server opens the database with, and the 1000 byte "long_key" of the
+ * legacy workload is added as well.
+ *
+ * With -D, the keys are split by rocksdb_shard() into that many databases,
+ * <path>.0 and on, as the server opens them with rocksdb.shards. Every
+ * file then holds the keys of one shard within its range of ids.
+ *
+ * usage: load_db [-n keys] [-k key dist] [-v value dist] [-t threads]
+ *                [-F file MB] [-w overwrites] [-s seed] [-d path]
+ *                [-P profile] [-D shards]
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>  // sysconf() - get CPU count
+#include <sys/stat.h>
+
+#include <ix/rocksdb.h>
+
+#include "dataset.h"
+
+#define VALUE_MAX       (1 << 20)
+#define VALUE_BUF_LEN   (2 * VALUE_MAX)
+#define SAMPLE_KEYS     4096
+#define WRITE_BATCH     1000
+#define LONG_KEY        "long_key"
+#define LONG_VALUE_LEN  1000
+
+static uint64_t nr_keys = 1000000;
+static struct dataset_dist key_dist = { DATASET_FIXED, 16, 0 };
+static struct dataset_dist value_dist = { DATASET_FIXED, 100, 0 };
+static int nr_threads;
+static uint64_t file_mb = 64;
+static uint64_t nr_overwrites;
+static uint64_t seed = 1;
+static const char *db_path = "./my_db";
+static struct rocksdb_profile profile;
+static int nr_shards = 1;
+
+static char sst_dir[4096];
+/* nr_files per shard, file f of shard s is s * nr_files + f */
+static uint64_t keys_per_file, nr_files, next_file;
+static bool *file_empty;
+static uint64_t bytes_written;
+static char *value_buf;
+static rocksdb_options_t *options;
+
+static void die(const char *what, char *err)
+{
+  fprintf(stderr, "load_db: %s: %s\n", what, err ? err : strerror(errno));
+  exit(1);
+}
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* the options of the server, so that it reads the files as they are */
+static rocksdb_options_t *db_options(void)
+{
+  rocksdb_options_t *o =
+      rocksdb_profile_options(&profile, (int) sysconf(_SC_NPROCESSORS_ONLN));
+
+  /* ingestion into a database with data could overlap it */
+  rocksdb_options_set_error_if_exists(o, 1);
+  return o;
+}
+
+/* the value of @id, a slice of the random buffer, @gen for overwrites */
+static const char *value_of(uint64_t id, uint64_t gen, size_t *len)
+{
+  uint64_t h = dataset_hash(seed + 1 + gen) ^ dataset_hash(id);
+
+  *len = dataset_dist_sample(&value_dist, dataset_hash(h), 0, VALUE_MAX);
+  return value_buf + h % (VALUE_BUF_LEN - *len + 1);
+}
+
+static void write_file(uint64_t file)
+{
+  rocksdb_envoptions_t *env = rocksdb_envoptions_create();
+  rocksdb_sstfilewriter_t *w = rocksdb_sstfilewriter_create(env, options);
+  int shard = file / nr_files;
+  uint64_t id = file % nr_files * keys_per_file, end = id + keys_per_file;
+  char path[4200], key[DATASET_KEY_MAX];
+  char long_value[LONG_VALUE_LEN];
+  uint64_t bytes = 0, n = 0;
+  const char *val;
+  size_t klen, vlen;
+  char *err = NULL;
+
+  snprintf(path, sizeof(path), "%s/%08lu.sst", sst_dir, file);
+  rocksdb_sstfilewriter_open(w, path, &err);
+  if (err)
+    die(path, err);
+  if (end > nr_keys)
+    end = nr_keys;
+  for (; id < end; id++) {
+    klen = dataset_key_len(&key_dist, seed, id);
+    dataset_key(id, key, klen);
+    if (rocksdb_shard(key, klen, nr_shards) != shard)
+      continue;
+    val = value_of(id, 0, &vlen);
+    rocksdb_sstfilewriter_put(w, key, klen, val, vlen, &err);
+    if (err)
+      die(path, err);
+    bytes += klen + vlen;
+    n++;
+  }
+  /* sorts after every id, so it goes last */
+  if (file % nr_files == nr_files - 1 &&
+      rocksdb_shard(LONG_KEY, strlen(LONG_KEY), nr_shards) == shard) {
+    memset(long_value, 'a', LONG_VALUE_LEN);
+    rocksdb_sstfilewriter_put(w, LONG_KEY, strlen(LONG_KEY), long_value,
+                              LONG_VALUE_LEN, &err);
+    if (err)
+      die(path, err);
+    n++;
+  }
+  /* an SST file cannot be empty, and a shard may have no key in a range */
+  if (n) {
+    rocksdb_sstfilewriter_finish(w, &err);
+    if (err)
+      die(path, err);
+  } else {
+    file_empty[file] = true;
+  }
+  rocksdb_sstfilewriter_destroy(w);
+  if (!n)
+    unlink(path);
+  rocksdb_envoptions_destroy(env);
+  __sync_fetch_and_add(&bytes_written, bytes);
+}
+
+static void *writer_thread(void *arg)
+{
+  uint64_t file;
+
+  while ((file = __sync_fetch_and_add(&next_file, 1)) <
+         nr_files * nr_shards)
+    write_file(file);
+  return NULL;
+}
+
+static void overwrite(rocksdb_t **dbs)
+{
+  rocksdb_writeoptions_t *wo = rocksdb_writeoptions_create();
+  rocksdb_writebatch_t **b = calloc(nr_shards, sizeof(*b));
+  rocksdb_flushoptions_t *fo = rocksdb_flushoptions_create();
+  char key[DATASET_KEY_MAX];
+  const char *val;
+  size_t klen, vlen;
+  char *err = NULL;
+  uint64_t i, id;
+  int s;
+
+  for (s = 0; s < nr_shards; s++)
+    b[s] = rocksdb_writebatch_create();
+  /* the data is in the SST files already */
+  rocksdb_writeoptions_disable_WAL(wo, 1);
+  for (i = 0; i < nr_overwrites; i++) {
+    id = dataset_hash(seed + 2 + i) % nr_keys;
+    klen = dataset_key_len(&key_dist, seed, id);
+    dataset_key(id, key, klen);
+    val = value_of(id, i + 1, &vlen);
+    rocksdb_writebatch_put(b[rocksdb_shard(key, klen, nr_shards)], key, klen,
+                           val, vlen);
+    if ((i + 1) % WRITE_BATCH && i + 1 < nr_overwrites)
+      continue;
+    for (s = 0; s < nr_shards; s++) {
+      rocksdb_write(dbs[s], wo, b[s], &err);
+      if (err)
+        die("write", err);
+      rocksdb_writebatch_clear(b[s]);
+    }
+  }
+  for (s = 0; s < nr_shards; s++) {
+    rocksdb_flush(dbs[s], fo, &err);
+    if (err)
+      die("flush", err);
+    rocksdb_writebatch_destroy(b[s]);
+  }
+  free(b);
+  rocksdb_flushoptions_destroy(fo);
+  rocksdb_writeoptions_destroy(wo);
+}
+
+static void usage(void)
+{
+  fprintf(stderr,
+          "usage: load_db [-n keys] [-k key dist] [-v value dist] "
+          "[-t threads]\n"
+          "               [-F file MB] [-w overwrites] [-s seed] [-d path]\n"
+          "               [-P plain|point|scan] [-D shards]\n"
+          "dist: fixed:N, uniform:MIN:MAX, normal:MEAN:STDDEV, "
+          "pareto:SCALE:SHAPE\n");
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  rocksdb_ingestexternalfileoptions_t *io;
+  pthread_t *threads;
+  char **files, path[4200];
+  char *err = NULL, *stats;
+  rocksdb_t **dbs;
+  uint64_t i, n, sample = 0;
+  double start, t_files, t_ingest;
+  size_t vlen;
+  int opt, s;
+
+  nr_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  rocksdb_profile_find("plain", &profile);
+  while ((opt = getopt(argc, argv, "n:k:v:t:F:w:s:d:P:D:")) != -1) {
+    switch (opt) {
+    case 'n': nr_keys = strtoull(optarg, NULL, 0); break;
+    case 'k': if (dataset_dist_parse(optarg, &key_dist)) usage(); break;
+    case 'v': if (dataset_dist_parse(optarg, &value_dist)) usage(); break;
+    case 't': nr_threads = atoi(optarg); break;
+    case 'F': file_mb = strtoull(optarg, NULL, 0); break;
+    case 'w': nr_overwrites = strtoull(optarg, NULL, 0); break;
+    case 's': seed = strtoull(optarg, NULL, 0); break;
+    case 'd': db_path = optarg; break;
+    case 'P': if (rocksdb_profile_find(optarg, &profile)) usage(); break;
+    case 'D': nr_shards = atoi(optarg); break;
+    default: usage();
+    }
+  }
+  if (!nr_keys || nr_threads < 1 || !file_mb || nr_shards < 1)
+    usage();
+
+  /* random, hardly compressible values */
+  value_buf = malloc(VALUE_BUF_LEN);
+  if (!value_buf)
+    die("value buffer", NULL);
+  for (i = 0; i < VALUE_BUF_LEN / 8; i++)
+    ((uint64_t *) value_buf)[i] = dataset_hash(seed ^ (i << 20));
+
+  /* files of about file_mb from the average entry size */
+  for (i = 0; i < SAMPLE_KEYS; i++) {
+    value_of(i, 0, &vlen);
+    sample += dataset_key_len(&key_dist, seed, i) + vlen;
+  }
+  keys_per_file = (file_mb << 20) / (sample / SAMPLE_KEYS + 1) + 1;
+  /* a shard gets 1 / nr_shards of the keys of a range */
+  keys_per_file *= nr_shards;
+  nr_files = (nr_keys + keys_per_file - 1) / keys_per_file;
+  file_empty = calloc(nr_files * nr_shards, sizeof(*file_empty));
+
+  options = db_options();
+  snprintf(sst_dir, sizeof(sst_dir), "%s.sst", db_path);
+  if (mkdir(sst_dir, 0755) && errno != EEXIST)
+    die(sst_dir, NULL);
+
+  start = now();
+  threads = calloc(nr_threads, sizeof(*threads));
+  for (i = 0; i < nr_threads; i++)
+    if (pthread_create(&threads[i], NULL, writer_thread, NULL))
+      die("pthread_create", NULL);
+  for (i = 0; i < nr_threads; i++)
+    pthread_join(threads[i], NULL);
+  t_files = now() - start;
+
+  dbs = calloc(nr_shards, sizeof(*dbs));
+  files = calloc(nr_files, sizeof(*files));
+  for (i = 0; i < nr_files; i++)
+    files[i] = malloc(4200);
+  io = rocksdb_ingestexternalfileoptions_create();
+  rocksdb_ingestexternalfileoptions_set_move_files(io, 1);
+  for (s = 0; s < nr_shards; s++) {
+    rocksdb_shard_path(path, sizeof(path), db_path, s, nr_shards);
+    dbs[s] = rocksdb_open(options, path, &err);
+    if (err)
+      die(path, err);
+    for (i = n = 0; i < nr_files; i++)
+      if (!file_empty[s * nr_files + i])
+        snprintf(files[n++], 4200, "%s/%08lu.sst", sst_dir,
+                 s * nr_files + i);
+    if (n)
+      rocksdb_ingest_external_file(dbs[s], (const char *const *) files, n, io,
+                                   &err);
+    if (err)
+      die("ingest", err);
+    /* the database holds links to the files now */
+    for (i = 0; i < n; i++)
+      unlink(files[i]);
+  }
+  rmdir(sst_dir);
+  t_ingest = now() - start - t_files;
+
+  if (nr_overwrites)
+    overwrite(dbs);
+
+  printf("%s profile: %lu keys in %d shards, %lu MB in %lu files: written in %.2f s "
+         "(%d threads), ingested in %.2f s, %.2f s in total\n",
+         profile.name, nr_keys, nr_shards, bytes_written >> 20, nr_files * nr_shards,
+         t_files, nr_threads, t_ingest, now() - start);
+  for (s = 0; s < nr_shards; s++) {
+    stats = rocksdb_property_value(dbs[s], "rocksdb.levelstats");
+    if (stats) {
+      if (nr_shards > 1)
+        printf("shard %d:\n", s);
+      printf("%s", stats);
+      free(stats);
+    }
+    rocksdb_close(dbs[s]);
+  }
+
+  rocksdb_ingestexternalfileoptions_destroy(io);
+  rocksdb_options_destroy(options);
+  for (i = 0; i < nr_files; i++)
+    free(files[i]);
+  free(files);
+  free(file_empty);
+  free(dbs);
+  free(threads);
+  free(value_buf);
+  return 0;
+}
@@ -0,0 +1,5 @@
+# Makefile for the applications served by the worker cores
+
+SRC = rocksdb.c rocksdb_commit.c rocksdb_io.c kv_cache.c search.c
+
+$(eval $(call register_dir, apps, $(SRC)))
@@ -0,0 +1,240 @@
+/*
+ * kv_cache.c - per-worker cache of hot key-value pairs
+ *
+ * With a skewed GET workload most requests hit a few keys, yet each one
+ * pays for the memtable and block cache lookups of RocksDB. A worker with
+ * rocksdb.hot_cache_kb serves those from a small set-associative table of
+ * its own, in fixed-size entries that hold the key, the part of the value
+ * a reply carries and its full length. Every set keeps its 8 tags in one
+ * cache line and evicts with CLOCK.
+ *
+ * Writes invalidate the entries of all workers without messages: a write
+ * bumps the generation of the key's slot in a shared, read-mostly array
+ * once it is applied, and an entry is only valid while the generation it
+ * was filled with is current. A GET reads the generation before reading
+ * RocksDB, so a value filled with it is never older than a write that
+ * bumped it first.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <ix/stddef.h>
+#include <ix/cfg.h>
+#include <ix/errno.h>
+#include <ix/hash.h>
+#include <ix/kv.h>
+#include <ix/rocksdb.h>
+
+#define KV_CACHE_WAYS		8
+#define KV_CACHE_GENS		(1 << 16)	/* generation slots */
+
+struct kv_cache_entry {
+	uint32_t gen;
+	uint32_t val_len;	/* of the whole value */
+	uint8_t key_len;
+	/* the key, then the first KV_BUF_LEN bytes of the value */
+	char data[2 * KV_BUF_LEN];
+} __aligned(64);
+
+struct kv_cache_set {
+	uint32_t tags[KV_CACHE_WAYS];	/* 0 for an empty way */
+	uint8_t ref;			/* CLOCK reference bits */
+	uint8_t hand;
+} __aligned(64);
+
+struct kv_cache {
+	struct kv_cache_set *sets;
+	struct kv_cache_entry *entries;
+	uint32_t mask;
+};
+
+static volatile uint32_t *kv_cache_gens;
+static volatile uint64_t kv_cache_writes;
+
+static uint32_t kv_cache_hash(const char *key, size_t len)
+{
+	uint32_t h = len;
+	uint64_t w;
+
+	for (; len >= sizeof(w); key += sizeof(w), len -= sizeof(w)) {
+		memcpy(&w, key, sizeof(w));
+		h = hash_crc32c_one(h, w);
+	}
+	if (len) {
+		w = 0;
+		memcpy(&w, key, len);
+		h = hash_crc32c_one(h, w);
+	}
+	return h;
+}
+
+/**
+ * kv_cache_init - allocates the generations, if the cache is enabled
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int kv_cache_init(void)
+{
+	if (!CFG.rocksdb_hot_cache_kb)
+		return 0;
+	kv_cache_gens = calloc(KV_CACHE_GENS, sizeof(*kv_cache_gens));
+	return kv_cache_gens ? 0 : -ENOMEM;
+}
+
+/**
+ * kv_cache_create - allocates the cache of the calling worker
+ *
+ * The sets are a power of two that fits in rocksdb.hot_cache_kb.
+ *
+ * Returns the cache, or NULL if out of memory.
+ */
+struct kv_cache *kv_cache_create(void)
+{
+	size_t set_len = sizeof(struct kv_cache_set) +
+			 KV_CACHE_WAYS * sizeof(struct kv_cache_entry);
+	size_t nr_sets = 1;
+	struct kv_cache *c;
+
+	while (2 * nr_sets * set_len <= (size_t) CFG.rocksdb_hot_cache_kb << 10)
+		nr_sets *= 2;
+
+	c = malloc(sizeof(*c));
+	if (!c)
+		return NULL;
+	/* touched here first, so on the node of the worker */
+	c->sets = calloc(nr_sets, sizeof(*c->sets));
+	c->entries = calloc(nr_sets * KV_CACHE_WAYS, sizeof(*c->entries));
+	if (!c->sets || !c->entries) {
+		free(c->sets);
+		free(c->entries);
+		free(c);
+		return NULL;
+	}
+	c->mask = nr_sets - 1;
+	return c;
+}
+
+/**
+ * kv_cache_gen - the generation to fill a key with
+ * @key: the key
+ * @len: the key length
+ *
+ * Must be read before the value, see kv_cache_put().
+ */
+uint32_t kv_cache_gen(const char *key, size_t len)
+{
+	return kv_cache_gens[kv_cache_hash(key, len) & (KV_CACHE_GENS - 1)];
+}
+
+/**
+ * kv_cache_epoch - counts the writes of all workers
+ *
+ * A value read from a snapshot taken before a write may be older than that
+ * write, so it is only cached if the epoch did not change since.
+ */
+uint64_t kv_cache_epoch(void)
+{
+	return kv_cache_writes;
+}
+
+/**
+ * kv_cache_get - looks a key up
+ * @c: the cache
+ * @key: the key
+ * @len: the key length
+ * @val_len: the length of the whole value
+ *
+ * Returns the first min(@val_len, KV_BUF_LEN) bytes of the value, or NULL
+ * if the key is not cached.
+ */
+const char *kv_cache_get(struct kv_cache *c, const char *key, size_t len,
+			 size_t *val_len)
+{
+	uint32_t h = kv_cache_hash(key, len), tag = h | 1;
+	struct kv_cache_set *set = &c->sets[h & c->mask];
+	struct kv_cache_entry *e;
+	int i;
+
+	for (i = 0; i < KV_CACHE_WAYS; i++) {
+		if (set->tags[i] != tag)
+			continue;
+		e = &c->entries[(h & c->mask) * KV_CACHE_WAYS + i];
+		if (e->key_len != len || memcmp(e->data, key, len))
+			continue;
+		if (e->gen != kv_cache_gens[h & (KV_CACHE_GENS - 1)]) {
+			/* written since */
+			set->tags[i] = 0;
+			return NULL;
+		}
+		set->ref |= 1 << i;
+		*val_len = e->val_len;
+		return e->data + len;
+	}
+	return NULL;
+}
+
+/**
+ * kv_cache_put - caches a value
+ * @c: the cache
+ * @key: the key
+ * @len: the key length
+ * @val: the value
+ * @val_len: the value length
+ * @gen: the generation of the key before the value was read
+ */
+void kv_cache_put(struct kv_cache *c, const char *key, size_t len,
+		  const char *val, size_t val_len, uint32_t gen)
+{
+	uint32_t h = kv_cache_hash(key, len), tag = h | 1;
+	struct kv_cache_set *set = &c->sets[h & c->mask];
+	struct kv_cache_entry *e;
+	int i, way = -1;
+
+	if (len > KV_BUF_LEN || val_len > UINT32_MAX)
+		return;
+	for (i = 0; i < KV_CACHE_WAYS; i++) {
+		e = &c->entries[(h & c->mask) * KV_CACHE_WAYS + i];
+		if (set->tags[i] == tag && e->key_len == len &&
+		    !memcmp(e->data, key, len)) {
+			way = i;
+			break;
+		}
+		if (!set->tags[i] && way < 0)
+			way = i;
+	}
+	if (way < 0) {
+		/* CLOCK: skip and clear the ways used since the last pass */
+		while (set->ref & (1 << set->hand)) {
+			set->ref &= ~(1 << set->hand);
+			set->hand = (set->hand + 1) % KV_CACHE_WAYS;
+		}
+		way = set->hand;
+		set->hand = (set->hand + 1) % KV_CACHE_WAYS;
+	}
+
+	e = &c->entries[(h & c->mask) * KV_CACHE_WAYS + way];
+	e->gen = gen;
+	e->val_len = val_len;
+	e->key_len = len;
+	memcpy(e->data, key, len);
+	memcpy(e->data + len, val, min(val_len, (size_t) KV_BUF_LEN));
+	set->tags[way] = tag;
+	set->ref &= ~(1 << way);
+}
+
+/**
+ * kv_cache_invalidate - drops a key from the caches of all workers
+ * @key: the key
+ * @len: the key length
+ *
+ * Called once a write of the key is applied.
+ */
+void kv_cache_invalidate(const char *key, size_t len)
+{
+	if (!kv_cache_gens)
+		return;
+	__sync_fetch_and_add(&kv_cache_gens[kv_cache_hash(key, len) &
+					    (KV_CACHE_GENS - 1)], 1);
+	__sync_fetch_and_add(&kv_cache_writes, 1);
+}
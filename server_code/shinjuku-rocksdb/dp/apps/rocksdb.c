@@ -0,0 +1,1002 @@
+/*
+ * rocksdb.c - RocksDB application served by the worker cores
+ *
+ * The database is opened once at startup. Every worker keeps its own read
+ * and write options so that the request path does not allocate them per
+ * request. Requests follow the key-value protocol of ix/kv.h.
+ *
+ * Reads run in a per-worker session: a snapshot shared by all reads and one
+ * iterator reused by all scans, renewed after rocksdb.session_refresh us or
+ * after a write of the worker. GETs return pinned values instead of copies.
+ * A batch of queued GETs (batch_size) is served with one MultiGet. Scans
+ * yield the worker every rocksdb.scan_chunk keys (see worker_yield()).
+ * PUTs and DELETEs go through the group commit of rocksdb_commit.c. GETs
+ * that miss the block cache can be read on I/O threads (rocksdb_io.c), and
+ * the hot keys served from a cache of the worker (kv_cache.c).
+ *
+ * With rocksdb.shards the keyspace is split by rocksdb_shard() into as many
+ * database instances, each with its own memtable, block cache and version
+ * set, and worker i owns shard i modulo shards. The leaf picks a worker by
+ * load and not by key, so a worker also serves the keys of other shards,
+ * with a session per shard. MultiGets run once per shard, and scans merge
+ * the iterators of all shards unless both bounds share the key prefix.
+ *
+ * The databases have a fixed prefix extractor, except plain tables (see
+ * rocksdb_profile_prefix()), so a seek only finds keys reliably within the
+ * prefix of its target. Scans whose bounds share the prefix stay in prefix
+ * mode (and stop at its end), other scans from a key seek in total order
+ * (see rocksdb_scan_kind()). Without the extractor all seeks are in total
+ * order and scans only stop at their end key.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ix/stddef.h>
+#include <ix/app.h>
+#include <ix/cpu.h>
+#include <ix/log.h>
+#include <ix/errno.h>
+#include <ix/dispatch.h>
+#include <ix/kv.h>
+#include <ix/rocksdb.h>
+#include <ix/stats.h>
+#include <ix/timer.h>
+
+#include <asm/cpu.h>
+
+#include <c.h>
+
+#define ROCKSDB_WARMUP_GETS	64
+#define ROCKSDB_MULTI_MAX	(KV_MULTIGET_MAX > CFG_MAX_BATCH ? \
+				 KV_MULTIGET_MAX : CFG_MAX_BATCH)
+#define ROCKSDB_BLOCK_CACHE_TIER 1	/* ReadTier::kBlockCacheTier */
+
+/* kinds of scans, each with its own read options and iterator */
+enum {
+	ROCKSDB_SCAN_FIRST,	/* from the first key */
+	ROCKSDB_SCAN_PREFIX,	/* between two keys of one prefix */
+	ROCKSDB_SCAN_TOTAL,	/* from a key, across prefixes */
+	ROCKSDB_NR_SCANS,
+};
+
+/* the session of a worker with one shard */
+struct rocksdb_state {
+	rocksdb_t *db;
+	rocksdb_readoptions_t *readoptions;
+	/* of GETs, block cache only with rocksdb.io_threads */
+	rocksdb_readoptions_t *getoptions;
+	/* of each kind of scan, [ROCKSDB_SCAN_FIRST] is readoptions */
+	rocksdb_readoptions_t *scanoptions[ROCKSDB_NR_SCANS];
+	rocksdb_writeoptions_t *writeoptions;
+	/* session, see rocksdb_session() */
+	const rocksdb_snapshot_t *snapshot;
+	rocksdb_iterator_t *iter[ROCKSDB_NR_SCANS];
+	uint64_t session_start;
+	bool session_stale;
+	/* hot keys of the worker, see kv_cache_fill() */
+	struct kv_cache *cache;
+	uint64_t session_epoch;
+};
+
+struct rocksdb_worker {
+	int shard;		/* the one the worker owns */
+	struct rocksdb_state shards[CFG_MAX_SHARDS];
+};
+
+static uint64_t rocksdb_session_cycles;
+static rocksdb_t *rocksdb_dbs[CFG_MAX_SHARDS];
+static int rocksdb_nr_shards = 1;
+static bool rocksdb_prefix;	/* see rocksdb_profile_prefix() */
+
+/* the profile of shinjuku.conf with its overrides */
+static int rocksdb_app_profile(struct rocksdb_profile *p)
+{
+	const char *name = CFG.rocksdb_profile[0] ? CFG.rocksdb_profile : "plain";
+
+	if (rocksdb_profile_find(name, p)) {
+		log_err("rocksdb: unknown profile %s\n", name);
+		return -EINVAL;
+	}
+	if (CFG.rocksdb_block_cache_mb >= 0)
+		p->block_cache_mb = CFG.rocksdb_block_cache_mb;
+	if (CFG.rocksdb_bloom_bits >= 0)
+		p->bloom_bits = CFG.rocksdb_bloom_bits;
+	if (CFG.rocksdb_pin_l0 >= 0)
+		p->pin_l0 = CFG.rocksdb_pin_l0;
+	if (CFG.rocksdb_mmap_reads >= 0)
+		p->mmap_reads = CFG.rocksdb_mmap_reads;
+	if (CFG.rocksdb_compression[0]) {
+		p->compression = rocksdb_compression_parse(CFG.rocksdb_compression);
+		if (p->compression < 0) {
+			log_err("rocksdb: unknown compression %s\n",
+				CFG.rocksdb_compression);
+			return -EINVAL;
+		}
+	}
+	if (CFG.rocksdb_memtable[0]) {
+		p->memtable = rocksdb_memtable_parse(CFG.rocksdb_memtable);
+		if (p->memtable < 0) {
+			log_err("rocksdb: unknown memtable %s\n",
+				CFG.rocksdb_memtable);
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
+
+static int rocksdb_app_init(void)
+{
+	BUILD_ASSERT(sizeof(struct kv_request) <=
+		     sizeof(((struct message *) 0)->app_data));
+	BUILD_ASSERT(sizeof(struct kv_response) <=
+		     sizeof(((struct message *) 0)->app_data));
+
+	struct rocksdb_profile profile;
+	rocksdb_options_t *options;
+	char path[64];
+	int i, ret;
+
+	ret = rocksdb_app_profile(&profile);
+	if (ret)
+		return ret;
+	if (CFG.rocksdb_shards > 1)
+		rocksdb_nr_shards = CFG.rocksdb_shards;
+	/* the shards split the block cache */
+	if (profile.block_cache_mb)
+		profile.block_cache_mb = max(profile.block_cache_mb /
+					     rocksdb_nr_shards, (uint64_t) 1);
+	log_info("rocksdb: profile %s, %s table, cache %lu MB, bloom %d, "
+		 "compression %s, memtable %s, %d shards\n", profile.name,
+		 profile.plain_table ? "plain" : "block based",
+		 profile.block_cache_mb, profile.bloom_bits,
+		 rocksdb_compression_names[profile.compression],
+		 rocksdb_memtable_names[profile.memtable], rocksdb_nr_shards);
+	rocksdb_prefix = rocksdb_profile_prefix(&profile);
+	if (profile.plain_table && rocksdb_prefix)
+		log_warn("rocksdb: plain tables with a hash memtable only scan "
+			 "within a key prefix\n");
+	options = rocksdb_profile_options(&profile, 0);
+
+	// open DB
+	char *err = NULL;
+	/*
+	 NOTE: this DB is created by db/create_db.c program,
+	 Our run scripts Makes create_db program and runs it.
+	 build_and_run.sh: copies the created db to this path.
+	 HORUS: the shards are /tmp/my_db.0 and on, see load_db -D.
+	*/
+	char DBPath[] = "/tmp/my_db";
+	for (i = 0; i < rocksdb_nr_shards; i++) {
+		rocksdb_shard_path(path, sizeof(path), DBPath, i,
+				   rocksdb_nr_shards);
+		rocksdb_dbs[i] = rocksdb_open(options, path, &err);
+		if (err) {
+			log_err("rocksdb: failed to open %s: %s\n", path, err);
+			free(err);
+			rocksdb_options_destroy(options);
+			return -EIO;
+		}
+	}
+	rocksdb_options_destroy(options);
+	rocksdb_session_cycles = CFG.rocksdb_session_refresh_us * cycles_per_us;
+	ret = rocksdb_commit_init();
+	if (ret)
+		return ret;
+	ret = kv_cache_init();
+	if (ret)
+		return ret;
+	return rocksdb_io_init();
+}
+
+static int rocksdb_app_init_cpu(void **state)
+{
+	struct rocksdb_worker *w = calloc(1, sizeof(*w));
+	struct kv_cache *cache = NULL;
+	struct rocksdb_state *s;
+	int i;
+
+	if (!w)
+		return -ENOMEM;
+	if (CFG.rocksdb_hot_cache_kb) {
+		cache = kv_cache_create();
+		if (!cache)
+			return -ENOMEM;
+	}
+
+	w->shard = (percpu_get(cpu_nr) - 2) % rocksdb_nr_shards;
+	for (i = 0; i < rocksdb_nr_shards; i++) {
+		s = &w->shards[i];
+		s->db = rocksdb_dbs[i];
+		s->readoptions = rocksdb_readoptions_create();
+		s->getoptions = s->readoptions;
+		if (CFG.rocksdb_io_threads) {
+			s->getoptions = rocksdb_readoptions_create();
+			rocksdb_readoptions_set_read_tier(s->getoptions,
+							  ROCKSDB_BLOCK_CACHE_TIER);
+		}
+		s->scanoptions[ROCKSDB_SCAN_FIRST] = s->readoptions;
+		s->scanoptions[ROCKSDB_SCAN_PREFIX] = rocksdb_readoptions_create();
+		/* needs the extractor, kv_scan() checks the end key anyway */
+		if (rocksdb_prefix)
+			rocksdb_readoptions_set_prefix_same_as_start(
+				s->scanoptions[ROCKSDB_SCAN_PREFIX], 1);
+		s->scanoptions[ROCKSDB_SCAN_TOTAL] = rocksdb_readoptions_create();
+		rocksdb_readoptions_set_total_order_seek(
+			s->scanoptions[ROCKSDB_SCAN_TOTAL], 1);
+		s->writeoptions = rocksdb_writeoptions_create();
+		rocksdb_commit_options(s->writeoptions);
+		s->cache = cache;
+	}
+	*state = w;
+	return 0;
+}
+
+/* points all read options of a session at @snapshot, NULL for none */
+static void rocksdb_session_snapshot(struct rocksdb_state *s,
+				     const rocksdb_snapshot_t *snapshot)
+{
+	int i;
+
+	rocksdb_readoptions_set_snapshot(s->getoptions, snapshot);
+	for (i = 0; i < ROCKSDB_NR_SCANS; i++)
+		rocksdb_readoptions_set_snapshot(s->scanoptions[i], snapshot);
+}
+
+static void rocksdb_session_end(struct rocksdb_state *s)
+{
+	int i;
+
+	for (i = 0; i < ROCKSDB_NR_SCANS; i++) {
+		if (s->iter[i]) {
+			rocksdb_iter_destroy(s->iter[i]);
+			s->iter[i] = NULL;
+		}
+	}
+	if (s->snapshot) {
+		rocksdb_session_snapshot(s, NULL);
+		rocksdb_release_snapshot(s->db, s->snapshot);
+		s->snapshot = NULL;
+	}
+}
+
+/*
+ * Renews the worker's snapshot of a shard (and drops its iterator) when it
+ * is older than the refresh interval or the worker wrote to it since. A
+ * long-lived snapshot or iterator pins memtables and SST files, the interval
+ * bounds how long. Without an interval reads see the latest data.
+ */
+static void rocksdb_session(struct rocksdb_state *s)
+{
+	uint64_t now;
+
+	if (!rocksdb_session_cycles)
+		return;
+	now = rdtsc();
+	if (s->snapshot && !s->session_stale &&
+	    now - s->session_start < rocksdb_session_cycles)
+		return;
+
+	rocksdb_session_end(s);
+	/* before the snapshot, see kv_cache_fill() */
+	s->session_epoch = kv_cache_epoch();
+	s->snapshot = rocksdb_create_snapshot(s->db);
+	rocksdb_session_snapshot(s, s->snapshot);
+	s->session_start = now;
+	s->session_stale = false;
+}
+
+/*
+ * Takes the session's iterator of a kind of scan, or a new one, until
+ * rocksdb_iter_put(). A scan that yields keeps it, so the requests served
+ * meanwhile do not move it and a session renewal does not destroy it.
+ */
+static rocksdb_iterator_t *rocksdb_iter_get(struct rocksdb_state *s, int kind,
+					    uint64_t *session)
+{
+	rocksdb_iterator_t *iter = s->iter[kind];
+
+	*session = s->session_start;
+	if (!iter)
+		return rocksdb_create_iterator(s->db, s->scanoptions[kind]);
+	s->iter[kind] = NULL;
+	return iter;
+}
+
+/* gives the iterator back to its session, if that is still the current one */
+static void rocksdb_iter_put(struct rocksdb_state *s, int kind,
+			     rocksdb_iterator_t *iter, uint64_t session)
+{
+	if (rocksdb_session_cycles && !s->iter[kind] && !s->session_stale &&
+	    session == s->session_start)
+		s->iter[kind] = iter;
+	else
+		rocksdb_iter_destroy(iter);
+}
+
+/* the session of the worker with @shard for @keys keys, renewed if due */
+static struct rocksdb_state *rocksdb_shard_session(struct rocksdb_worker *w,
+						   int shard, int keys)
+{
+	struct rocksdb_state *s = &w->shards[shard];
+
+	if (rocksdb_nr_shards > 1) {
+		if (shard == w->shard)
+			STATS_ADD(SHARD_LOCAL, keys);
+		else
+			STATS_ADD(SHARD_REMOTE, keys);
+	}
+	rocksdb_session(s);
+	return s;
+}
+
+/* the session of the worker with the shard of a key */
+static inline struct rocksdb_state *
+rocksdb_shard_of(struct rocksdb_worker *w, const char *key, size_t len)
+{
+	return rocksdb_shard_session(w, rocksdb_shard(key, len,
+						      rocksdb_nr_shards), 1);
+}
+
+/* lets other requests run every scan_chunk keys of a scan */
+static inline void rocksdb_scan_yield(unsigned int keys)
+{
+	if (CFG.rocksdb_scan_chunk && keys % CFG.rocksdb_scan_chunk == 0)
+		worker_yield();
+}
+
+static void rocksdb_app_warmup(void *state)
+{
+	struct rocksdb_worker *w = state;
+	struct rocksdb_state *s;
+	rocksdb_pinnableslice_t *val;
+	rocksdb_iterator_t *iter;
+	uint64_t session;
+	int i, shard;
+
+	s = &w->shards[rocksdb_shard("long_key", 8, rocksdb_nr_shards)];
+	rocksdb_session(s);
+	// Pull the hot key and the first data blocks into this core's caches
+	for (i = 0; i < ROCKSDB_WARMUP_GETS; i++) {
+		val = rocksdb_get_pinned(s->db, s->readoptions, "long_key", 8,
+					 NULL);
+		if (val)
+			rocksdb_pinnableslice_destroy(val);
+	}
+
+	for (shard = 0; shard < rocksdb_nr_shards; shard++) {
+		s = &w->shards[shard];
+		rocksdb_session(s);
+		iter = rocksdb_iter_get(s, ROCKSDB_SCAN_FIRST, &session);
+		for (rocksdb_iter_seek_to_first(iter), i = 0;
+		     rocksdb_iter_valid(iter) && i < ROCKSDB_WARMUP_GETS;
+		     rocksdb_iter_next(iter), i++)
+			;
+		rocksdb_iter_put(s, ROCKSDB_SCAN_FIRST, iter, session);
+	}
+}
+
+/*
+ * @parham: different tasks at worker based on runNs (set by client).
+ * Client sends runNs 500 for GET and 0 for SCAN functions.
+ */
+static void rocksdb_legacy_work(struct rocksdb_worker *w, struct message * req)
+{
+	if (req->runNs > 0) {
+		struct rocksdb_state * s = rocksdb_shard_of(w, "long_key", 8);
+		for (int i = 0; i < 60; i++) {
+			rocksdb_pinnableslice_t * long_val =
+				rocksdb_get_pinned(s->db, s->readoptions,
+						   "long_key", 8, NULL);
+			if (long_val)
+				rocksdb_pinnableslice_destroy(long_val);
+		}
+	} else {
+		uint64_t session;
+		unsigned int keys = 0;
+		// HORUS: the whole keyspace, one shard after the other
+		for (int shard = 0; shard < rocksdb_nr_shards; shard++) {
+			struct rocksdb_state * s = &w->shards[shard];
+			rocksdb_session(s);
+			rocksdb_iterator_t * iter = rocksdb_iter_get(s, ROCKSDB_SCAN_FIRST, &session);
+			for (rocksdb_iter_seek_to_first(iter); rocksdb_iter_valid(iter); rocksdb_iter_next(iter)) {
+				size_t klen;
+				rocksdb_iter_key(iter, &klen);
+				rocksdb_scan_yield(++keys);
+			}
+			rocksdb_iter_put(s, ROCKSDB_SCAN_FIRST, iter, session);
+		}
+	}
+}
+
+static void kv_error(struct kv_response *kp, const char *what, char *err)
+{
+	log_warn("rocksdb: %s failed: %s\n", what, err);
+	free(err);
+	kp->status = KV_ERROR;
+}
+
+/* appends @len bytes to the reply, false if they do not fit */
+static bool kv_put_bytes(struct kv_response *kp, const void *data, size_t len)
+{
+	if (kp->len + len > KV_BUF_LEN)
+		return false;
+	memcpy(kp->buf + kp->len, data, len);
+	kp->len += len;
+	return true;
+}
+
+/* the reply of a GET, truncated if the value does not fit */
+static void kv_get_value(struct kv_response *kp, const char *val, size_t len)
+{
+	kp->len = len;
+	if (len > KV_BUF_LEN) {
+		kp->flags |= KV_F_TRUNCATED;
+		len = KV_BUF_LEN;
+	}
+	memcpy(kp->buf, val, len);
+}
+
+/*
+ * Caches a value read with generation @gen. A value read from the session's
+ * snapshot may predate writes applied since, so it is only cached if no
+ * write happened since the snapshot was taken.
+ */
+static void kv_cache_fill(struct rocksdb_state *s, const char *key,
+			  size_t len, const char *val, size_t val_len,
+			  uint32_t gen)
+{
+	if (s->cache && (!s->snapshot || kv_cache_epoch() == s->session_epoch))
+		kv_cache_put(s->cache, key, len, val, val_len, gen);
+}
+
+/* reads the value of a GET that missed the block cache on an I/O thread */
+static void kv_get_io(struct rocksdb_state *s, struct kv_request *kr,
+		      struct kv_response *kp, uint32_t gen)
+{
+	struct rocksdb_io io;
+
+	io.db = s->db;
+	io.key = (char *) kr->buf;
+	io.key_len = kr->key_len;
+	rocksdb_io_submit(&io);
+	rocksdb_io_wait(&io);
+	if (io.err)
+		kv_error(kp, "get", io.err);
+	else if (!io.val)
+		kp->status = KV_NOT_FOUND;
+	else {
+		kv_get_value(kp, io.val, io.val_len);
+		kv_cache_fill(s, io.key, io.key_len, io.val, io.val_len, gen);
+	}
+	free(io.val);
+}
+
+/*
+ * A MultiGet that reads the keys missing from the block cache on the I/O
+ * threads, all at once.
+ */
+static void kv_multi_get_shard(struct rocksdb_state *s, int n,
+			       const char **keys, size_t *key_lens, char **vals,
+			       size_t *val_lens, char **errs)
+{
+	struct rocksdb_io io[ROCKSDB_MULTI_MAX];
+	bool miss[ROCKSDB_MULTI_MAX];
+	int i;
+
+	rocksdb_multi_get(s->db, s->getoptions, n, keys, key_lens, vals,
+			  val_lens, errs);
+	for (i = 0; i < n; i++) {
+		miss[i] = rocksdb_io_miss(errs[i]);
+		if (!miss[i])
+			continue;
+		io[i].db = s->db;
+		io[i].key = keys[i];
+		io[i].key_len = key_lens[i];
+		rocksdb_io_submit(&io[i]);
+	}
+	for (i = 0; i < n; i++) {
+		if (!miss[i])
+			continue;
+		rocksdb_io_wait(&io[i]);
+		vals[i] = io[i].val;
+		val_lens[i] = io[i].val_len;
+		errs[i] = io[i].err;
+	}
+}
+
+/* a MultiGet per shard, over the keys of that shard */
+static void kv_multi_get(struct rocksdb_worker *w, int n, const char **keys,
+			 size_t *key_lens, char **vals, size_t *val_lens,
+			 char **errs)
+{
+	const char *skeys[ROCKSDB_MULTI_MAX];
+	size_t skey_lens[ROCKSDB_MULTI_MAX], sval_lens[ROCKSDB_MULTI_MAX];
+	char *svals[ROCKSDB_MULTI_MAX], *serrs[ROCKSDB_MULTI_MAX];
+	int shard[ROCKSDB_MULTI_MAX], idx[ROCKSDB_MULTI_MAX];
+	int i, j, m;
+
+	if (rocksdb_nr_shards == 1) {
+		kv_multi_get_shard(rocksdb_shard_session(w, 0, n), n, keys,
+				   key_lens, vals, val_lens, errs);
+		return;
+	}
+
+	for (i = 0; i < n; i++)
+		shard[i] = rocksdb_shard(keys[i], key_lens[i],
+					 rocksdb_nr_shards);
+	for (i = 0; i < n; i++) {
+		if (shard[i] < 0)
+			continue;
+		for (j = i, m = 0; j < n; j++) {
+			if (shard[j] != shard[i])
+				continue;
+			idx[m] = j;
+			skeys[m] = keys[j];
+			skey_lens[m] = key_lens[j];
+			m++;
+		}
+		kv_multi_get_shard(rocksdb_shard_session(w, shard[i], m), m,
+				   skeys, skey_lens, svals, sval_lens, serrs);
+		for (j = 0; j < m; j++) {
+			vals[idx[j]] = svals[j];
+			val_lens[idx[j]] = sval_lens[j];
+			errs[idx[j]] = serrs[j];
+			/* done */
+			shard[idx[j]] = -1;
+		}
+	}
+}
+
+static void kv_get_db(struct rocksdb_state *s, struct kv_request *kr,
+		      struct kv_response *kp, uint32_t gen)
+{
+	rocksdb_pinnableslice_t *pinned;
+	char *err = NULL;
+	const char *val;
+	size_t len;
+
+	/* the value stays in the block cache or memtable, no copy */
+	pinned = rocksdb_get_pinned(s->db, s->getoptions, (char *) kr->buf,
+				    kr->key_len, &err);
+	if (rocksdb_io_miss(err)) {
+		kv_get_io(s, kr, kp, gen);
+		return;
+	}
+	if (err) {
+		kv_error(kp, "get", err);
+		return;
+	}
+	if (!pinned) {
+		kp->status = KV_NOT_FOUND;
+		return;
+	}
+	val = rocksdb_pinnableslice_value(pinned, &len);
+	kv_get_value(kp, val, len);
+	kv_cache_fill(s, (char *) kr->buf, kr->key_len, val, len, gen);
+	rocksdb_pinnableslice_destroy(pinned);
+}
+
+static void kv_get(struct rocksdb_state *s, struct kv_request *kr,
+		   struct kv_response *kp)
+{
+	const char *key = (char *) kr->buf, *val;
+	uint64_t start;
+	uint32_t gen;
+	size_t len;
+
+	if (!s->cache) {
+		kv_get_db(s, kr, kp, 0);
+		return;
+	}
+	start = rdtsc();
+	val = kv_cache_get(s->cache, key, kr->key_len, &len);
+	if (val) {
+		kv_get_value(kp, val, len);
+		STATS_INC(CACHE_HITS);
+		STATS_ADD(CACHE_HIT_CYCLES, rdtsc() - start);
+		return;
+	}
+	gen = kv_cache_gen(key, kr->key_len);
+	kv_get_db(s, kr, kp, gen);
+	STATS_INC(CACHE_MISSES);
+	STATS_ADD(CACHE_MISS_CYCLES, rdtsc() - start);
+}
+
+static void kv_write(struct rocksdb_state *s, struct kv_request *kr,
+		     struct kv_response *kp)
+{
+	char *key = (char *) kr->buf, *err = NULL;
+	struct rocksdb_commit c;
+
+	if (CFG.rocksdb_group_commit) {
+		c.db = s->db;
+		c.delete = kr->op == KV_OP_DELETE;
+		c.key = key;
+		c.key_len = kr->key_len;
+		c.val = key + kr->key_len;
+		c.val_len = kr->val_len;
+		rocksdb_commit_write(&c);
+		kv_cache_invalidate(key, kr->key_len);
+		s->session_stale = true;
+		if (c.failed)
+			kp->status = KV_ERROR;
+		return;
+	}
+
+	if (kr->op == KV_OP_PUT)
+		rocksdb_put(s->db, s->writeoptions, key, kr->key_len,
+			    key + kr->key_len, kr->val_len, &err);
+	else
+		rocksdb_delete(s->db, s->writeoptions, key, kr->key_len, &err);
+	kv_cache_invalidate(key, kr->key_len);
+	/* read our own writes */
+	s->session_stale = true;
+	if (err)
+		kv_error(kp, kr->op == KV_OP_PUT ? "put" : "delete", err);
+}
+
+/*
+ * Packs a MULTIGET entry, KV_ABSENT if @val is NULL. Returns false if the
+ * whole entry does not fit, or its length does not fit the u16 field.
+ */
+static bool kv_put_entry(struct kv_response *kp, const char *val, size_t vlen)
+{
+	uint16_t len = KV_ABSENT;
+
+	if (val) {
+		if (vlen >= KV_ABSENT)
+			return false;
+		len = vlen;
+	} else {
+		vlen = 0;
+	}
+	if (kp->len + sizeof(len) + vlen > KV_BUF_LEN)
+		return false;
+	kv_put_bytes(kp, &len, sizeof(len));
+	if (val)
+		kv_put_bytes(kp, val, vlen);
+	return true;
+}
+
+static void kv_multiget(struct rocksdb_worker *w, struct kv_request *kr,
+			struct kv_response *kp)
+{
+	const char *keys[KV_MULTIGET_MAX];
+	size_t key_lens[KV_MULTIGET_MAX], val_lens[KV_MULTIGET_MAX];
+	char *vals[KV_MULTIGET_MAX], *errs[KV_MULTIGET_MAX];
+	int i, nr = kr->nr_keys, off = 0;
+
+	if (!nr || nr > KV_MULTIGET_MAX) {
+		kp->status = KV_INVALID;
+		return;
+	}
+	for (i = 0; i < nr; i++) {
+		if (off >= KV_BUF_LEN ||
+		    off + 1 + kr->buf[off] > KV_BUF_LEN) {
+			kp->status = KV_INVALID;
+			return;
+		}
+		key_lens[i] = kr->buf[off];
+		keys[i] = (char *) &kr->buf[off + 1];
+		off += 1 + key_lens[i];
+	}
+
+	kv_multi_get(w, nr, keys, key_lens, vals, val_lens, errs);
+	for (i = 0; i < nr; i++) {
+		if (errs[i])
+			kv_error(kp, "multiget", errs[i]);
+		if (!(kp->flags & KV_F_TRUNCATED) &&
+		    !kv_put_entry(kp, errs[i] ? NULL : vals[i], val_lens[i]))
+			kp->flags |= KV_F_TRUNCATED;
+		if (vals[i])
+			kp->count++;
+		free(vals[i]);
+	}
+}
+
+/* bytewise order, the default comparator */
+static int kv_compare(const char *a, size_t alen, const char *b, size_t blen)
+{
+	int ret = memcmp(a, b, min(alen, blen));
+
+	if (ret)
+		return ret;
+	return alen < blen ? -1 : alen > blen;
+}
+
+/*
+ * The kind of a scan. A seek in prefix mode only finds the keys of its
+ * target's prefix, so only scans whose bounds share the prefix can use it.
+ * Without the prefix extractor all seeks are in total order anyway.
+ */
+static int rocksdb_scan_kind(struct kv_request *kr)
+{
+	const char *start = (char *) kr->buf, *end = start + kr->key_len;
+
+	if (!kr->key_len)
+		return ROCKSDB_SCAN_FIRST;
+	if (kr->key_len >= ROCKSDB_PREFIX_LEN &&
+	    kr->val_len >= ROCKSDB_PREFIX_LEN &&
+	    !memcmp(start, end, ROCKSDB_PREFIX_LEN))
+		return ROCKSDB_SCAN_PREFIX;
+	return ROCKSDB_SCAN_TOTAL;
+}
+
+/*
+ * The first shard of a scan and the number of shards, all of them unless
+ * both bounds share the key prefix.
+ */
+static int kv_scan_shards(struct kv_request *kr, int kind, int *first)
+{
+	if (kind == ROCKSDB_SCAN_PREFIX) {
+		*first = rocksdb_shard((char *) kr->buf, kr->key_len,
+				       rocksdb_nr_shards);
+		return 1;
+	}
+	*first = 0;
+	return rocksdb_nr_shards;
+}
+
+/*
+ * The iterator at the smallest key, or -1 once all are done. The shards
+ * hold disjoint keys, so merging them yields each key once, in order.
+ */
+static int kv_scan_next(rocksdb_iterator_t **iters, int n, const char **key,
+			size_t *klen)
+{
+	const char *k;
+	size_t len;
+	int i, next = -1;
+
+	for (i = 0; i < n; i++) {
+		if (!rocksdb_iter_valid(iters[i]))
+			continue;
+		k = rocksdb_iter_key(iters[i], &len);
+		if (next < 0 || kv_compare(k, len, *key, *klen) < 0) {
+			next = i;
+			*key = k;
+			*klen = len;
+		}
+	}
+	return next;
+}
+
+static void kv_scan(struct rocksdb_worker *w, struct kv_request *kr,
+		    struct kv_response *kp)
+{
+	const char *start = (char *) kr->buf, *end = start + kr->key_len;
+	int limit = kr->limit ? min((int) kr->limit, KV_SCAN_MAX) :
+				KV_SCAN_LIMIT;
+	rocksdb_iterator_t *iters[CFG_MAX_SHARDS];
+	uint64_t sessions[CFG_MAX_SHARDS];
+	struct rocksdb_state *s;
+	const char *key, *val;
+	size_t klen, vlen;
+	int i, n, first, cur, kind = rocksdb_scan_kind(kr);
+	uint16_t len;
+	uint8_t klen8;
+	char *err = NULL;
+
+	n = kv_scan_shards(kr, kind, &first);
+	for (i = 0; i < n; i++) {
+		s = rocksdb_shard_session(w, first + i, 0);
+		iters[i] = rocksdb_iter_get(s, kind, &sessions[i]);
+		if (kr->key_len)
+			rocksdb_iter_seek(iters[i], start, kr->key_len);
+		else
+			rocksdb_iter_seek_to_first(iters[i]);
+	}
+	for (cur = kv_scan_next(iters, n, &key, &klen);
+	     cur >= 0 && kp->count < limit;
+	     rocksdb_iter_next(iters[cur]),
+	     cur = kv_scan_next(iters, n, &key, &klen)) {
+		if (kr->val_len &&
+		    kv_compare(key, klen, end, kr->val_len) >= 0)
+			break;
+		kp->count++;
+		rocksdb_scan_yield(kp->count);
+		if (kp->flags & KV_F_TRUNCATED)
+			continue;
+		val = rocksdb_iter_value(iters[cur], &vlen);
+		klen8 = klen;
+		len = vlen;
+		if (klen > UINT8_MAX || vlen >= KV_ABSENT ||
+		    kp->len + 1 + klen + 2 + vlen > KV_BUF_LEN) {
+			kp->flags |= KV_F_TRUNCATED;
+			continue;
+		}
+		kv_put_bytes(kp, &klen8, 1);
+		kv_put_bytes(kp, key, klen);
+		kv_put_bytes(kp, &len, sizeof(len));
+		kv_put_bytes(kp, val, vlen);
+	}
+	for (i = 0; i < n; i++) {
+		s = &w->shards[first + i];
+		rocksdb_iter_get_error(iters[i], &err);
+		if (err) {
+			kv_error(kp, "scan", err);
+			err = NULL;
+			/* do not reuse a failed iterator */
+			s->session_stale = true;
+		}
+		rocksdb_iter_put(s, kind, iters[i], sessions[i]);
+	}
+}
+
+/* checks that the keys and value of a request lie within its buffer */
+static bool kv_valid(struct kv_request *kr)
+{
+	switch (kr->op) {
+	case KV_OP_GET:
+	case KV_OP_DELETE:
+		return kr->key_len && kr->key_len <= KV_BUF_LEN;
+	case KV_OP_PUT:
+		return kr->key_len && kr->key_len + kr->val_len <= KV_BUF_LEN;
+	case KV_OP_SCAN:
+		return kr->key_len + kr->val_len <= KV_BUF_LEN;
+	case KV_OP_MULTIGET:
+		return true;
+	}
+	return false;
+}
+
+static void kv_reply_init(struct kv_response *kp)
+{
+	kp->magic = KV_MAGIC;
+	kp->status = KV_OK;
+	kp->flags = 0;
+	kp->count = 0;
+	kp->len = 0;
+}
+
+static void rocksdb_app_handle(void *state, struct message * req,
+			       struct message * resp)
+{
+	struct rocksdb_worker *w = state;
+	struct kv_request *kr = (struct kv_request *) req->app_data;
+	struct kv_response *kp = (struct kv_response *) resp->app_data;
+	const char *key = (char *) kr->buf;
+
+	resp->runNs = req->runNs;
+	if (kr->magic != KV_MAGIC) {
+		rocksdb_legacy_work(w, req);
+		return;
+	}
+
+	kv_reply_init(kp);
+	if (!kv_valid(kr)) {
+		kp->status = KV_INVALID;
+		return;
+	}
+	switch (kr->op) {
+	case KV_OP_GET:
+		kv_get(rocksdb_shard_of(w, key, kr->key_len), kr, kp);
+		break;
+	case KV_OP_PUT:
+	case KV_OP_DELETE:
+		kv_write(rocksdb_shard_of(w, key, kr->key_len), kr, kp);
+		break;
+	case KV_OP_MULTIGET:
+		kv_multiget(w, kr, kp);
+		break;
+	case KV_OP_SCAN:
+		kv_scan(w, kr, kp);
+		break;
+	}
+}
+
+static bool rocksdb_app_batchable(struct message *req)
+{
+	struct kv_request *kr = (struct kv_request *) req->app_data;
+
+	return kr->magic == KV_MAGIC && kr->op == KV_OP_GET && kv_valid(kr);
+}
+
+/*
+ * Serves a batch of GETs (see batch_size in shinjuku.conf) with one
+ * MultiGet, which shares the memtable and block cache lookups.
+ */
+static void rocksdb_app_handle_batch(void *state, struct message **reqs,
+				     struct message *resps, int n)
+{
+	struct rocksdb_worker *w = state;
+	/* shared by the shards */
+	struct kv_cache *cache = w->shards[0].cache;
+	const char *keys[CFG_MAX_BATCH], *val;
+	size_t key_lens[CFG_MAX_BATCH], val_lens[CFG_MAX_BATCH], len;
+	char *vals[CFG_MAX_BATCH], *errs[CFG_MAX_BATCH];
+	uint32_t gens[CFG_MAX_BATCH];
+	int idx[CFG_MAX_BATCH];
+	struct kv_request *kr;
+	struct kv_response *kp;
+	uint64_t start;
+	int i, m = 0;
+
+	for (i = 0; i < n; i++) {
+		kr = (struct kv_request *) reqs[i]->app_data;
+		kp = (struct kv_response *) resps[i].app_data;
+		resps[i].runNs = reqs[i]->runNs;
+		kv_reply_init(kp);
+		gens[m] = 0;
+		if (cache) {
+			start = rdtsc();
+			val = kv_cache_get(cache, (char *) kr->buf,
+					   kr->key_len, &len);
+			if (val) {
+				kv_get_value(kp, val, len);
+				STATS_INC(CACHE_HITS);
+				STATS_ADD(CACHE_HIT_CYCLES, rdtsc() - start);
+				continue;
+			}
+			gens[m] = kv_cache_gen((char *) kr->buf, kr->key_len);
+		}
+		/* the MultiGet only reads the keys the cache misses */
+		idx[m] = i;
+		keys[m] = (char *) kr->buf;
+		key_lens[m] = kr->key_len;
+		m++;
+	}
+	if (!m)
+		return;
+
+	start = rdtsc();
+	kv_multi_get(w, m, keys, key_lens, vals, val_lens, errs);
+	for (i = 0; i < m; i++) {
+		kp = (struct kv_response *) resps[idx[i]].app_data;
+		if (errs[i]) {
+			kv_error(kp, "get", errs[i]);
+		} else if (!vals[i]) {
+			kp->status = KV_NOT_FOUND;
+		} else {
+			kv_get_value(kp, vals[i], val_lens[i]);
+			kv_cache_fill(&w->shards[rocksdb_shard(keys[i],
+					key_lens[i], rocksdb_nr_shards)],
+				      keys[i], key_lens[i], vals[i],
+				      val_lens[i], gens[i]);
+		}
+		free(vals[i]);
+	}
+	if (cache) {
+		STATS_ADD(CACHE_MISSES, m);
+		STATS_ADD(CACHE_MISS_CYCLES, rdtsc() - start);
+	}
+}
+
+static const char * const rocksdb_app_classes[] = {
+	"get", "scan", "multiget", "put", "delete", NULL
+};
+
+static int rocksdb_app_classify(struct message *req)
+{
+	struct kv_request *kr = (struct kv_request *) req->app_data;
+
+	if (kr->magic != KV_MAGIC)
+		return req->runNs > 0 ? 0 : 1;
+	switch (kr->op) {
+	case KV_OP_SCAN:
+		return 1;
+	case KV_OP_MULTIGET:
+		return 2;
+	case KV_OP_PUT:
+		return 3;
+	case KV_OP_DELETE:
+		return 4;
+	}
+	return 0;
+}
+
+struct app_handler rocksdb_app = {
+	.name		= "rocksdb",
+	.client_id	= ROCKSDB_CLIENT,
+	.init		= rocksdb_app_init,
+	.init_cpu	= rocksdb_app_init_cpu,
+	.warmup		= rocksdb_app_warmup,
+	.handle		= rocksdb_app_handle,
+	.classes	= rocksdb_app_classes,
+	.classify	= rocksdb_app_classify,
+	.batchable	= rocksdb_app_batchable,
+	.handle_batch	= rocksdb_app_handle_batch,
+};
@@ -0,0 +1,186 @@
+/*
+ * rocksdb_commit.c - group commit of the RocksDB writes of the worker cores
+ *
+ * A write with a synced WAL waits for an fsync, milliseconds on most devices
+ * and far longer than the requests the worker could serve meanwhile. So a
+ * task that writes pushes a struct rocksdb_commit on a lock-free list and
+ * parks in the dispatcher (worker_park()) while its worker serves the other
+ * queued requests. One committer thread on a spare CPU takes all the pending
+ * writes at once, applies them in a single write batch with one WAL sync, and
+ * then marks them done: their tasks resume and reply once the write is
+ * durable. The writes that arrive during an fsync make up the next group.
+ * With rocksdb.shards a group holds one write batch per shard database.
+ *
+ * rocksdb.wal selects a synced WAL (the default), an unsynced one or none.
+ * With rocksdb.group_commit = false the workers write themselves, with the
+ * same WAL mode, for comparison.
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <ix/stddef.h>
+#include <ix/app.h>
+#include <ix/cfg.h>
+#include <ix/cpu.h>
+#include <ix/errno.h>
+#include <ix/log.h>
+#include <ix/rocksdb.h>
+
+#include <asm/cpu.h>
+
+#include <c.h>
+
+#define COMMIT_SPINS		100000	/* empty polls before sleeping */
+#define COMMIT_SLEEP_US		20
+
+/* pending writes, newest first */
+static struct rocksdb_commit *commit_head;
+static rocksdb_writeoptions_t *commit_options;
+/* the write batch of each database, only used by the committer */
+static rocksdb_t *commit_dbs[CFG_MAX_SHARDS];
+static rocksdb_writebatch_t *commit_batches[CFG_MAX_SHARDS];
+static bool commit_failed[CFG_MAX_SHARDS];
+static int commit_nr_dbs;
+
+/**
+ * rocksdb_commit_options - applies the WAL mode of shinjuku.conf
+ * @wo: the write options
+ */
+void rocksdb_commit_options(rocksdb_writeoptions_t *wo)
+{
+	rocksdb_writeoptions_set_sync(wo, CFG.rocksdb_wal == CFG_WAL_SYNC);
+	rocksdb_writeoptions_disable_WAL(wo, CFG.rocksdb_wal == CFG_WAL_OFF);
+}
+
+/**
+ * rocksdb_commit_write - writes through the committer
+ * @c: the write, on the stack of the calling task
+ *
+ * Returns once the committer applied the write, c->failed tells whether it
+ * failed. Meanwhile the task is parked and its worker free.
+ */
+void rocksdb_commit_write(struct rocksdb_commit *c)
+{
+	struct rocksdb_commit *head;
+
+	c->done = false;
+	c->failed = false;
+	do {
+		head = commit_head;
+		c->next = head;
+	} while (!__sync_bool_compare_and_swap(&commit_head, head, c));
+
+	worker_park(&c->done);
+}
+
+/* the pending writes, oldest first */
+static struct rocksdb_commit *rocksdb_commit_take(void)
+{
+	struct rocksdb_commit *c, *next, *list = NULL;
+
+	c = __sync_lock_test_and_set(&commit_head, NULL);
+	for (; c; c = next) {
+		next = c->next;
+		c->next = list;
+		list = c;
+	}
+	return list;
+}
+
+/* the index of the write batch of @db, there is one per shard at most */
+static int rocksdb_commit_batch(rocksdb_t *db)
+{
+	int i;
+
+	for (i = 0; i < commit_nr_dbs; i++)
+		if (commit_dbs[i] == db)
+			return i;
+	assert(commit_nr_dbs < CFG_MAX_SHARDS);
+	commit_dbs[i] = db;
+	commit_batches[i] = rocksdb_writebatch_create();
+	commit_nr_dbs++;
+	return i;
+}
+
+static void *rocksdb_committer(void *arg)
+{
+	struct rocksdb_commit *c, *next, *list;
+	rocksdb_writebatch_t *batch;
+	unsigned int idle = 0;
+	char *err = NULL;
+	int i, n;
+
+	/* unlike the drainers, the committer is on the latency path of writes */
+	if (cpu_pin_spare_nice(0))
+		log_warn("rocksdb: no spare CPU, the committer shares the data plane cores\n");
+
+	while (true) {
+		list = rocksdb_commit_take();
+		if (!list) {
+			if (++idle < COMMIT_SPINS)
+				cpu_relax();
+			else
+				usleep(COMMIT_SLEEP_US);
+			continue;
+		}
+		idle = 0;
+
+		for (c = list; c; c = c->next) {
+			batch = commit_batches[rocksdb_commit_batch(c->db)];
+			if (c->delete)
+				rocksdb_writebatch_delete(batch, c->key, c->key_len);
+			else
+				rocksdb_writebatch_put(batch, c->key, c->key_len,
+						       c->val, c->val_len);
+		}
+		for (i = 0; i < commit_nr_dbs; i++) {
+			batch = commit_batches[i];
+			n = rocksdb_writebatch_count(batch);
+			commit_failed[i] = false;
+			if (!n)
+				continue;
+			rocksdb_write(commit_dbs[i], commit_options, batch, &err);
+			if (err) {
+				log_warn("rocksdb: group commit of %d writes failed: %s\n",
+					 n, err);
+				free(err);
+				err = NULL;
+				commit_failed[i] = true;
+			}
+			rocksdb_writebatch_clear(batch);
+		}
+
+		for (c = list; c; c = next) {
+			/* the task may go on and reuse its stack once done */
+			next = c->next;
+			c->failed = commit_failed[rocksdb_commit_batch(c->db)];
+			asm volatile("" ::: "memory");
+			c->done = true;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * rocksdb_commit_init - starts the committer, if enabled
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int rocksdb_commit_init(void)
+{
+	pthread_t tid;
+
+	if (!CFG.rocksdb_group_commit)
+		return 0;
+
+	commit_options = rocksdb_writeoptions_create();
+	rocksdb_commit_options(commit_options);
+	if (pthread_create(&tid, NULL, rocksdb_committer, NULL)) {
+		log_err("rocksdb: unable to create the committer thread\n");
+		return -EAGAIN;
+	}
+	return 0;
+}
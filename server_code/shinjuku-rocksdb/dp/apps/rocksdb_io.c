@@ -0,0 +1,163 @@
+/*
+ * rocksdb_io.c - storage reads of the workers on I/O threads
+ *
+ * A GET whose block is not cached blocks its worker for an SSD read, and
+ * the cached GETs queued behind it wait as long. With rocksdb.io_threads,
+ * workers read with a block cache only read tier, which fails instead of
+ * reading the device. The task then hands the read to a pool of I/O threads
+ * on the spare CPUs and parks in the dispatcher (see worker_park()) until
+ * the value arrives, so the worker serves the next requests meanwhile.
+ *
+ * The I/O threads read the latest data rather than the snapshot of the
+ * worker's session, which may be released while the read is in flight. A
+ * read carries the database of its shard, so the pool serves all of them.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ix/stddef.h>
+#include <ix/app.h>
+#include <ix/cfg.h>
+#include <ix/cpu.h>
+#include <ix/errno.h>
+#include <ix/lock.h>
+#include <ix/log.h>
+#include <ix/rocksdb.h>
+
+#include <asm/cpu.h>
+
+#include <c.h>
+
+#define IO_SPINS		10000	/* empty polls before sleeping */
+#define IO_SLEEP_US		20
+/* Status::Incomplete of a read that needs I/O with the block cache tier */
+#define IO_INCOMPLETE		"Result incomplete"
+
+/* submitted reads, newest first */
+static struct rocksdb_io *io_head;
+/* reads taken by the I/O threads, oldest first */
+static struct rocksdb_io *io_taken;
+static DEFINE_SPINLOCK(io_lock);
+
+/**
+ * rocksdb_io_miss - tells whether a read failed for a block cache miss
+ * @err: the error of a read with the block cache tier
+ *
+ * Returns true if the read must be submitted, in which case it frees @err.
+ */
+bool rocksdb_io_miss(char *err)
+{
+	if (!CFG.rocksdb_io_threads || !err ||
+	    strncmp(err, IO_INCOMPLETE, strlen(IO_INCOMPLETE)))
+		return false;
+	free(err);
+	return true;
+}
+
+/**
+ * rocksdb_io_submit - passes a read to the I/O threads
+ * @io: the read, on the stack of the calling task
+ */
+void rocksdb_io_submit(struct rocksdb_io *io)
+{
+	struct rocksdb_io *head;
+
+	io->val = NULL;
+	io->err = NULL;
+	io->done = false;
+	do {
+		head = io_head;
+		io->next = head;
+	} while (!__sync_bool_compare_and_swap(&io_head, head, io));
+}
+
+/**
+ * rocksdb_io_wait - waits for a submitted read
+ * @io: the read
+ *
+ * The task is parked meanwhile and its worker free.
+ */
+void rocksdb_io_wait(struct rocksdb_io *io)
+{
+	worker_park(&io->done);
+}
+
+/* the oldest submitted read, or NULL */
+static struct rocksdb_io *rocksdb_io_take(void)
+{
+	struct rocksdb_io *io, *next;
+
+	spin_lock(&io_lock);
+	if (!io_taken) {
+		io = __sync_lock_test_and_set(&io_head, NULL);
+		for (; io; io = next) {
+			next = io->next;
+			io->next = io_taken;
+			io_taken = io;
+		}
+	}
+	io = io_taken;
+	if (io)
+		io_taken = io->next;
+	spin_unlock(&io_lock);
+	return io;
+}
+
+static void *rocksdb_io_thread(void *arg)
+{
+	rocksdb_readoptions_t *readoptions = rocksdb_readoptions_create();
+	unsigned int idle = 0;
+	struct rocksdb_io *io;
+	char *val, *err;
+	size_t len;
+
+	/* the reads are on the latency path of the GETs */
+	if (cpu_pin_spare_nice(0) && !arg)
+		log_warn("rocksdb: no spare CPU, the I/O threads share the data plane cores\n");
+
+	while (true) {
+		io = rocksdb_io_take();
+		if (!io) {
+			if (++idle < IO_SPINS)
+				cpu_relax();
+			else
+				usleep(IO_SLEEP_US);
+			continue;
+		}
+		idle = 0;
+
+		err = NULL;
+		val = rocksdb_get(io->db, readoptions, io->key, io->key_len,
+				  &len, &err);
+		io->val = val;
+		io->val_len = len;
+		io->err = err;
+		/* the task may go on and reuse its stack once done */
+		asm volatile("" ::: "memory");
+		io->done = true;
+	}
+	return NULL;
+}
+
+/**
+ * rocksdb_io_init - starts the I/O threads, if enabled
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int rocksdb_io_init(void)
+{
+	pthread_t tid;
+	int i;
+
+	for (i = 0; i < CFG.rocksdb_io_threads; i++) {
+		if (pthread_create(&tid, NULL, rocksdb_io_thread,
+				   (void *) (long) i)) {
+			log_err("rocksdb: unable to create I/O thread %d\n", i);
+			return -EAGAIN;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,102 @@
+/*
+ * search.c - search (posting list intersection) application
+ *
+ * The inverted index is loaded once at startup and shared read-only by all
+ * workers. Each worker owns the scratch buffers used for the intermediate
+ * intersections, so the result handed back to the worker outlives the call.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <ix/stddef.h>
+#include <ix/app.h>
+#include <ix/log.h>
+#include <ix/errno.h>
+#include <ix/dispatch.h>
+#include <ix/intersection.h>
+
+struct search_state {
+	uint64_t intersection_tmp[2][1 + MAX_INSERSECTION_DOCS];
+};
+
+static int search_app_init(void)
+{
+	load_docs();
+	log_info("Search App init: Loaded %d words.\n", word_cnt);
+	return 0;
+}
+
+static int search_app_init_cpu(void **state)
+{
+	struct search_state *s = calloc(1, sizeof(*s));
+	if (!s)
+		return -ENOMEM;
+
+	*state = s;
+	return 0;
+}
+
+static void search_app_warmup(void *state)
+{
+	volatile uint64_t sum = 0;
+	unsigned i, j;
+
+	// Walk every posting list once so the index sits in this core's caches
+	for (i = 0; i < word_cnt; i++) {
+		for (j = 0; j <= word_to_docids[i][0]; j++)
+			sum += word_to_docids[i][j];
+	}
+	(void) state;
+}
+
+static void search_app_handle(void *state, struct message * req,
+			      struct message * resp)
+{
+	struct search_state *s = state;
+	uint64_t query_word_ids[MAX_QUERY_WORDS];
+	uint64_t *intersection_res, *intermediate_res;
+	uint64_t query_word_cnt = req->runNs;
+
+	if (query_word_cnt == 0) {
+		resp->runNs = 0;
+		return;
+	}
+	if (query_word_cnt > MAX_QUERY_WORDS)
+		query_word_cnt = MAX_QUERY_WORDS;
+
+	for (unsigned i = 0; i < query_word_cnt; i++) {
+		query_word_ids[i] = req->app_data[i];
+	}
+	uint32_t word_id_ofst = query_word_ids[0]-1;
+	intersection_res = word_to_docids[word_id_ofst];
+
+	for (unsigned intersection_opr_cnt = 1; intersection_opr_cnt < query_word_cnt; intersection_opr_cnt++) {
+		word_id_ofst = query_word_ids[intersection_opr_cnt]-1;
+		intermediate_res = s->intersection_tmp[intersection_opr_cnt % 2];
+
+		compute_intersection(intersection_res, word_to_docids[word_id_ofst], intermediate_res);
+		intersection_res = intermediate_res;
+
+		if (intersection_res[0] == 0) // stop if the intersection is empty
+			break;
+	}
+
+	// Write additional search result data to pkt
+	uint64_t intersection_size = intersection_res[0];
+	if (intersection_size > ARRAY_SIZE(resp->app_data))
+		intersection_size = ARRAY_SIZE(resp->app_data);
+	resp->runNs = intersection_size;
+	for (unsigned i = 0; i < intersection_size; i++) {
+		resp->app_data[i] = intersection_res[1+i];
+	}
+}
+
+struct app_handler search_app = {
+	.name		= "search",
+	.client_id	= SEARCH_CLIENT,
+	.init		= search_app_init,
+	.init_cpu	= search_app_init_cpu,
+	.warmup		= search_app_warmup,
+	.handle		= search_app_handle,
+};
@@ -0,0 +1,167 @@
+/*
+ * app.c - application handler registry
+ *
+ * All applications linked into Shinjuku are listed in app_tbl. The "apps"
+ * parameter of shinjuku.conf selects which of them are enabled; when it is
+ * missing every registered application is enabled.
+ */
+
+#include <string.h>
+
+#include <ix/app.h>
+#include <ix/cfg.h>
+#include <ix/cpu.h>
+#include <ix/errno.h>
+#include <ix/log.h>
+
+extern struct app_handler rocksdb_app;
+extern struct app_handler search_app;
+
+static struct app_handler *app_tbl[] = {
+	&rocksdb_app,
+	&search_app,
+	NULL
+};
+
+struct app_handler *app_handlers[APP_MAX_HANDLERS];
+int app_count;
+const char *app_class_names[APP_MAX_CLASSES] = { "other" };
+int app_nr_classes = 1;
+__thread void *app_state[APP_MAX_HANDLERS];
+
+static struct app_handler *app_find(const char *name)
+{
+	int i;
+
+	for (i = 0; app_tbl[i]; i++) {
+		if (!strncmp(app_tbl[i]->name, name, APP_NAME_LEN))
+			return app_tbl[i];
+	}
+	return NULL;
+}
+
+static void app_assign_classes(struct app_handler *app)
+{
+	int i, nr = 1;
+
+	if (!app->classes || !app->classes[0])
+		app->classify = NULL;
+	if (app->classify)
+		for (nr = 0; app->classes[nr]; nr++)
+			;
+	if (app_nr_classes + nr > APP_MAX_CLASSES) {
+		log_warn("app: no request class left for %s\n", app->name);
+		app->classify = NULL;
+		app->class_base = 0;
+		return;
+	}
+
+	app->class_base = app_nr_classes;
+	for (i = 0; i < nr; i++)
+		app_class_names[app_nr_classes++] =
+			app->classify ? app->classes[i] : app->name;
+}
+
+static int app_enable(struct app_handler *app)
+{
+	int i;
+
+	for (i = 0; i < app_count; i++) {
+		if (app_handlers[i] == app)
+			return 0;
+		if (app_handlers[i]->client_id == app->client_id) {
+			log_err("app: %s and %s share client id %d\n",
+				app_handlers[i]->name, app->name, app->client_id);
+			return -EINVAL;
+		}
+	}
+	if (app_count >= APP_MAX_HANDLERS)
+		return -E2BIG;
+	app_handlers[app_count++] = app;
+	app_assign_classes(app);
+	return 0;
+}
+
+/**
+ * app_init - enables the configured applications and initializes them
+ *
+ * Must run after cfg and before the worker cores are started.
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int app_init(void)
+{
+	struct app_handler *app;
+	int i, ret;
+
+	if (!CFG.num_apps) {
+		for (i = 0; app_tbl[i]; i++) {
+			ret = app_enable(app_tbl[i]);
+			if (ret)
+				return ret;
+		}
+	}
+
+	for (i = 0; i < CFG.num_apps; i++) {
+		app = app_find(CFG.apps[i]);
+		if (!app) {
+			log_err("app: unknown application '%s'\n", CFG.apps[i]);
+			return -EINVAL;
+		}
+		ret = app_enable(app);
+		if (ret)
+			return ret;
+	}
+
+	for (i = 0; i < app_count; i++) {
+		app = app_handlers[i];
+		if (app->init) {
+			ret = app->init();
+			if (ret) {
+				log_err("app: failed to initialize %s\n", app->name);
+				return ret;
+			}
+		}
+		log_info("app: enabled %s (client id %d)\n", app->name,
+			 app->client_id);
+	}
+	return 0;
+}
+
+/**
+ * app_init_cpu - creates the per-core state of every enabled application
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int app_init_cpu(void)
+{
+	struct app_handler *app;
+	int i, ret;
+
+	for (i = 0; i < app_count; i++) {
+		app = app_handlers[i];
+		app_state[i] = NULL;
+		if (!app->init_cpu)
+			continue;
+		ret = app->init_cpu(&app_state[i]);
+		if (ret) {
+			log_err("app: failed to initialize %s on cpu %d\n",
+				app->name, percpu_get(cpu_id));
+			return ret;
+		}
+	}
+	return 0;
+}
+
+/**
+ * app_warmup - runs the warmup hook of every enabled application
+ */
+void app_warmup(void)
+{
+	int i;
+
+	for (i = 0; i < app_count; i++) {
+		if (app_handlers[i]->warmup)
+			app_handlers[i]->warmup(app_state[i]);
+	}
+}
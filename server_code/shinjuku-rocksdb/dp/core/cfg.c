@@ -38,6 +38,7 @@
 #include <inttypes.h>
 #include <libconfig.h>	/* provides hierarchical config file parsing */
 
+#include <ix/stddef.h>
 #include <ix/errno.h>
 #include <ix/log.h>
 #include <ix/types.h>
@@ -63,14 +64,20 @@ static int parse_port(void);
 static int parse_slo(void);
 static int parse_queue_settings(void);
 static int parse_preemption_delay(void);
+static int parse_batch_size(void);
 static int parse_keep_alive_interval(void);
 static int parse_parent_leaf_id(void);
 static int parse_server_id(void);
+static int parse_idle_signal(void);
 static int parse_gateway_addr(void);
 static int parse_arp(void);
 static int parse_devices(void);
 static int parse_cpu(void);
 static int parse_loader_path(void);
+static int parse_apps(void);
+static int parse_pools(void);
+static int parse_trace(void);
+static int parse_rocksdb(void);
 
 struct config_vector_t {
 	const char *name;
@@ -83,14 +90,20 @@ static struct config_vector_t config_tbl[] = {
 	{ "slo",          parse_slo},
 	{ "queue_settings", parse_queue_settings},
 	{ "preemption_delay", parse_preemption_delay},
+	{ "batch_size",   parse_batch_size},
 	{ "keep_alive_interval", parse_keep_alive_interval},
 	{ "parent_leaf_id", parse_parent_leaf_id},
 	{ "server_id", parse_server_id},
+	{ "idle_signal", parse_idle_signal},
 	{ "gateway_addr", parse_gateway_addr},
 	{ "arp",          parse_arp},
 	{ "devices",      parse_devices},
 	{ "cpu",          parse_cpu},
 	{ "loader_path",  parse_loader_path},
+	{ "apps",         parse_apps},
+	{ "pools",        parse_pools},
+	{ "trace",        parse_trace},
+	{ "rocksdb",      parse_rocksdb},
 	{ NULL,           NULL}
 };
 
@@ -189,6 +202,20 @@ static int parse_preemption_delay(void)
 	return 0;
 }
 
+static int parse_batch_size(void)
+{
+	int val;
+
+	CFG.batch_size = 0;
+
+	if (config_lookup_int(&cfg, "batch_size", &val)) {
+		if (val < 0 || val > CFG_MAX_BATCH)
+			return -EINVAL;
+		CFG.batch_size = val;
+	}
+	return 0;
+}
+
 static int parse_keep_alive_interval(void)
 {
 	const config_setting_t *interval_conf = NULL;
@@ -225,6 +252,27 @@ static int parse_server_id(void)
 	return 0;
 }
 
+static int parse_idle_signal(void)
+{
+	long long val;
+
+	/* standalone idle signals are disabled unless a dwell time is set */
+	CFG.idle_signal_dwell_us = 0;
+	CFG.idle_signal_interval_us = 100;
+
+	if (config_lookup_int64(&cfg, "idle_signal_dwell", &val)) {
+		if (val < 0)
+			return -EINVAL;
+		CFG.idle_signal_dwell_us = (uint64_t) val;
+	}
+	if (config_lookup_int64(&cfg, "idle_signal_interval", &val)) {
+		if (val < 0)
+			return -EINVAL;
+		CFG.idle_signal_interval_us = (uint64_t) val;
+	}
+	return 0;
+}
+
 static int add_port(int port)
 {
 	if (port <= 0 || port > 65534)
@@ -429,6 +477,251 @@ static int parse_loader_path(void)
 	return 0;
 }
 
+static int add_app(const char *app)
+{
+	int i;
+
+	if (!app)
+		return -EINVAL;
+	for (i = 0; i < CFG.num_apps; i++) {
+		if (!strncmp(CFG.apps[i], app, sizeof(CFG.apps[i])))
+			return 0;
+	}
+	if (CFG.num_apps >= CFG_MAX_APPS)
+		return -E2BIG;
+	strncpy(CFG.apps[CFG.num_apps], app, sizeof(CFG.apps[0]));
+	CFG.apps[CFG.num_apps][sizeof(CFG.apps[0]) - 1] = '\0';
+	CFG.num_apps++;
+	return 0;
+}
+
+static int parse_apps(void)
+{
+	const config_setting_t *apps = NULL;
+	const char *app = NULL;
+	int i, ret;
+
+	CFG.num_apps = 0;
+	apps = config_lookup(&cfg, "apps");
+	if (!apps) {
+		log_info("no apps defined in config, enabling all applications\n");
+		return 0;
+	}
+	app = config_setting_get_string(apps);
+	if (app)
+		return add_app(app);
+	for (i = 0; i < config_setting_length(apps); ++i) {
+		app = config_setting_get_string_elem(apps, i);
+		ret = add_app(app);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int parse_trace(void)
+{
+	const char *path = NULL;
+	long long val;
+
+	/* tracing is disabled unless a sampling rate is set */
+	CFG.trace_sample = 0;
+	strcpy(CFG.trace_file, "/tmp/horus.trace");
+
+	if (config_lookup_int64(&cfg, "trace_sample", &val)) {
+		if (val < 0 || val > UINT32_MAX)
+			return -EINVAL;
+		CFG.trace_sample = (uint32_t) val;
+	}
+	if (config_lookup_string(&cfg, "trace_file", &path)) {
+		strncpy(CFG.trace_file, path, sizeof(CFG.trace_file));
+		CFG.trace_file[sizeof(CFG.trace_file) - 1] = '\0';
+	}
+	return 0;
+}
+
+/* copies an optional string setting, -EINVAL if it does not fit */
+static int parse_string(const char *path, char *dst, size_t len)
+{
+	const char *val;
+
+	dst[0] = '\0';
+	if (!config_lookup_string(&cfg, path, &val))
+		return 0;
+	if (strlen(val) >= len)
+		return -EINVAL;
+	strcpy(dst, val);
+	return 0;
+}
+
+static int parse_rocksdb(void)
+{
+	const char *wal;
+	long long val;
+	int flag;
+
+	CFG.rocksdb_session_refresh_us = 1000;
+
+	if (config_lookup_int64(&cfg, "rocksdb.session_refresh", &val)) {
+		if (val < 0)
+			return -EINVAL;
+		CFG.rocksdb_session_refresh_us = (uint64_t) val;
+	}
+	CFG.rocksdb_scan_chunk = 256;
+	if (config_lookup_int64(&cfg, "rocksdb.scan_chunk", &val)) {
+		if (val < 0 || val > UINT32_MAX)
+			return -EINVAL;
+		CFG.rocksdb_scan_chunk = (uint32_t) val;
+	}
+
+	/* the application checks the names and applies the overrides */
+	if (parse_string("rocksdb.profile", CFG.rocksdb_profile,
+			 sizeof(CFG.rocksdb_profile)) ||
+	    parse_string("rocksdb.compression", CFG.rocksdb_compression,
+			 sizeof(CFG.rocksdb_compression)) ||
+	    parse_string("rocksdb.memtable", CFG.rocksdb_memtable,
+			 sizeof(CFG.rocksdb_memtable)))
+		return -EINVAL;
+	CFG.rocksdb_block_cache_mb = -1;
+	if (config_lookup_int64(&cfg, "rocksdb.block_cache_mb", &val)) {
+		if (val < 0)
+			return -EINVAL;
+		CFG.rocksdb_block_cache_mb = val;
+	}
+	CFG.rocksdb_bloom_bits = -1;
+	if (config_lookup_int64(&cfg, "rocksdb.bloom_bits", &val)) {
+		if (val < 0 || val > 64)
+			return -EINVAL;
+		CFG.rocksdb_bloom_bits = (int) val;
+	}
+	CFG.rocksdb_pin_l0 = -1;
+	if (config_lookup_bool(&cfg, "rocksdb.pin_l0", &flag))
+		CFG.rocksdb_pin_l0 = flag;
+	CFG.rocksdb_mmap_reads = -1;
+	if (config_lookup_bool(&cfg, "rocksdb.mmap_reads", &flag))
+		CFG.rocksdb_mmap_reads = flag;
+
+	CFG.rocksdb_group_commit = true;
+	if (config_lookup_bool(&cfg, "rocksdb.group_commit", &flag))
+		CFG.rocksdb_group_commit = flag;
+	CFG.rocksdb_wal = CFG_WAL_SYNC;
+	if (config_lookup_string(&cfg, "rocksdb.wal", &wal)) {
+		if (!strcmp(wal, "sync"))
+			CFG.rocksdb_wal = CFG_WAL_SYNC;
+		else if (!strcmp(wal, "async"))
+			CFG.rocksdb_wal = CFG_WAL_ASYNC;
+		else if (!strcmp(wal, "off"))
+			CFG.rocksdb_wal = CFG_WAL_OFF;
+		else
+			return -EINVAL;
+	}
+
+	CFG.rocksdb_io_threads = 0;
+	if (config_lookup_int64(&cfg, "rocksdb.io_threads", &val)) {
+		if (val < 0 || val > CFG_MAX_IO_THREADS)
+			return -EINVAL;
+		CFG.rocksdb_io_threads = (uint32_t) val;
+	}
+
+	CFG.rocksdb_hot_cache_kb = 0;
+	if (config_lookup_int64(&cfg, "rocksdb.hot_cache_kb", &val)) {
+		if (val < 0 || val > UINT32_MAX)
+			return -EINVAL;
+		CFG.rocksdb_hot_cache_kb = (uint32_t) val;
+	}
+
+	CFG.rocksdb_shards = 0;
+	if (config_lookup_int64(&cfg, "rocksdb.shards", &val)) {
+		if (val < 0 || val > CFG_MAX_SHARDS)
+			return -EINVAL;
+		CFG.rocksdb_shards = (uint32_t) val;
+	}
+	return 0;
+}
+
+#define CFG_POOL_ALIGN		128	/* whole mempool chunks */
+#define CFG_MAX_NUMA_NODES	8
+
+enum {
+	CFG_CONSUMER_DISPATCHER,
+	CFG_CONSUMER_NETWORKER,
+	CFG_CONSUMER_WORKERS,
+};
+
+static const struct {
+	const char *name;
+	uint32_t def;
+	int consumer;
+} cfg_pools[CFG_NR_POOLS] = {
+	[CFG_POOL_TASK]		= { "task",	   768 * 1024, CFG_CONSUMER_DISPATCHER },
+	[CFG_POOL_FRCELL]	= { "frcell",	   768 * 1024, CFG_CONSUMER_DISPATCHER },
+	[CFG_POOL_REQUEST]	= { "request",	   768 * 1024, CFG_CONSUMER_NETWORKER },
+	[CFG_POOL_RQ_CELL]	= { "rq_cell",	   768 * 1024, CFG_CONSUMER_NETWORKER },
+	[CFG_POOL_CONTEXT]	= { "context",	   32 * 1024,  CFG_CONSUMER_DISPATCHER },
+	[CFG_POOL_STACK]	= { "stack",	   32 * 1024,  CFG_CONSUMER_WORKERS },
+	[CFG_POOL_RESPONSE]	= { "response",	   128000,     CFG_CONSUMER_WORKERS },
+	[CFG_POOL_KA_RESPONSE]	= { "keep_alive",  128000,     CFG_CONSUMER_NETWORKER },
+};
+
+static int parse_pools(void)
+{
+	char path[64];
+	long long val;
+	int i;
+
+	for (i = 0; i < CFG_NR_POOLS; i++) {
+		CFG.pool_size[i] = cfg_pools[i].def;
+		snprintf(path, sizeof(path), "pools.%s", cfg_pools[i].name);
+		if (!config_lookup_int64(&cfg, path, &val))
+			continue;
+		if (val <= 0 || val > INT32_MAX - CFG_POOL_ALIGN) {
+			log_err("cfg: invalid size %lld for pool %s\n", val,
+				cfg_pools[i].name);
+			return -EINVAL;
+		}
+		CFG.pool_size[i] = align_up(val, CFG_POOL_ALIGN);
+	}
+	return 0;
+}
+
+const char *cfg_pool_name(int pool)
+{
+	return cfg_pools[pool].name;
+}
+
+/**
+ * cfg_pool_numa_node - determines the NUMA node a pool should live on
+ * @pool: the pool (CFG_POOL_*)
+ *
+ * Pools are placed on the node of the cores that use them. For pools used
+ * by the workers this is the node most of the worker cores are on.
+ *
+ * Returns the node.
+ */
+int cfg_pool_numa_node(int pool)
+{
+	int votes[CFG_MAX_NUMA_NODES] = { 0 };
+	int i, node, best = 0;
+
+	switch (cfg_pools[pool].consumer) {
+	case CFG_CONSUMER_DISPATCHER:
+		return cpu_numa_node_of(CFG.cpu[CFG_CPU_DISPATCHER_INDEX]);
+	case CFG_CONSUMER_NETWORKER:
+		return cpu_numa_node_of(CFG.cpu[CFG_CPU_NETWORKER_INDEX]);
+	}
+
+	if (CFG.num_cpus <= CFG_CPU_NETWORKER_INDEX + 1)
+		return cpu_numa_node_of(CFG.cpu[CFG_CPU_DISPATCHER_INDEX]);
+	for (i = CFG_CPU_NETWORKER_INDEX + 1; i < CFG.num_cpus; i++) {
+		node = cpu_numa_node_of(CFG.cpu[i]);
+		if (node >= CFG_MAX_NUMA_NODES)
+			continue;
+		if (++votes[node] > votes[best])
+			best = node;
+	}
+	return best;
+}
+
 static int parse_conf_file(const char *path)
 {
 	int ret, i;
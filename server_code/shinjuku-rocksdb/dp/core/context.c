@@ -24,51 +24,90 @@
  * context.c - context management
  */
 
-#include <ucontext.h>
+#include <sys/mman.h>
 
 #include <ix/stddef.h>
 #include <ix/context.h>
 #include <ix/mempool.h>
+#include <ix/mcache.h>
+#include <ix/mem.h>
+#include <ix/vm.h>
+#include <ix/cpu.h>
+#include <ix/cfg.h>
+#include <ix/log.h>
+#include <ix/errno.h>
 
-#define CONTEXT_CAPACITY    32 * 1024
-#define STACK_CAPACITY      32 * 1024
-#define STACK_SIZE          16384
+#ifdef CONTEXT_GUARD_PAGES
 
-static int context_init_mempool(void)
+/*
+ * Guarded stacks live on 4KB pages: each slot is a guard page followed by the
+ * stack, and the guard page is unmapped so an overflow faults instead of
+ * silently corrupting the neighbouring stack.
+ */
+static int stack_init_guarded(void)
 {
-        struct mempool *m = &context_pool;
-        return mempool_create(m, &context_datastore, MEMPOOL_SANITY_GLOBAL, 0);
-}
+        size_t slot = CONTEXT_GUARD_SIZE + CONTEXT_STACK_SIZE;
+        int pages_per_slot = slot / PGSIZE_4KB;
+        int nr = CFG.pool_size[CFG_POOL_STACK];
+        int node = cfg_pool_numa_node(CFG_POOL_STACK);
+        char *base, *guard;
+        int i, ret;
 
-static int stack_init_mempool(void)
-{
-        struct mempool *m = &stack_pool;
-        return mempool_create(m, &stack_datastore, MEMPOOL_SANITY_GLOBAL, 0);
+        ret = mcache_init(&stack_cache, nr, cfg_pool_name(CFG_POOL_STACK),
+                          node);
+        if (ret)
+                return ret;
+
+        base = mem_alloc_pages_onnode(nr * pages_per_slot, PGSIZE_4KB, node,
+                                      MPOL_BIND);
+        if (base == MAP_FAILED)
+                return -ENOMEM;
+
+        mcache_set_layout(&stack_cache, base + CONTEXT_GUARD_SIZE, slot, 0);
+        for (i = nr - 1; i >= 0; i--) {
+                guard = base + i * slot;
+                vm_unmap(guard, 1, PGSIZE_4KB);
+                mcache_seed(&stack_cache, guard + CONTEXT_GUARD_SIZE);
+        }
+        stack_cache.own_len = (size_t) nr * slot;
+        log_info("context: %d stacks with guard pages, %lu MB on node %d\n",
+                 nr, (size_t) nr * slot >> 20, node);
+        return 0;
 }
 
+#endif
+
 /**
  * context_init - allocates global context and stack datastores
  */
 int context_init(void)
 {
         int ret;
-        ret = mempool_create_datastore(&context_datastore, CONTEXT_CAPACITY,
-                                       sizeof(ucontext_t), 1,
-                                       MEMPOOL_DEFAULT_CHUNKSIZE,
-                                       "context");
+        ret = mempool_create_datastore_onnode(&context_datastore,
+                                              CFG.pool_size[CFG_POOL_CONTEXT],
+                                              sizeof(struct context), 1,
+                                              MEMPOOL_DEFAULT_CHUNKSIZE,
+                                              cfg_pool_name(CFG_POOL_CONTEXT),
+                                              cfg_pool_numa_node(CFG_POOL_CONTEXT));
         if (ret)
                 return ret;
 
-        ret = context_init_mempool();
+        ret = mcache_create(&context_cache, &context_datastore);
         if (ret)
                 return ret;
 
-        ret = mempool_create_datastore(&stack_datastore, STACK_CAPACITY,
-                                       STACK_SIZE, 1, MEMPOOL_DEFAULT_CHUNKSIZE,
-                                       "stack");
+#ifdef CONTEXT_GUARD_PAGES
+        return stack_init_guarded();
+#else
+        ret = mempool_create_datastore_onnode(&stack_datastore,
+                                              CFG.pool_size[CFG_POOL_STACK],
+                                              CONTEXT_STACK_SIZE, 1,
+                                              MEMPOOL_DEFAULT_CHUNKSIZE,
+                                              cfg_pool_name(CFG_POOL_STACK),
+                                              cfg_pool_numa_node(CFG_POOL_STACK));
         if (ret)
                 return ret;
 
-        ret = stack_init_mempool();
-        return ret;
+        return mcache_create(&stack_cache, &stack_datastore);
+#endif
 }
@@ -29,12 +29,14 @@
 
 #include <unistd.h>
 #include <sched.h>
+#include <sys/resource.h>
 #include <sys/syscall.h>
 
 #include <ix/stddef.h>
 #include <ix/errno.h>
 #include <ix/log.h>
 #include <ix/cpu.h>
+#include <ix/cfg.h>
 #include <ix/mem.h>
 
 int cpu_count;
@@ -206,6 +208,61 @@ int cpu_init_one(unsigned int cpu)
 	return 0;
 }
 
+/**
+ * cpu_numa_node_of - determines the NUMA node of a CPU
+ * @cpu: the CPU id, does not need to be started yet
+ *
+ * Returns the node, or 0 if it is unknown.
+ */
+int cpu_numa_node_of(unsigned int cpu)
+{
+	int node = numa_node_of_cpu(cpu);
+
+	return node < 0 ? 0 : node;
+}
+
+/**
+ * cpu_pin_spare_nice - moves a helper thread out of the way of the data plane
+ * @nice: the nice value of the thread, 0 keeps the inherited one
+ *
+ * Restricts the calling thread to the CPUs not listed in the "cpu"
+ * configuration. For threads that do not enter Dune. Helpers on the latency
+ * path of requests pass 0: lowering the nice value back needs CAP_SYS_NICE.
+ *
+ * Returns 0 if successful, otherwise fail (no spare CPU).
+ */
+int cpu_pin_spare_nice(int nice)
+{
+	cpu_set_t set;
+	int i;
+
+	if (nice && setpriority(PRIO_PROCESS, 0, nice))
+		log_warn("cpu: cannot set the nice value of a helper thread to %d\n",
+			 nice);
+
+	CPU_ZERO(&set);
+	for (i = 0; i < cpu_count; i++)
+		CPU_SET(i, &set);
+	for (i = 0; i < CFG.num_cpus; i++)
+		CPU_CLR(CFG.cpu[i], &set);
+	if (!CPU_COUNT(&set))
+		return -ENOENT;
+	return sched_setaffinity(0, sizeof(set), &set) ? -EINVAL : 0;
+}
+
+/**
+ * cpu_pin_spare - moves a background helper thread out of the way
+ *
+ * Like cpu_pin_spare_nice(), with the lowest scheduling priority. For the
+ * trace and log drainers.
+ *
+ * Returns 0 if successful, otherwise fail (no spare CPU).
+ */
+int cpu_pin_spare(void)
+{
+	return cpu_pin_spare_nice(19);
+}
+
 /**
  * cpu_init - initializes CPU support
  *
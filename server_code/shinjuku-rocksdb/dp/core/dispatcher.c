@@ -30,6 +30,10 @@
 #include <ix/cfg.h>
 #include <ix/context.h>
 #include <ix/dispatch.h>
+#include <ix/kstats.h>
+#include <ix/probe.h>
+#include <ix/stats.h>
+#include <ix/trace.h>
 
 extern void dune_apic_send_posted_ipi(uint8_t vector, uint32_t dest_core);
 
@@ -49,13 +53,32 @@ static void preempt_check_init(int num_workers)
                 preempt_check[i] = false;
 }
 
-static inline void handle_finished(int i)
+/*
+ * HORUS: Completes the requests that were served in a batch after @req, each
+ * of them counts in the worker queue length.
+ */
+static inline void finish_batch(struct request * req, uint8_t core_id)
+{
+    struct request * next;
+
+    for (req = req->batch_next; req; req = next) {
+        next = req->batch_next;
+        --queue_length[core_id];
+        PROBE(finished, req, core_id, queue_length[core_id]);
+        request_enqueue(&frqueue, req);
+        STATS_INC(COMPLETED);
+    }
+}
+
+static inline void handle_finished(int i, uint64_t cur_time)
 {
     uint8_t core_id;
+    core_id = worker_responses[i].type;
     if (worker_responses[i].req == NULL)
             log_warn("No mbuf was returned from worker\n");
+    else
+            finish_batch(worker_responses[i].req, core_id);
     context_free(worker_responses[i].rnbl);
-    core_id = worker_responses[i].type;
     // HORUS: Task finished, decrement worker queue len
     --queue_length[core_id];
     /* 
@@ -66,12 +89,21 @@ static inline void handle_finished(int i)
     if (queue_length[core_id] == 0 && (worker_state[core_id] > 0)){
         worker_state[core_id] -= 1;
     }
+    // HORUS: Start of an idle period, networker may signal it after the dwell time
+    if (queue_length[core_id] == 0)
+        idle_signals[core_id].idle_since = cur_time;
+    PROBE(finished, worker_responses[i].req, core_id, queue_length[core_id]);
     request_enqueue(&frqueue, (struct request *) worker_responses[i].req);
+    STATS_INC(COMPLETED);
     preempt_check[i] = false;
     worker_responses[i].flag = PROCESSED;
 }
 
-static inline void handle_preempted(int i)
+/*
+ * A task that yielded goes back to the tail of its queue, after the requests
+ * that arrived while it ran.
+ */
+static inline void handle_preempted(int i, bool yielded)
 {
         void * rnbl;
 	struct request * req;
@@ -83,16 +115,117 @@ static inline void handle_preempted(int i)
         category = worker_responses[i].category;
         type = worker_responses[i].type;
         timestamp = worker_responses[i].timestamp;
-	if (CFG.queue_settings[type]) {
+	if (CFG.queue_settings[type] && !yielded) {
 		tskq_enqueue_head(&tskq[type], rnbl, req, type, category, timestamp);
 	} else {
 		tskq_enqueue_tail(&tskq[type], rnbl, req, type, category, timestamp);
 	}
+        PROBE(preempted, req, type, queue_length[type]);
+        STATS_INC(REQUEUED);
+        preempt_check[i] = false;
+        worker_responses[i].flag = PROCESSED;
+}
+
+/*
+ * Tasks waiting in worker_park(), oldest first. They leave their worker free
+ * for other requests but still count in its queue length, as they have yet
+ * to reply.
+ */
+static struct task_queue parkq;
+
+static inline void handle_parked(int i)
+{
+        struct request * req = worker_responses[i].req;
+        struct task * tsk = mcache_alloc(&task_cache);
+
+        if (unlikely(!tsk)) {
+                // Cannot keep it aside: worker_park() parks it again
+                handle_preempted(i, true);
+                return;
+        }
+        mcache_tag(&task_cache, tsk, req);
+        tsk->runnable = worker_responses[i].rnbl;
+        tsk->req = req;
+        tsk->type = worker_responses[i].type;
+        tsk->category = worker_responses[i].category;
+        tsk->timestamp = worker_responses[i].timestamp;
+        tsk->wake = worker_responses[i].wake;
+        tsk->next = NULL;
+        if (parkq.head != NULL)
+                parkq.tail->next = tsk;
+        else
+                parkq.head = tsk;
+        parkq.tail = tsk;
+        ++park_length[tsk->type];
         preempt_check[i] = false;
         worker_responses[i].flag = PROCESSED;
 }
 
-static inline void dispatch_request(int i, uint64_t cur_time)
+/*
+ * Puts the parked tasks whose event happened back at the head of their
+ * queue, they already waited for it. Returns true if any resumed.
+ */
+static inline bool handle_parkq(void)
+{
+        struct task ** p = &parkq.head;
+        struct task * tsk, * last = NULL;
+        bool busy = false;
+
+        while ((tsk = *p) != NULL) {
+                if (!*tsk->wake) {
+                        last = tsk;
+                        p = &tsk->next;
+                        continue;
+                }
+                *p = tsk->next;
+                --park_length[tsk->type];
+                tskq_enqueue_head(&tskq[tsk->type], tsk->runnable, tsk->req,
+                                  tsk->type, tsk->category, tsk->timestamp);
+                PROBE(preempted, tsk->req, tsk->type, queue_length[tsk->type]);
+                STATS_INC(REQUEUED);
+                mcache_free(&task_cache, tsk);
+                busy = true;
+        }
+        parkq.tail = last;
+        return busy;
+}
+
+/*
+ * HORUS: Chains the new packets of the same batch at the head of worker i's
+ * queue to @req, up to batch_size requests. They run in the context of @req,
+ * so their own contexts are freed here.
+ */
+static inline void dispatch_batch(int i, struct request * req,
+                                  uint64_t cur_time)
+{
+    struct request * last = req, * next;
+    void * rnbl;
+    uint8_t type, category;
+    uint64_t timestamp;
+    int n = 1;
+
+    while (n < CFG.batch_size && tskq_peek_batch(&tskq[i], req->batch_id)) {
+        tskq_dequeue(&tskq[i], &rnbl, &next, &type, &category, &timestamp);
+        context_free(rnbl);
+        next->enqueued = timestamp;
+        last->batch_next = next;
+        last = next;
+        n++;
+        STATS_INC(DISPATCHED);
+        PROBE(dispatch, next, i, queue_length[i], cur_time - timestamp,
+              category);
+        KSTATS_LAT_RECORD(KSTATS_LAT_QUEUE, i, next->lat_class,
+                          cur_time - timestamp);
+        if (unlikely(next->trace_id))
+            trace_emit(next->trace_id, TRACE_DISPATCH, cur_time, i);
+    }
+    if (n > 1) {
+        STATS_INC(BATCHES);
+        STATS_ADD(BATCHED, n);
+    }
+}
+
+static inline int dispatch_request(int i, uint64_t cur_time)
 {
     void * rnbl;
 	struct request * req;
@@ -109,7 +242,7 @@ static inline void dispatch_request(int i, uint64_t cur_time)
     */
     if(naive_tskq_dequeue(tskq, &rnbl, &req, &type,
                           &category, &timestamp, (uint8_t)i))
-            return;
+            return 0;
     // NOTE: changes the worker stat to RUNNING (Busy) So the parent loop won't call this function no more (until flag changes)
     worker_responses[i].flag = RUNNING;
     // NOTE: Fill the dispatcher_request array for this worker, with regards to data that we took from taskq
@@ -118,9 +251,20 @@ static inline void dispatch_request(int i, uint64_t cur_time)
     dispatcher_requests[i].type = type;
     dispatcher_requests[i].category = category;
     dispatcher_requests[i].timestamp = timestamp;
+    if (category == PACKET && req->batch_id)
+            dispatch_batch(i, req, cur_time);
+    dispatcher_requests[i].next = tskq_peek_packet(&tskq[i]);
     timestamps[i] = cur_time;
     preempt_check[i] = true;
+    STATS_INC(DISPATCHED);
+    PROBE(dispatch, req, i, queue_length[i], cur_time - timestamp, category);
+    if (category == PACKET)
+            KSTATS_LAT_RECORD(KSTATS_LAT_QUEUE, i, req->lat_class,
+                              cur_time - timestamp);
+    if (unlikely(req->trace_id))
+            trace_emit(req->trace_id, TRACE_DISPATCH, cur_time, i);
     dispatcher_requests[i].flag = ACTIVE;
+    return 1;
 }
 
 static inline void preempt_worker(int i, uint64_t cur_time)
@@ -132,18 +276,33 @@ static inline void preempt_worker(int i, uint64_t cur_time)
         }
 }
 
-static inline void handle_worker(int i, uint64_t cur_time)
+/*
+ * Returns true if the worker needed attention: a finished or preempted task,
+ * or a new dispatch.
+ */
+static inline bool handle_worker(int i, uint64_t cur_time)
 {
+        bool busy = false;
+
         if (worker_responses[i].flag != RUNNING) { // NOTE: Worker is not executing anything...
                 if (worker_responses[i].flag == FINISHED) {
-                        handle_finished(i);
+                        handle_finished(i, cur_time);
+                        busy = true;
                 } else if (worker_responses[i].flag == PREEMPTED) {
-                        handle_preempted(i);
+                        handle_preempted(i, false);
+                        busy = true;
+                } else if (worker_responses[i].flag == YIELDED) {
+                        handle_preempted(i, true);
+                        busy = true;
+                } else if (worker_responses[i].flag == PARKED) {
+                        handle_parked(i);
+                        busy = true;
                 }
-                dispatch_request(i, cur_time);  // Dispatch for worker i (i is core number)
+                busy |= dispatch_request(i, cur_time);  // Dispatch for worker i (i is core number)
         } 
         //else
                 //preempt_worker(i, cur_time);
+        return busy;
 }
 
 /*
@@ -151,24 +310,34 @@ static inline void handle_worker(int i, uint64_t cur_time)
  * Here this function takes those elements and enqueues task objects into the taskq[] 
  * Racksched has different tasqs for types of packets, we use these different queues for different workers
 */
-static inline void handle_networker(uint64_t cur_time)
+/*
+ * Returns the cycles spent on new requests, 0 if the networker had none.
+ */
+static inline uint64_t handle_networker(uint64_t cur_time)
 {
         int i, ret;
         uint8_t core_id;
-        ucontext_t * cont;
+        struct context * cont;
+        uint64_t start;
 
         if (networker_pointers.cnt != 0) {
+                start = rdtsc();
                 for (i = 0; i < networker_pointers.cnt; i++) {
                         ret = context_alloc(&cont);
                         if (unlikely(ret)) {
                                 //log_warn("Cannot allocate context\n");
                                 request_enqueue(&frqueue, networker_pointers.reqs[i]);
+                                STATS_INC(DROPS);
                                 continue;
                         }
                         core_id = networker_pointers.types[i];
 			            // HORUS: increment worker queue len 
                         ++queue_length[core_id];
+                        // HORUS: Worker is busy again
+                        idle_signals[core_id].idle_since = 0;
                         struct request *req = networker_pointers.reqs[i];
+                        mcache_tag(&context_cache, cont, req);
+                        mcache_tag(&stack_cache, cont->stack, req);
                         //log_info("WORKER %d REQTYPE %d", core_id, req->type);
                         if (req->type == WORKER_STATE_IDLE && worker_state[core_id] == 0) { 
                             // HORUS: WORKER_STATE_IDLE means leaf selected this worker based on idle selection.
@@ -176,9 +345,17 @@ static inline void handle_networker(uint64_t cur_time)
                             // We keep this state so worker will re-send an idle signal when idle (in worker.c)
                             worker_state[core_id] = 1;
                         }
+                        // HORUS: Leaf popped the worker, its next idle period needs a new signal
+                        if (req->type == WORKER_STATE_IDLE)
+                                idle_signals[core_id].announced = 0;
                         tskq_enqueue_tail(&tskq[core_id], cont,
                                           networker_pointers.reqs[i],
                                           core_id, PACKET, cur_time);
+                        STATS_INC(ENQUEUED);
+                        PROBE(enqueue, req, core_id, queue_length[core_id]);
+                        if (unlikely(req->trace_id))
+                                trace_emit(req->trace_id, TRACE_ENQUEUE,
+                                           cur_time, core_id);
                 }
 
                 for (i = 0; i < ETH_RX_MAX_BATCH; i++) {
@@ -189,7 +366,9 @@ static inline void handle_networker(uint64_t cur_time)
                         networker_pointers.free_cnt++;
                 }
                 networker_pointers.cnt = 0;
+                return rdtsc() - start;
         }
+        return 0;
 }
 
 /**
@@ -201,16 +380,34 @@ static inline void handle_networker(uint64_t cur_time)
 void do_dispatching(int num_cpus)
 {
         int i;
-        uint64_t cur_time;
+        bool busy = false;
+        uint64_t cur_time, last_loop, net_cycles = 0;
 
         preempt_check_init(num_cpus - 2);
         timestamp_init(num_cpus - 2);
+        last_loop = rdtsc();
         
         while(1) {
                 cur_time = rdtsc();
+                // Loop accounting of the previous iteration, no extra TSC read when idle
+                if (busy) {
+                        STATS_INC(DISP_BUSY_LOOPS);
+                        STATS_ADD(DISP_NET_CYCLES, net_cycles);
+                        STATS_ADD(DISP_WORKER_CYCLES, cur_time - last_loop - net_cycles);
+                } else {
+                        STATS_INC(DISP_IDLE_LOOPS);
+                        STATS_ADD(DISP_IDLE_CYCLES, cur_time - last_loop);
+                }
+                last_loop = cur_time;
+                busy = false;
+
+                if (parkq.head != NULL)
+                        busy |= handle_parkq();
                 for (i = 0; i < num_cpus - 2; i++)
-                        handle_worker(i, cur_time);
-                handle_networker(cur_time);
+                        busy |= handle_worker(i, cur_time);
+                net_cycles = handle_networker(cur_time);
+                busy |= net_cycles != 0;
+                stats_publish(cur_time);
         }
 }
 
@@ -47,7 +47,8 @@
 #include <ix/drivers.h>
 #include <ix/context.h>
 #include <ix/dispatch.h>
-#include <ix/rocksdb.h>
+#include <ix/app.h>
+#include <ix/stats.h>
 
 
 #include <asm/cpu.h>
@@ -92,14 +93,13 @@ extern int taskqueue_init(void);
 extern int request_init(void);
 extern int response_init(void);
 extern int response_init_cpu(void);
+extern int ka_response_init(void);
+extern int trace_init(void);
 extern int context_init(void);
 extern void do_work(void);
 extern void do_networking(void);
 extern void do_dispatching(int num_cpus);
 
-extern struct mempool context_pool;
-extern struct mempool stack_pool;
-
 // Flag that controls whether interrupts are disabled during memory allocation.
 uint8_t flag;
 
@@ -123,7 +123,16 @@ static struct init_vector_t init_tbl[] = {
 	{ "taskqueue", taskqueue_init, NULL, NULL},      // after firstcpu
 	{ "request", request_init, NULL, NULL},      // after firstcpu
 	{ "response", response_init, response_init_cpu, NULL},
+	{ "ka_response", ka_response_init, NULL, NULL},
 	{ "context", context_init, NULL},
+	{ "app",     app_init,     NULL, NULL},               // after cfg, before hw
+	{ "stats",   stats_init,   NULL, NULL},               // after app
+	{ "membudget", mempool_print_budget, NULL, NULL},     // after all datastores
+	{ "trace",   trace_init,   NULL, NULL},               // after firstcpu
+	{ "log",     log_init,     log_init_cpu, NULL},       // after firstcpu, before hw
+#ifdef ENABLE_KSTATS
+	{ "kstats_lat", kstats_lat_init, NULL, NULL},         // after stats
+#endif
         { "ethdev", init_ethdev, NULL, NULL},
         { "tx_queue", NULL, init_tx_queues, NULL},
 	{ "hw",      init_hw,      NULL, NULL},               // spaws per-cpu init sequence
@@ -274,11 +283,15 @@ static int init_network_cpu(void)
 /**
  * init_create_cpu - initializes a CPU
  * @cpu: the CPU number
- * @eth: the ethernet device to assign to this CPU
+ * @nr: the index of the CPU in CFG.cpu
+ * @first: whether this is the first CPU, set up by init_firstcpu()
+ *
+ * The index is assigned before the percpu phase, so that per-core modules
+ * (log rings, kstats) can use percpu_get(cpu_nr) in their fcpu hooks.
  *
  * Returns 0 if successful, otherwise fail.
  */
-static int init_create_cpu(unsigned int cpu, int first)
+static int init_create_cpu(unsigned int cpu, unsigned int nr, int first)
 {
 	int ret = 0, i;
 
@@ -290,6 +303,8 @@ static int init_create_cpu(unsigned int cpu, int first)
 		return ret;
 	}
 
+	percpu_get(cpu_nr) = nr;
+
 	log_info("init: percpu phase %d\n", cpu);
 	for (i = 0; init_tbl[i].name; i++) {
 		if (init_tbl[i].fcpu) {
@@ -313,7 +328,7 @@ void *start_cpu(void *arg)
 	unsigned int cpu_nr_ = (unsigned int)(unsigned long) arg;
 	unsigned int cpu = CFG.cpu[cpu_nr_];
 
-        ret = init_create_cpu(cpu, 0);
+        ret = init_create_cpu(cpu, cpu_nr_, 0);
 	if (ret) {
 		log_err("init: failed to initialize CPU %d\n", cpu);
 		exit(ret);
@@ -321,8 +336,6 @@ void *start_cpu(void *arg)
 
 	/* percpu_get(cp_cmd) of the first CPU is initialized in init_hw. */
 
-	percpu_get(cpu_nr) = cpu_nr_;
-
         log_info("start_cpu: starting cpu-specific work\n");
         if (cpu_nr_ == 1) {
                 ret = init_rx_queue();
@@ -363,14 +376,12 @@ static int init_hw(void)
 	pthread_t tid;
 
 	// will spawn per-cpu initialization sequence on CPU0
-	ret = init_create_cpu(CFG.cpu[0], 1);
+	ret = init_create_cpu(CFG.cpu[0], 0, 1);
 	if (ret) {
 		log_err("init: failed to create CPU 0\n");
 		return ret;
 	}
 
-	percpu_get(cpu_nr) = 0;
-
 	for (i = 1; i < CFG.num_cpus; i++) {
 		ret = pthread_create(&tid, NULL, start_cpu, (void *)(unsigned long) i);
 		if (ret) {
@@ -440,30 +451,6 @@ int main(int argc, char *argv[])
         }
         log_info("init done\n");
 
-	// Initialize RocksDB
-	rocksdb_options_t *options = rocksdb_options_create();
-	rocksdb_options_set_allow_mmap_reads(options, 1);
-	rocksdb_options_set_allow_mmap_writes(options, 1);
-	rocksdb_slicetransform_t * prefix_extractor = rocksdb_slicetransform_create_fixed_prefix(8);
-	rocksdb_options_set_prefix_extractor(options, prefix_extractor);
-	rocksdb_options_set_plain_table_factory(options, 0, 10, 0.75, 3);
-        // Optimize RocksDB. This is the easiest way to
-        // get RocksDB to perform well
-	rocksdb_options_increase_parallelism(options, 0);
-	rocksdb_options_optimize_level_style_compaction(options, 0);
-	// create the DB if it's not already present
-	rocksdb_options_set_create_if_missing(options, 1);
-
-	// open DB
-	char *err = NULL;
-	/*
-	 NOTE: this DB is created by db/create_db.c program, 
-	 Our run scripts Makes create_db program and runs it.
-	 build_and_run.sh: copies the created db to this path. 
-	*/
-	char DBPath[] = "/tmp/my_db";
-	db = rocksdb_open(options, DBPath, &err);
-	assert(!err);
 	flag = 1;
 
         do_dispatching(CFG.num_cpus);
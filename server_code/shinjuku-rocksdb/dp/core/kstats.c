@@ -31,13 +31,18 @@
 
 
 #include <stdio.h>
+#include <string.h>
 #include <strings.h>
 #include <unistd.h>
 #include <linux/perf_event.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/syscall.h>
+#include <ix/errno.h>
 #include <ix/kstats.h>
 #include <ix/log.h>
+#include <ix/mem.h>
+#include <ix/stats.h>
 #include <ix/timer.h>
 
 #define KSTATS_INTERVAL (5 * ONE_SECOND)
@@ -52,6 +57,38 @@ DEFINE_PERCPU(int, hw_instructions_fd);
 
 static DEFINE_PERCPU(struct timer, _kstats_timer);
 
+__thread struct perf_event_mmap_page *kstats_pmc_page[KSTATS_PMC_NR];
+__thread uint64_t kstats_pmc_start[KSTATS_PMC_NR];
+__thread bool kstats_pmc_hw;
+
+struct kstats_lat *kstats_lat[CFG_MAX_CPU];
+/* what kstats_lat_report() saw last time, per worker */
+static struct kstats_lat *kstats_lat_prev[CFG_MAX_CPU];
+static int kstats_lat_workers;
+
+static const char *kstats_lat_names[KSTATS_LAT_NR] = {
+	[KSTATS_LAT_QUEUE]	= "queue",
+	[KSTATS_LAT_SERVICE]	= "service",
+	[KSTATS_LAT_SOJOURN]	= "sojourn",
+};
+
+static const struct perf_event_attr kstats_pmc_attr[KSTATS_PMC_NR] = {
+	[KSTATS_PMC_INSTRUCTIONS] = {
+		.type = PERF_TYPE_HARDWARE,
+		.config = PERF_COUNT_HW_INSTRUCTIONS,
+	},
+	[KSTATS_PMC_CYCLES] = {
+		.type = PERF_TYPE_HARDWARE,
+		.config = PERF_COUNT_HW_CPU_CYCLES,
+	},
+	[KSTATS_PMC_LLC_MISSES] = {
+		.type = PERF_TYPE_HW_CACHE,
+		.config = (PERF_COUNT_HW_CACHE_LL) |
+			  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+			  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+	},
+};
+
 void kstats_enter(kstats_distr *n, kstats_accumulate *saved_accu)
 {
 	kstats_distr *old = percpu_get(_kstats_accumulate).cur;
@@ -209,6 +246,50 @@ static int init_perf_event(struct perf_event_attr *attr)
 	return fd;
 }
 
+/**
+ * kstats_pmc_init_worker - opens the per-class counters of a worker
+ * @worker: the worker index of the calling core
+ *
+ * The events are pinned so they stay on the PMU and mapped so
+ * kstats_pmc_read() can use rdpmc. Failing that, the worker only counts
+ * tasks and TSC cycles. Called by the worker itself once it knows its index.
+ */
+void kstats_pmc_init_worker(int worker)
+{
+	struct perf_event_attr attr;
+	struct perf_event_mmap_page *pc;
+	int i, fd;
+
+	for (i = 0; i < KSTATS_PMC_NR; i++) {
+		attr = kstats_pmc_attr[i];
+		attr.size = sizeof(attr);
+		attr.pinned = 1;
+		fd = perf_event_open(&attr, 0, -1, -1, 0);
+		if (fd < 0)
+			goto fail;
+		pc = mmap(NULL, PGSIZE_4KB, PROT_READ, MAP_SHARED, fd, 0);
+		/* the mapping keeps the event */
+		close(fd);
+		if (pc == MAP_FAILED)
+			goto fail;
+		kstats_pmc_page[i] = pc;
+		if (!pc->cap_user_rdpmc || !pc->index)
+			goto fail;
+	}
+	kstats_pmc_hw = true;
+	kstats_lat[worker]->pmc_hw = 1;
+	return;
+
+fail:
+	log_warn("kstats: no user space PMU access on worker %d, counting "
+		 "tasks and TSC cycles only\n", worker);
+	for (i = 0; i < KSTATS_PMC_NR; i++) {
+		if (kstats_pmc_page[i])
+			munmap(kstats_pmc_page[i], PGSIZE_4KB);
+		kstats_pmc_page[i] = NULL;
+	}
+}
+
 int kstats_init_cpu(void)
 {
 	struct perf_event_attr llc_load_misses_attr = {.type = PERF_TYPE_HW_CACHE, .config = (PERF_COUNT_HW_CACHE_LL) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)};
@@ -222,3 +303,199 @@ int kstats_init_cpu(void)
 	return 0;
 }
 
+
+void kstats_hist_merge(struct kstats_hist *dst, const struct kstats_hist *src)
+{
+	int i;
+
+	dst->count += src->count;
+	dst->sum += src->sum;
+	for (i = 0; i < KSTATS_HIST_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+}
+
+void kstats_hist_sub(struct kstats_hist *dst, const struct kstats_hist *src)
+{
+	int i;
+
+	dst->count -= src->count;
+	dst->sum -= src->sum;
+	for (i = 0; i < KSTATS_HIST_BUCKETS; i++)
+		dst->buckets[i] -= src->buckets[i];
+}
+
+/**
+ * kstats_hist_percentile - finds a percentile of a histogram
+ * @h: the histogram
+ * @p: the percentile, between 0 and 100
+ *
+ * Returns the lower bound of the bucket holding the percentile, or 0 if the
+ * histogram is empty.
+ */
+uint64_t kstats_hist_percentile(const struct kstats_hist *h, double p)
+{
+	uint64_t total = 0, seen = 0, rank;
+	int i;
+
+	/* the writer may be ahead of count, trust the buckets */
+	for (i = 0; i < KSTATS_HIST_BUCKETS; i++)
+		total += h->buckets[i];
+	if (!total)
+		return 0;
+
+	rank = (uint64_t) (total * p / 100.0);
+	if (rank >= total)
+		rank = total - 1;
+	for (i = 0; i < KSTATS_HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen > rank)
+			break;
+	}
+	return kstats_hist_value(i);
+}
+
+/**
+ * kstats_lat_init - places the latency histograms of the workers
+ *
+ * The histograms live in the shared memory statistics region, on the node of
+ * their worker. Must run after stats.
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int kstats_lat_init(void)
+{
+	size_t len = sizeof(struct kstats_lat);
+	struct bitmask *mask;
+	int i;
+
+	kstats_lat_workers = CFG.num_cpus - 2;
+	for (i = 0; i < kstats_lat_workers; i++) {
+		kstats_lat[i] = stats_shm_hist(i);
+		kstats_lat_prev[i] = calloc(1, len);
+		if (!kstats_lat[i] || !kstats_lat_prev[i])
+			return -ENOMEM;
+
+		mask = numa_allocate_nodemask();
+		numa_bitmask_setbit(mask, cpu_numa_node_of(CFG.cpu[i + 2]));
+		if (mbind(kstats_lat[i], align_up(len, PGSIZE_4KB),
+			  MPOL_PREFERRED, mask->maskp, mask->size, 0))
+			log_warn("kstats: cannot place the histograms of worker %d\n",
+				 i);
+		numa_bitmask_free(mask);
+		/* fault the pages in now rather than on the data plane */
+		memset(kstats_lat[i], 0, len);
+	}
+	return 0;
+}
+
+static void kstats_pmc_printone(const struct kstats_pmc *p, bool hw,
+				const char *label)
+{
+	uint64_t cycles = max(p->events[KSTATS_PMC_CYCLES], 1UL);
+	uint64_t ipc = p->events[KSTATS_PMC_INSTRUCTIONS] * 100 / cycles;
+
+	if (!p->tasks)
+		return;
+	if (!hw) {
+		log_info("kstat-pmc: %-16s %9lu tasks tsc/task %9lu\n", label,
+			 p->tasks, p->tsc / p->tasks);
+		return;
+	}
+	log_info("kstat-pmc: %-16s %9lu tasks tsc/task %9lu instr/task %9lu "
+		 "llc-miss/task %7lu ipc %lu.%02lu\n", label, p->tasks,
+		 p->tsc / p->tasks,
+		 p->events[KSTATS_PMC_INSTRUCTIONS] / p->tasks,
+		 p->events[KSTATS_PMC_LLC_MISSES] / p->tasks,
+		 ipc / 100, ipc % 100);
+}
+
+static void kstats_lat_printone(const struct kstats_hist *h, const char *metric,
+				const char *label)
+{
+	int last;
+
+	if (!h->count)
+		return;
+	for (last = KSTATS_HIST_BUCKETS - 1; last > 0 && !h->buckets[last]; last--)
+		;
+	log_info("kstat-lat: %-7s %-16s %9lu avg %7lu p50 %7lu p99 %7lu "
+		 "p99.9 %7lu max %7lu us\n",
+		 metric, label, h->count,
+		 h->sum / h->count / cycles_per_us,
+		 kstats_hist_percentile(h, 50) / cycles_per_us,
+		 kstats_hist_percentile(h, 99) / cycles_per_us,
+		 kstats_hist_percentile(h, 99.9) / cycles_per_us,
+		 kstats_hist_value(last) / cycles_per_us);
+}
+
+/**
+ * kstats_lat_report - logs the latency percentiles since the last report
+ *
+ * Prints every metric merged over all workers, then split by request class
+ * and by worker, followed by the CPU counters of each request class. Called
+ * periodically by a single core (the networker).
+ */
+void kstats_lat_report(void)
+{
+	static struct kstats_hist snap, all, by_class[KSTATS_LAT_CLASSES];
+	static struct kstats_hist by_worker[CFG_MAX_CPU];
+	struct kstats_pmc pmc[KSTATS_LAT_CLASSES], pmc_snap;
+	bool hw = kstats_lat_workers > 0;
+	char label[32];
+	int m, w, c, e;
+
+	for (m = 0; m < KSTATS_LAT_NR; m++) {
+		memset(&all, 0, sizeof(all));
+		memset(by_class, 0, sizeof(by_class));
+		memset(by_worker, 0, sizeof(*by_worker) * kstats_lat_workers);
+
+		for (w = 0; w < kstats_lat_workers; w++) {
+			for (c = 0; c < KSTATS_LAT_CLASSES; c++) {
+				struct kstats_hist *prev = &kstats_lat_prev[w]->h[m][c];
+
+				/* the writer keeps going, work on one copy */
+				snap = kstats_lat[w]->h[m][c];
+				kstats_hist_merge(&all, &snap);
+				kstats_hist_sub(&all, prev);
+				kstats_hist_merge(&by_class[c], &snap);
+				kstats_hist_sub(&by_class[c], prev);
+				kstats_hist_merge(&by_worker[w], &snap);
+				kstats_hist_sub(&by_worker[w], prev);
+				*prev = snap;
+			}
+		}
+
+		kstats_lat_printone(&all, kstats_lat_names[m], "all");
+		for (c = 0; c < app_nr_classes; c++) {
+			snprintf(label, sizeof(label), "class %s",
+				 app_class_names[c]);
+			kstats_lat_printone(&by_class[c], kstats_lat_names[m],
+					    label);
+		}
+		for (w = 0; w < kstats_lat_workers; w++) {
+			snprintf(label, sizeof(label), "worker %d", w);
+			kstats_lat_printone(&by_worker[w], kstats_lat_names[m],
+					    label);
+		}
+	}
+
+	memset(pmc, 0, sizeof(pmc));
+	for (w = 0; w < kstats_lat_workers; w++) {
+		hw &= kstats_lat[w]->pmc_hw;
+		for (c = 0; c < KSTATS_LAT_CLASSES; c++) {
+			struct kstats_pmc *prev = &kstats_lat_prev[w]->pmc[c];
+
+			pmc_snap = kstats_lat[w]->pmc[c];
+			pmc[c].tasks += pmc_snap.tasks - prev->tasks;
+			pmc[c].tsc += pmc_snap.tsc - prev->tsc;
+			for (e = 0; e < KSTATS_PMC_NR; e++)
+				pmc[c].events[e] += pmc_snap.events[e] -
+						    prev->events[e];
+			*prev = pmc_snap;
+		}
+	}
+	for (c = 0; c < app_nr_classes; c++) {
+		snprintf(label, sizeof(label), "class %s", app_class_names[c]);
+		kstats_pmc_printone(&pmc[c], hw, label);
+	}
+}
@@ -24,49 +24,449 @@
 /*
  * log.c - the logging system
  *
+ * Once a data plane core is up, logk() no longer formats or writes on the
+ * calling core: it copies the format pointer and the raw arguments (and the
+ * bytes of %s strings) into a fixed size record of the core's log ring. A
+ * drainer thread on a spare CPU formats the records and writes them to
+ * stdout. A full ring drops records rather than stalling the core. Errors and
+ * anything logged before log_init_cpu() are still printed synchronously, so
+ * records of different cores (and synchronous ones) may be interleaved out
+ * of order.
+ *
  * FIXME: Should we direct logs to a file?
  */
 
 #include <ix/stddef.h>
 #include <ix/log.h>
+#include <ix/cfg.h>
 #include <ix/cpu.h>
+#include <ix/errno.h>
+#include <ix/mem.h>
+#include <ix/timer.h>
+
+#include <asm/cpu.h>
 
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
 #include <time.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #define MAX_LOG_LEN	1024
 
+#define LOG_RING_SIZE	4096	/* records per core */
+#define LOG_MAX_ARGS	12
+#define LOG_STR_LEN	128
+#define LOG_DRAIN_SLEEP_US	1000
+
+enum {
+	LOG_ARG_INT,
+	LOG_ARG_LONG,
+	LOG_ARG_DOUBLE,
+	LOG_ARG_STR,
+	LOG_ARG_SKIP,		/* %n, consumed but not printed */
+	LOG_ARG_BAD,		/* not supported, format on the caller */
+};
+
+struct log_spec {
+	const char *start;	/* the '%' */
+	int len;
+	int stars;		/* '*' width and precision arguments */
+	int kind;
+};
+
+/* fmt is NULL if str holds the formatted message */
+struct log_rec {
+	uint64_t tsc;
+	const char *fmt;
+	uint8_t level;
+	uint8_t nargs;
+	uint16_t cpu;
+	uint16_t str_len;
+	uint64_t args[LOG_MAX_ARGS];
+	char str[LOG_STR_LEN];
+} __aligned(64);
+
+struct log_ring {
+	/* producer */
+	uint64_t head;
+	uint64_t tail_cache;
+	uint64_t drops;
+	/* drainer */
+	uint64_t tail __aligned(64);
+	struct log_rec *recs __aligned(64);
+} __aligned(64);
+
 __thread bool log_is_early_boot = true;
 
 int max_loglevel = LOG_DEBUG;
 
-void logk(int level, const char *fmt, ...)
+static __thread struct log_ring *log_ring;
+static struct log_ring log_rings[CFG_MAX_CPU];
+static int log_nr_rings;
+static uint64_t log_start_tsc;
+static time_t log_start_time;
+/* the drainer and the exit handler both consume */
+static pthread_mutex_t log_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Parses the conversion that follows the '%' at @p and returns the first
+ * character after it. Only the argument types matter here, the drainer hands
+ * the specification itself back to snprintf().
+ */
+static const char *log_parse_spec(const char *p, struct log_spec *s)
 {
-	va_list ptr;
-	char buf[MAX_LOG_LEN];
+	int lng = 0;
+
+	s->start = p++;
+	s->stars = 0;
+	while (*p && strchr("-+ #0'", *p))
+		p++;
+	if (*p == '*') {
+		s->stars++;
+		p++;
+	}
+	while (*p >= '0' && *p <= '9')
+		p++;
+	if (*p == '.') {
+		p++;
+		if (*p == '*') {
+			s->stars++;
+			p++;
+		}
+		while (*p >= '0' && *p <= '9')
+			p++;
+	}
+	while (*p && strchr("hlzjtqL", *p)) {
+		if (*p != 'h')
+			lng = *p == 'L' ? -1 : 1;
+		p++;
+	}
+
+	switch (*p) {
+	case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+		s->kind = lng > 0 ? LOG_ARG_LONG : LOG_ARG_INT;
+		break;
+	case 'p':
+		s->kind = LOG_ARG_LONG;
+		break;
+	case 'f': case 'F': case 'e': case 'E': case 'g': case 'G':
+	case 'a': case 'A':
+		s->kind = lng < 0 ? LOG_ARG_BAD : LOG_ARG_DOUBLE;
+		break;
+	case 's':
+		s->kind = lng ? LOG_ARG_BAD : LOG_ARG_STR;
+		break;
+	case 'n':
+		s->kind = LOG_ARG_SKIP;
+		break;
+	default:
+		s->kind = LOG_ARG_BAD;
+		if (!*p)
+			p--;
+	}
+	p++;
+	s->len = p - s->start;
+	return p;
+}
+
+/* Returns 0 if the arguments fit in the record, otherwise fail. */
+static int log_capture(struct log_rec *r, const char *fmt, va_list ap)
+{
+	struct log_spec s;
+	const char *p = fmt, *str;
+	double d;
+	size_t len;
+	int i;
+
+	r->nargs = 0;
+	r->str_len = 0;
+	while ((p = strchr(p, '%'))) {
+		if (p[1] == '%') {
+			p += 2;
+			continue;
+		}
+		p = log_parse_spec(p, &s);
+		if (s.kind == LOG_ARG_BAD ||
+		    r->nargs + s.stars + 1 > LOG_MAX_ARGS)
+			return -EINVAL;
+		for (i = 0; i < s.stars; i++)
+			r->args[r->nargs++] = va_arg(ap, int);
+
+		switch (s.kind) {
+		case LOG_ARG_INT:
+			r->args[r->nargs++] = va_arg(ap, int);
+			break;
+		case LOG_ARG_LONG:
+			r->args[r->nargs++] = va_arg(ap, long);
+			break;
+		case LOG_ARG_DOUBLE:
+			d = va_arg(ap, double);
+			memcpy(&r->args[r->nargs++], &d, sizeof(d));
+			break;
+		case LOG_ARG_STR:
+			/* the string may be gone by the time it is printed */
+			str = va_arg(ap, const char *);
+			if (!str)
+				str = "(null)";
+			/* no room left for the NUL: format the record now */
+			if (r->str_len >= LOG_STR_LEN)
+				return -EINVAL;
+			len = strnlen(str, LOG_STR_LEN - r->str_len - 1);
+			memcpy(r->str + r->str_len, str, len);
+			r->args[r->nargs++] = r->str_len;
+			r->str_len += len;
+			r->str[r->str_len++] = '\0';
+			break;
+		case LOG_ARG_SKIP:
+			va_arg(ap, void *);
+			r->args[r->nargs++] = 0;
+			break;
+		}
+	}
+	return 0;
+}
+
+static void log_enqueue(int level, const char *fmt, va_list ap)
+{
+	struct log_ring *ring = log_ring;
+	struct log_rec *r;
+	va_list copy;
+
+	if (unlikely(ring->head - ring->tail_cache >= LOG_RING_SIZE)) {
+		ring->tail_cache = *(volatile uint64_t *) &ring->tail;
+		if (ring->head - ring->tail_cache >= LOG_RING_SIZE) {
+			ring->drops++;
+			return;
+		}
+	}
+
+	r = &ring->recs[ring->head & (LOG_RING_SIZE - 1)];
+	r->tsc = rdtsc();
+	r->level = level;
+	r->cpu = percpu_get(cpu_id);
+	r->fmt = fmt;
+	va_copy(copy, ap);
+	if (log_capture(r, fmt, copy)) {
+		/* unusual conversions: format here, write later */
+		r->fmt = NULL;
+		vsnprintf(r->str, LOG_STR_LEN, fmt, ap);
+	}
+	va_end(copy);
+
+	/* the drainer must see the record before the new head */
+	asm volatile("" ::: "memory");
+	*(volatile uint64_t *) &ring->head = ring->head + 1;
+}
+
+static int log_prefix(char *buf, int cpu, int level, time_t ts)
+{
+	int off = 0;
+
+	if (cpu >= 0)
+		off = sprintf(buf, "CPU %02d| ", cpu);
+	off += strftime(buf + off, 32, "%H:%M:%S ", localtime(&ts));
+	off += snprintf(buf + off, 6, "<%d>: ", level);
+	return off;
+}
+
+static int log_format_arg(char *buf, size_t size, const char *spec,
+			  const struct log_spec *s, const struct log_rec *r,
+			  int *arg)
+{
+	int w1 = 0, w2 = 0;
+	uint64_t v;
+	double d;
+
+	if (s->stars > 0)
+		w1 = r->args[(*arg)++];
+	if (s->stars > 1)
+		w2 = r->args[(*arg)++];
+	v = r->args[(*arg)++];
+
+	if (s->kind == LOG_ARG_SKIP)
+		return 0;
+	if (s->kind == LOG_ARG_DOUBLE) {
+		memcpy(&d, &v, sizeof(d));
+		if (s->stars == 2)
+			return snprintf(buf, size, spec, w1, w2, d);
+		if (s->stars == 1)
+			return snprintf(buf, size, spec, w1, d);
+		return snprintf(buf, size, spec, d);
+	}
+	if (s->kind == LOG_ARG_STR) {
+		if (s->stars == 2)
+			return snprintf(buf, size, spec, w1, w2, r->str + v);
+		if (s->stars == 1)
+			return snprintf(buf, size, spec, w1, r->str + v);
+		return snprintf(buf, size, spec, r->str + v);
+	}
+	if (s->stars == 2)
+		return snprintf(buf, size, spec, w1, w2, (long) v);
+	if (s->stars == 1)
+		return snprintf(buf, size, spec, w1, (long) v);
+	return snprintf(buf, size, spec, (long) v);
+}
+
+static void log_format(const struct log_rec *r, char *buf)
+{
+	struct log_spec s;
+	const char *p = r->fmt, *next;
+	char spec[32];
 	time_t ts;
-	off_t off = 0;
+	int off, arg = 0, n;
 
-	if (level > max_loglevel)
+	ts = log_start_time + (r->tsc - log_start_tsc) / cycles_per_us / 1000000;
+	off = log_prefix(buf, r->cpu, r->level, ts);
+	if (!p) {
+		snprintf(buf + off, MAX_LOG_LEN - off, "%s", r->str);
 		return;
+	}
 
-	if (!log_is_early_boot) {
-		snprintf(buf, 9, "CPU %02d| ", percpu_get(cpu_id));
-		off = strlen(buf);
+	while (*p && off < MAX_LOG_LEN - 1) {
+		next = strchr(p, '%');
+		if (!next) {
+			off += snprintf(buf + off, MAX_LOG_LEN - off, "%s", p);
+			break;
+		}
+		n = next - p;
+		if (n > MAX_LOG_LEN - 1 - off)
+			n = MAX_LOG_LEN - 1 - off;
+		memcpy(buf + off, p, n);
+		off += n;
+		if (next[1] == '%') {
+			buf[off++] = '%';
+			p = next + 2;
+			continue;
+		}
+		p = log_parse_spec(next, &s);
+		if (s.len >= (int) sizeof(spec))
+			break;
+		memcpy(spec, s.start, s.len);
+		spec[s.len] = '\0';
+		n = log_format_arg(buf + off, MAX_LOG_LEN - off, spec, &s, r,
+				   &arg);
+		off += n < MAX_LOG_LEN - off ? n : MAX_LOG_LEN - 1 - off;
 	}
+	buf[off < MAX_LOG_LEN ? off : MAX_LOG_LEN - 1] = '\0';
+}
 
-	time(&ts);
-	off += strftime(buf + off, 32, "%H:%M:%S ", localtime(&ts));
+/* Returns the number of records written. */
+static int log_drain(void)
+{
+	static uint64_t reported[CFG_MAX_CPU];
+	char buf[MAX_LOG_LEN];
+	struct log_ring *ring;
+	uint64_t head;
+	int i, n = 0;
+
+	pthread_mutex_lock(&log_drain_lock);
+	for (i = 0; i < log_nr_rings; i++) {
+		ring = &log_rings[i];
+		head = *(volatile uint64_t *) &ring->head;
+		/* read the records only after the head that covers them */
+		asm volatile("" ::: "memory");
+		for (; ring->tail != head; n++) {
+			log_format(&ring->recs[ring->tail & (LOG_RING_SIZE - 1)],
+				   buf);
+			fputs(buf, stdout);
+			asm volatile("" ::: "memory");
+			*(volatile uint64_t *) &ring->tail = ring->tail + 1;
+		}
+		if (ring->drops != reported[i]) {
+			printf("log: %lu messages of core %d dropped, ring full\n",
+			       ring->drops - reported[i], i);
+			reported[i] = ring->drops;
+		}
+	}
+	if (n)
+		fflush(stdout);
+	pthread_mutex_unlock(&log_drain_lock);
+	return n;
+}
+
+static void *log_drainer(void *arg)
+{
+	if (cpu_pin_spare())
+		logk(LOG_WARN, "log: no spare CPU, the drainer shares the data plane cores\n");
+
+	while (true) {
+		if (!log_drain())
+			usleep(LOG_DRAIN_SLEEP_US);
+	}
+	return NULL;
+}
+
+static void log_drain_at_exit(void)
+{
+	log_drain();
+}
+
+void logk(int level, const char *fmt, ...)
+{
+	va_list ptr;
+	char buf[MAX_LOG_LEN];
+	off_t off;
 
-	snprintf(buf + off, 6, "<%d>: ", level);
-	off = strlen(buf);
+	if (level > max_loglevel)
+		return;
 
 	va_start(ptr, fmt);
+	if (log_ring && level > LOG_ERR) {
+		log_enqueue(level, fmt, ptr);
+		va_end(ptr);
+		return;
+	}
+
+	off = log_prefix(buf, log_is_early_boot ? -1 : (int) percpu_get(cpu_id),
+			 level, time(NULL));
 	vsnprintf(buf + off, MAX_LOG_LEN - off, fmt, ptr);
 	va_end(ptr);
 
 	printf("%s", buf);
 }
 
+/**
+ * log_init - allocates the per-core log rings and starts the drainer
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int log_init(void)
+{
+	size_t len = LOG_RING_SIZE * sizeof(struct log_rec);
+	pthread_t tid;
+	int i;
+
+	for (i = 0; i < CFG.num_cpus; i++) {
+		log_rings[i].recs =
+			mem_alloc_pages_onnode(div_up(len, PGSIZE_2MB), PGSIZE_2MB,
+					       cpu_numa_node_of(CFG.cpu[i]),
+					       MPOL_PREFERRED);
+		if (log_rings[i].recs == MAP_FAILED || !log_rings[i].recs)
+			return -ENOMEM;
+	}
+	log_nr_rings = CFG.num_cpus;
+	log_start_tsc = rdtsc();
+	log_start_time = time(NULL);
+
+	if (pthread_create(&tid, NULL, log_drainer, NULL)) {
+		log_err("log: unable to create the drainer thread\n");
+		return -EAGAIN;
+	}
+	atexit(log_drain_at_exit);
+	return 0;
+}
+
+/**
+ * log_init_cpu - switches the calling core to its log ring
+ *
+ * Returns 0.
+ */
+int log_init_cpu(void)
+{
+	log_ring = &log_rings[percpu_get(cpu_nr)];
+	return 0;
+}
@@ -0,0 +1,516 @@
+/*
+ * mcache.c - per-core magazine caches over a shared object store
+ *
+ * Follows the magazine design of Bonwick and Adams ("Magazines and Vmem",
+ * USENIX ATC 2001): each core keeps a loaded and a previous magazine, the
+ * previous one is always either full or empty, and whole magazines are
+ * exchanged with the depot.
+ *
+ * The cache is sized so the depot can never run out of empty magazines:
+ * with N objects of R rounds each and C cores, at most N/R magazines are
+ * full in the depot and at most 2C are held by cores.
+ *
+ * Usage counters are only ever written by their own core. Readers sum the
+ * per-core slots: allocated objects are the sum of allocs - frees, and frees
+ * a core did beyond its own allocs are objects that came from other cores.
+ * The high-water mark is the sum of the per-core marks, which is exact as
+ * long as objects are freed on the core that allocated them and an upper
+ * bound otherwise.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <ix/stddef.h>
+#include <ix/errno.h>
+#include <ix/log.h>
+#include <ix/mem.h>
+#include <ix/timer.h>
+#include <ix/mcache.h>
+
+#include <asm/cpu.h>
+
+static struct mcache_shm *mcache_shm;
+static struct mcache *mcache_all[MCACHE_MAX];
+
+static void mcache_depot_push(struct mcache_depot *d, struct mcache_mag *m)
+{
+	long old, new;
+
+	do {
+		old = d->head.cnt;
+		m->next = (struct mcache_mag *) (old & MCACHE_PTR_MASK);
+		new = (long) m | ((old & ~MCACHE_PTR_MASK) + (1UL << MCACHE_TAG_SHIFT));
+	} while (!atomic64_cmpxchg(&d->head, old, new));
+}
+
+static struct mcache_mag *mcache_depot_pop(struct mcache_depot *d)
+{
+	struct mcache_mag *m;
+	long old, new;
+
+	do {
+		old = d->head.cnt;
+		m = (struct mcache_mag *) (old & MCACHE_PTR_MASK);
+		if (!m)
+			return NULL;
+		/* m is never unmapped, a stale next is caught by the tag */
+		new = (long) m->next | ((old & ~MCACHE_PTR_MASK) + (1UL << MCACHE_TAG_SHIFT));
+	} while (!atomic64_cmpxchg(&d->head, old, new));
+
+	return m;
+}
+
+static int mcache_cpu_init(struct mcache *c, struct mcache_cpu *cc)
+{
+	cc->loaded = mcache_depot_pop(&c->empty);
+	cc->prev = mcache_depot_pop(&c->empty);
+	if (unlikely(!cc->loaded || !cc->prev)) {
+		log_err("mcache: %s has no magazines left for cpu %d\n",
+			c->name, percpu_get(cpu_nr));
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/**
+ * mcache_claim - makes the calling core the allocating core of a cache
+ * @c: the cache
+ * @cc: the calling core's magazines
+ *
+ * Called on the first allocation of a core, see mcache.h.
+ */
+void mcache_claim(struct mcache *c, struct mcache_cpu *cc)
+{
+	int cpu = cc - c->cpu;
+
+	if (!__sync_bool_compare_and_swap(&c->alloc_cpu, -1, cpu))
+		assert(c->alloc_cpu == cpu);
+}
+
+/**
+ * mcache_alloc_slow - refills the loaded magazine
+ * @c: the cache
+ * @cc: the calling core's magazines
+ *
+ * Returns a pointer to the object or NULL if the cache is exhausted.
+ */
+void *mcache_alloc_slow(struct mcache *c, struct mcache_cpu *cc)
+{
+	struct mcache_mag *full;
+
+	if (unlikely(!cc->loaded) && mcache_cpu_init(c, cc)) {
+		cc->cnt->failed++;
+		return NULL;
+	}
+
+	if (cc->prev->rounds) {
+		full = cc->prev;
+		cc->prev = cc->loaded;
+	} else {
+		full = mcache_depot_pop(&c->full);
+		if (unlikely(!full)) {
+			cc->cnt->failed++;
+			return NULL;
+		}
+		mcache_depot_push(&c->empty, cc->prev);
+		cc->prev = cc->loaded;
+	}
+	cc->loaded = full;
+	return full->objs[--full->rounds];
+}
+
+/**
+ * mcache_free_slow - makes room in the loaded magazine
+ * @c: the cache
+ * @cc: the calling core's magazines
+ * @obj: the object
+ */
+void mcache_free_slow(struct mcache *c, struct mcache_cpu *cc, void *obj)
+{
+	struct mcache_mag *empty;
+
+	if (unlikely(!cc->loaded) && mcache_cpu_init(c, cc))
+		panic("mcache: cannot free to %s\n", c->name);
+
+	if (!cc->prev->rounds) {
+		empty = cc->prev;
+		cc->prev = cc->loaded;
+	} else {
+		empty = mcache_depot_pop(&c->empty);
+		if (unlikely(!empty))
+			panic("mcache: %s ran out of empty magazines\n", c->name);
+		mcache_depot_push(&c->full, cc->prev);
+		cc->prev = cc->loaded;
+	}
+	cc->loaded = empty;
+	empty->objs[empty->rounds++] = obj;
+}
+
+static int mcache_shm_init(void)
+{
+	size_t len = align_up(sizeof(struct mcache_shm), PGSIZE_4KB);
+	void *addr = MAP_FAILED;
+	int fd;
+
+	fd = shm_open(MCACHE_SHM_NAME, O_CREAT | O_RDWR, 0644);
+	if (fd >= 0) {
+		if (!ftruncate(fd, len))
+			addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+				    MAP_SHARED, fd, 0);
+		close(fd);
+	}
+	if (addr == MAP_FAILED) {
+		log_warn("mcache: cannot map %s, pool counters are not exported\n",
+			 MCACHE_SHM_NAME);
+		addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (addr == MAP_FAILED)
+			return -ENOMEM;
+	}
+
+	mcache_shm = addr;
+	memset(mcache_shm, 0, len);
+	mcache_shm->nr_cpus = CFG.num_cpus;
+	mcache_shm->magic = MCACHE_SHM_MAGIC;
+	return 0;
+}
+
+static int mcache_register(struct mcache *c)
+{
+	struct mcache_shm_cache *sc;
+	int i, ret;
+
+	if (!mcache_shm) {
+		ret = mcache_shm_init();
+		if (ret)
+			return ret;
+	}
+	if (mcache_shm->nr_caches == MCACHE_MAX) {
+		log_err("mcache: too many caches, cannot add %s\n", c->name);
+		return -E2BIG;
+	}
+
+	mcache_all[mcache_shm->nr_caches] = c;
+	sc = &mcache_shm->caches[mcache_shm->nr_caches];
+	strncpy(sc->name, c->name, sizeof(sc->name) - 1);
+	sc->nr_mags = c->nr_mags;
+	c->shm = sc;
+	for (i = 0; i < CFG_MAX_CPU; i++) {
+		c->cpu[i].loaded = NULL;
+		c->cpu[i].prev = NULL;
+		c->cpu[i].cnt = &sc->cpu[i];
+	}
+	/* publish the slot only once it is set up */
+	wmb();
+	mcache_shm->nr_caches++;
+	return 0;
+}
+
+/**
+ * mcache_init - allocates the magazines of an empty cache
+ * @c: the cache
+ * @nr_objs: the number of objects that will be seeded
+ * @name: the name reported in logs
+ * @numa_node: the node to allocate the magazines on
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int mcache_init(struct mcache *c, uint32_t nr_objs, const char *name,
+		int numa_node)
+{
+	size_t len;
+	int i, ret;
+
+	c->name = name;
+	c->nr_objs = 0;
+	c->alloc_cpu = -1;
+	c->nr_mags = div_up(nr_objs, MCACHE_MAG_ROUNDS) + 2 * CFG.num_cpus + 1;
+	len = (size_t) c->nr_mags * sizeof(struct mcache_mag);
+	c->mag_pages = div_up(len, PGSIZE_2MB);
+	c->numa_node = numa_node;
+	c->own_len = 0;
+	c->mags = mem_alloc_pages_onnode(c->mag_pages, PGSIZE_2MB,
+					 numa_node, MPOL_BIND);
+	if (c->mags == MAP_FAILED || !c->mags) {
+		log_err("mcache: cannot allocate %d magazines for %s\n",
+			c->nr_mags, name);
+		return -ENOMEM;
+	}
+
+	ret = mcache_register(c);
+	if (ret)
+		return ret;
+
+#ifdef MCACHE_DEBUG
+	c->tags = calloc(nr_objs, sizeof(*c->tags));
+	if (!c->tags)
+		return -ENOMEM;
+#endif
+
+	c->full.head.cnt = 0;
+	c->empty.head.cnt = 0;
+	for (i = c->nr_mags - 1; i >= 0; i--) {
+		c->mags[i].rounds = 0;
+		mcache_depot_push(&c->empty, &c->mags[i]);
+	}
+	return 0;
+}
+
+/**
+ * mcache_seed - adds a free object to a cache
+ * @c: the cache
+ * @obj: the object
+ *
+ * Only valid during initialization, before other cores use the cache.
+ */
+void mcache_seed(struct mcache *c, void *obj)
+{
+	struct mcache_mag *m;
+
+	m = (struct mcache_mag *) (c->full.head.cnt & MCACHE_PTR_MASK);
+	if (!m || m->rounds == MCACHE_MAG_ROUNDS) {
+		m = mcache_depot_pop(&c->empty);
+		if (!m)
+			panic("mcache: %s seeded beyond its size\n", c->name);
+		mcache_depot_push(&c->full, m);
+	}
+	m->objs[m->rounds++] = obj;
+	c->nr_objs++;
+	c->shm->nr_objs = c->nr_objs;
+}
+
+/**
+ * mcache_create - creates a cache holding every element of a datastore
+ * @c: the cache
+ * @mds: the datastore, its elements are owned by the cache afterwards
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int mcache_create(struct mcache *c, struct mempool_datastore *mds)
+{
+	struct mempool_hdr *chunk, *h, *next;
+	int ret;
+
+	ret = mcache_init(c, mds->nr_elems, mds->prettyname, mds->numa_node);
+	if (ret)
+		return ret;
+	mcache_set_layout(c, mds->buf, mds->elem_len,
+			  mds->nostraddle ? PGSIZE_2MB / mds->elem_len : 0);
+
+	spin_lock(&mds->lock);
+	for (chunk = mds->chunk_head; chunk; chunk = chunk->next_chunk) {
+		for (h = chunk; h; h = next) {
+			next = h->next;
+			mcache_seed(c, h);
+		}
+	}
+	mds->chunk_head = NULL;
+	mds->free_chunks = 0;
+	spin_unlock(&mds->lock);
+
+	log_info("mcache: %-15s objs:%u magazines:%d\n", c->name, c->nr_objs,
+		 c->nr_mags);
+	return 0;
+}
+
+/**
+ * mcache_shm_stats - aggregates the per-core counters of a cache
+ * @sc: the cache in the stats page
+ * @nr_cpus: the number of cores
+ * @st: the result
+ *
+ * Also usable by tools that map the stats page, the counters are read
+ * without synchronization.
+ */
+void mcache_shm_stats(const struct mcache_shm_cache *sc, int nr_cpus,
+		      struct mcache_stats *st)
+{
+	uint64_t allocs = 0, frees = 0;
+	int i;
+
+	memset(st, 0, sizeof(*st));
+	st->nr_objs = sc->nr_objs;
+	for (i = 0; i < nr_cpus && i < CFG_MAX_CPU; i++) {
+		const struct mcache_counters *cc = &sc->cpu[i];
+		uint64_t a = cc->allocs, f = cc->frees;
+
+		allocs += a;
+		frees += f;
+		if (f > a)
+			st->remote_frees += f - a;
+		if (cc->hwm > 0)
+			st->hwm += cc->hwm;
+		st->failed += cc->failed;
+	}
+	st->allocated = allocs > frees ? allocs - frees : 0;
+	if (st->hwm > st->nr_objs)
+		st->hwm = st->nr_objs;
+}
+
+/**
+ * mcache_get_stats - aggregates the per-core counters of a cache
+ * @c: the cache
+ * @st: the result
+ */
+void mcache_get_stats(struct mcache *c, struct mcache_stats *st)
+{
+	mcache_shm_stats(c->shm, mcache_shm->nr_cpus, st);
+}
+
+/**
+ * mcache_print_budget - prints the memory held by the caches themselves
+ *
+ * Lists the magazines of every cache and the objects a cache allocated
+ * itself instead of taking them over from a datastore (guarded stacks), in
+ * the format of mempool_print_budget().
+ *
+ * Returns the number of bytes listed.
+ */
+size_t mcache_print_budget(void)
+{
+	struct mcache *c;
+	char name[32];
+	size_t total = 0;
+	int i;
+
+	if (!mcache_shm)
+		return 0;
+
+	for (i = 0; i < mcache_shm->nr_caches; i++) {
+		c = mcache_all[i];
+		snprintf(name, sizeof(name), "%s.mags", c->name);
+		log_info("mempool: %-15s %10d %8lu %6d %4d %10lu\n", name,
+			 c->nr_mags, sizeof(struct mcache_mag), c->mag_pages,
+			 c->numa_node, (size_t) c->mag_pages * PGSIZE_2MB >> 20);
+		total += (size_t) c->mag_pages * PGSIZE_2MB;
+		if (!c->own_len)
+			continue;
+		log_info("mempool: %-15s %10u %8lu %6s %4d %10lu\n", c->name,
+			 c->nr_objs, c->own_len / c->nr_objs, "-",
+			 c->numa_node, c->own_len >> 20);
+		total += c->own_len;
+	}
+	return total;
+}
+
+#ifdef MCACHE_DEBUG
+
+#define MCACHE_LEAK_REPORT_MAX	16
+
+/**
+ * mcache_set_layout - describes where the objects of a cache are
+ * @c: the cache
+ * @base: the address of the first object
+ * @stride: the distance between two objects
+ * @per_page: the number of objects per 2MB page, or 0 if they straddle pages
+ */
+void mcache_set_layout(struct mcache *c, void *base, size_t stride,
+		       int per_page)
+{
+	c->base = (uintptr_t) base;
+	c->stride = stride;
+	c->per_page = per_page;
+}
+
+static struct mcache_tag *mcache_obj_tag(struct mcache *c, void *obj)
+{
+	uintptr_t off = (uintptr_t) obj - c->base;
+	size_t idx;
+
+	if (!c->stride)
+		return NULL;
+	if (c->per_page)
+		idx = off / PGSIZE_2MB * c->per_page + off % PGSIZE_2MB / c->stride;
+	else
+		idx = off / c->stride;
+	if (idx >= c->nr_objs)
+		panic("mcache: %p does not belong to %s\n", obj, c->name);
+	return &c->tags[idx];
+}
+
+void mcache_debug_alloc(struct mcache *c, void *obj)
+{
+	struct mcache_tag *t = mcache_obj_tag(c, obj);
+
+	if (!t)
+		return;
+	if (t->live)
+		panic("mcache: %s object %p allocated twice\n", c->name, obj);
+	t->live = 1;
+	t->owner = NULL;
+	t->cpu = percpu_get(cpu_nr);
+	t->tsc = rdtsc();
+}
+
+void mcache_debug_free(struct mcache *c, void *obj)
+{
+	struct mcache_tag *t = mcache_obj_tag(c, obj);
+
+	if (!t)
+		return;
+	if (!t->live)
+		panic("mcache: %s object %p freed twice\n", c->name, obj);
+	t->live = 0;
+}
+
+/**
+ * mcache_tag - records the owner of an allocated object
+ * @c: the cache
+ * @obj: the object
+ * @owner: the owner, usually the request the object belongs to
+ */
+void mcache_tag(struct mcache *c, void *obj, void *owner)
+{
+	struct mcache_tag *t = mcache_obj_tag(c, obj);
+
+	if (t)
+		t->owner = owner;
+}
+
+/**
+ * mcache_report_leaks - logs objects that have been allocated for too long
+ * @min_age_us: the age above which an object is considered leaked
+ */
+void mcache_report_leaks(uint64_t min_age_us)
+{
+	uint64_t now = rdtsc(), min_age = min_age_us * cycles_per_us;
+	struct mcache *c;
+	struct mcache_tag *t;
+	int i, leaked;
+	size_t idx;
+	void *obj;
+
+	for (i = 0; i < mcache_shm->nr_caches; i++) {
+		c = mcache_all[i];
+		if (!c->stride)
+			continue;
+		leaked = 0;
+		for (idx = 0; idx < c->nr_objs; idx++) {
+			t = &c->tags[idx];
+			if (!t->live || now - t->tsc < min_age)
+				continue;
+			if (leaked++ >= MCACHE_LEAK_REPORT_MAX)
+				continue;
+			if (c->per_page)
+				obj = (void *) (c->base + idx / c->per_page * PGSIZE_2MB +
+						idx % c->per_page * c->stride);
+			else
+				obj = (void *) (c->base + idx * c->stride);
+			log_warn("mcache: %s %p owner %p cpu %u age %lu us\n",
+				 c->name, obj, t->owner, t->cpu,
+				 (now - t->tsc) / cycles_per_us);
+			if (c->describe)
+				c->describe(obj, t->owner);
+		}
+		if (leaked)
+			log_warn("mcache: %s has %d objects older than %lu us\n",
+				 c->name, leaked, min_age_us);
+	}
+}
+
+#endif /* MCACHE_DEBUG */
@@ -141,6 +141,7 @@ void *mem_alloc_pages(int nr, int size, struct bitmask *mask, int numa_policy)
 	switch (size) {
 	case PGSIZE_4KB:
 		base = NULL;
+		break;
 	case PGSIZE_2MB:
 		spin_lock(&mem_lock);
 		mem_pos -= PGSIZE_2MB * nr;
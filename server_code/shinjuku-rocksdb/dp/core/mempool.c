@@ -52,6 +52,7 @@
 #include <ix/stddef.h>
 #include <ix/errno.h>
 #include <ix/mempool.h>
+#include <ix/mcache.h>
 #include <ix/page.h>
 #include <ix/vm.h>
 #include <stdio.h>
@@ -176,24 +177,7 @@ int mempool_init_buf_with_pages(struct mempool_datastore *mds, int elems_per_pag
 	return 0;
 }
 
-
-/**
- * mempool_create_datastore - initializes a memory pool datastore
- * @nr_elems: the minimum number of elements in the total pool
- * @elem_len: the length of each element
- * @nostraddle: (bool) 1 == objects cannot straddle 2MB pages
- * @chunk_size: the number of elements in a chunk (allocated to a mempool)
- *
- * NOTE: mempool_createdatastore() will create a pool with at least @nr_elems,
- * but possibily more depending on page alignment.
- *
- * There should be one datastore per C data type (in general).
- * Each core, flow-group or unit of concurrency will create a distinct mempool leveraging the datastore
- *
- * Returns 0 if successful, otherwise fail.
- */
-
-int mempool_create_datastore(struct mempool_datastore *mds, int nr_elems, size_t elem_len, int nostraddle, int chunk_size, const char *name)
+static int __mempool_create_datastore(struct mempool_datastore *mds, int nr_elems, size_t elem_len, int nostraddle, int chunk_size, const char *name, int numa_node, int bind)
 {
 	int nr_pages;
 
@@ -212,12 +196,17 @@ int mempool_create_datastore(struct mempool_datastore *mds, int nr_elems, size_t
 	if (nostraddle) {
 		int elems_per_page = PGSIZE_2MB / elem_len;
 		nr_pages = div_up(nr_elems, elems_per_page);
-		mds->buf = page_alloc_contig(nr_pages);
+		mds->buf = page_alloc_contig_on_node(nr_pages, numa_node);
 		assert(mds->buf);
 	} else {
 		nr_pages = PGN_2MB(nr_elems * elem_len + PGMASK_2MB);
 		nr_elems = nr_pages * PGSIZE_2MB / elem_len;
-		mds->buf = mem_alloc_pages(nr_pages, PGSIZE_2MB, NULL, MPOL_PREFERRED);
+		if (bind)
+			mds->buf = mem_alloc_pages_onnode(nr_pages, PGSIZE_2MB,
+							  numa_node, MPOL_BIND);
+		else
+			mds->buf = mem_alloc_pages(nr_pages, PGSIZE_2MB, NULL,
+						   MPOL_PREFERRED);
 	}
 
 	mds->nr_pages = nr_pages;
@@ -225,6 +214,7 @@ int mempool_create_datastore(struct mempool_datastore *mds, int nr_elems, size_t
 	mds->elem_len = elem_len;
 	mds->chunk_size = chunk_size;
 	mds->nostraddle = nostraddle;
+	mds->numa_node = numa_node;
 
 	spin_lock_init(&mds->lock);
 
@@ -245,14 +235,54 @@ int mempool_create_datastore(struct mempool_datastore *mds, int nr_elems, size_t
 	mds->next_ds = mempool_all_datastores;
 	mempool_all_datastores = mds;
 
-	printf("mempool_datastore: %-15s pages:%4u elem_len:%4lu nostraddle:%d chunk_size:%d num_chunks:4%d\n",
+	printf("mempool_datastore: %-15s pages:%4u elem_len:%4lu nostraddle:%d chunk_size:%d num_chunks:4%d node:%d\n",
 	       name,
 	       nr_pages,
-	       mds->elem_len, mds->nostraddle, mds->chunk_size, mds->num_chunks);
+	       mds->elem_len, mds->nostraddle, mds->chunk_size, mds->num_chunks,
+	       numa_node);
 
 	return 0;
 }
 
+/**
+ * mempool_create_datastore - initializes a memory pool datastore
+ * @nr_elems: the minimum number of elements in the total pool
+ * @elem_len: the length of each element
+ * @nostraddle: (bool) 1 == objects cannot straddle 2MB pages
+ * @chunk_size: the number of elements in a chunk (allocated to a mempool)
+ *
+ * NOTE: mempool_createdatastore() will create a pool with at least @nr_elems,
+ * but possibily more depending on page alignment.
+ *
+ * There should be one datastore per C data type (in general).
+ * Each core, flow-group or unit of concurrency will create a distinct mempool leveraging the datastore
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int mempool_create_datastore(struct mempool_datastore *mds, int nr_elems, size_t elem_len, int nostraddle, int chunk_size, const char *name)
+{
+	return __mempool_create_datastore(mds, nr_elems, elem_len, nostraddle,
+					  chunk_size, name,
+					  percpu_get(cpu_numa_node), 0);
+}
+
+/**
+ * mempool_create_datastore_onnode - initializes a memory pool datastore on
+ *                                   a given NUMA node
+ * @numa_node: the node of the cores that use the datastore
+ *
+ * Same as mempool_create_datastore(), but the backing hugepages are bound
+ * (MPOL_BIND) to @numa_node instead of only preferring the node of the
+ * calling core.
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int mempool_create_datastore_onnode(struct mempool_datastore *mds, int nr_elems, size_t elem_len, int nostraddle, int chunk_size, const char *name, int numa_node)
+{
+	return __mempool_create_datastore(mds, nr_elems, elem_len, nostraddle,
+					  chunk_size, name, numa_node, 1);
+}
+
 
 /**
  * mempool_create - initializes a memory pool
@@ -402,6 +432,34 @@ static void mempool_printstats(struct timer *t, struct eth_fg *cur_fg)
 }
 #endif
 
+/**
+ * mempool_print_budget - prints the hugepage memory held by every datastore
+ *
+ * The total also covers the magazines of the mcaches and the objects they
+ * allocate themselves (guarded stacks), see mcache_print_budget().
+ *
+ * Returns 0.
+ */
+int mempool_print_budget(void)
+{
+	struct mempool_datastore *mds;
+	size_t total = 0;
+
+	log_info("mempool: %-15s %10s %8s %6s %4s %10s\n", "datastore",
+		 "elems", "elem_len", "pages", "node", "MB");
+	for (mds = mempool_all_datastores; mds; mds = mds->next_ds) {
+		log_info("mempool: %-15s %10u %8lu %6d %4d %10lu\n",
+			 mds->prettyname, mds->nr_elems, mds->elem_len,
+			 mds->nr_pages, mds->numa_node,
+			 (size_t) mds->nr_pages * PGSIZE_2MB >> 20);
+		total += (size_t) mds->nr_pages * PGSIZE_2MB;
+	}
+	total += mcache_print_budget();
+	log_info("mempool: %-15s %10s %8s %6lu %4s %10lu\n", "total", "", "",
+		 total / PGSIZE_2MB, "", total >> 20);
+	return 0;
+}
+
 int mempool_init(void)
 {
 #ifdef ENABLE_KSTATS
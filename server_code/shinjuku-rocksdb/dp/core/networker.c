@@ -27,14 +27,22 @@
  * system and forwading them to the dispatcher.
  */
 #include <stdio.h>
+#include <string.h>
 #include <sys/time.h>
 #include <ix/vm.h>
+#include <ix/atomic.h>
 #include <ix/cfg.h>
 #include <ix/log.h>
 #include <ix/mbuf.h>
 #include <ix/dispatch.h>
 #include <ix/ethqueue.h>
+#include <ix/kstats.h>
+#include <ix/stats.h>
 #include <ix/transmit.h>
+#include <ix/timer.h>
+#include <ix/trace.h>
+
+#include <asm/cpu.h>
 
 #include <asm/chksum.h>
 
@@ -44,18 +52,20 @@
 DEFINE_PERCPU(struct mempool, ka_response_pool __attribute__((aligned(64))));
 
 /**
- * response_init - allocates global response datastore
+ * ka_response_init - allocates global keep alive response datastore
  */
 int ka_response_init(void)
 {
-        return mempool_create_datastore(&ka_response_datastore, 128000,
-                                        sizeof(struct message), 1,
-                                        MEMPOOL_DEFAULT_CHUNKSIZE,
-                                        "keep_alive");
+        return mempool_create_datastore_onnode(&ka_response_datastore,
+                                               CFG.pool_size[CFG_POOL_KA_RESPONSE],
+                                               sizeof(struct message), 1,
+                                               MEMPOOL_DEFAULT_CHUNKSIZE,
+                                               cfg_pool_name(CFG_POOL_KA_RESPONSE),
+                                               cfg_pool_numa_node(CFG_POOL_KA_RESPONSE));
 }
 
 /**
- * response_init_cpu - allocates per cpu response mempools
+ * ka_response_init_cpu - allocates the networker's keep alive mempool
  */
 int ka_response_init_cpu(void)
 {
@@ -124,6 +134,66 @@ int send_worker_id_ack () {
 }
 
 
+/*
+ * Sends an IDLE_SIGNAL on the reply path of worker i. Returns -EAGAIN if the
+ * worker never replied or is rewriting the path (see idle_signal_publish()).
+ */
+static int send_idle_signal(int i)
+{
+	struct idle_signal *sig = &idle_signals[i];
+	struct message resp;
+	struct ip_tuple dst;
+	uint32_t seq;
+
+	seq = sig->seq;
+	if (!seq || (seq & 1))
+		return -EAGAIN;
+	rmb();
+	memset(&resp, 0, sizeof(resp));
+	resp.pkt_type = PKT_TYPE_IDLE_SIGNAL;
+	resp.cluster_id = sig->cluster_id;
+	resp.src_id = sig->src_id;
+	resp.dst_id = SWAP_UINT16(CFG.parent_leaf_id);
+	dst = sig->dst;
+	rmb();
+	if (sig->seq != seq)
+		return -EAGAIN;
+	return udp_send_one((void *)&resp, sizeof(struct message), &dst);
+}
+
+/**
+ * idle_signal_poll - signals workers that stayed idle for the dwell time
+ * @now: current TSC
+ * @dwell: idle dwell time in cycles
+ * @interval: minimum cycles between two signals of the same worker
+ *
+ * Returns the number of signals sent.
+ */
+static int idle_signal_poll(uint64_t now, uint64_t dwell, uint64_t interval)
+{
+	struct idle_signal *sig;
+	uint64_t since;
+	int i, sent = 0;
+
+	for (i = 0; i < CFG.num_ports; i++) {
+		sig = &idle_signals[i];
+		since = sig->idle_since;
+		// Busy, already held idle by the leaf, or too early
+		if (!since || sig->announced || now - since < dwell)
+			continue;
+		if (sig->last_sent && now - sig->last_sent < interval)
+			continue;
+		if (queue_length[i] != 0 || sig->idle_since != since)
+			continue;
+		if (send_idle_signal(i))
+			continue;
+		sig->announced = 1;
+		sig->last_sent = now;
+		sent++;
+	}
+	return sent;
+}
+
 /**
  * do_networking - implements networking core's functionality
  * @parham: Receives packets from eth, and  fills the networker_pointer array, also removes the ones that are already done.
@@ -131,32 +201,81 @@ int send_worker_id_ack () {
  */
 void do_networking(void)
 {
-	ka_response_init();
 	ka_response_init_cpu();
-	int i, j, num_recv;
+	int i, j, num_recv, ret;
 	uint8_t core_id;
 	bool place_in_worker_queue;
 	struct timeval last_heart_beat;
 	uint64_t keep_alive_cnt = 0;
+	uint64_t rx_tsc = 0;
+	uint64_t now, wait, last_loop = rdtsc();
+	bool busy = false;
+	bool batching = CFG.batch_size > 1;
+	uint64_t idle_dwell = CFG.idle_signal_dwell_us * cycles_per_us;
+	uint64_t idle_interval = CFG.idle_signal_interval_us * cycles_per_us;
+#ifdef MCACHE_DEBUG
+	uint64_t last_leak_check = rdtsc();
+#endif
+#ifdef ENABLE_KSTATS
+	uint64_t last_lat_report = rdtsc();
+#endif
 	gettimeofday(&last_heart_beat, NULL);
 	rqueue.head = NULL;
 	
 	
 	while (1)
 	{	
-		
+		// Loop accounting: an iteration is busy if it received packets
+		now = rdtsc();
+		if (busy)
+			STATS_ADD(NET_BUSY_CYCLES, now - last_loop);
+		else
+			STATS_ADD(NET_IDLE_CYCLES, now - last_loop);
+		last_loop = now;
+		busy = false;
+		stats_publish(now);
 		if (check_time(last_heart_beat)) { // Time elapsed is longer than HEARTBEAT_INTERVAL_US
 			eth_process_reclaim();
         	eth_process_send();
-			if (!send_keep_alive(keep_alive_cnt++)) // If succesfull, record the curr time as last heart beat
+			if (!send_keep_alive(keep_alive_cnt++)) { // If succesfull, record the curr time as last heart beat
 				gettimeofday(&last_heart_beat, NULL);
+				STATS_INC(KEEP_ALIVES);
+			}
+		}
+#ifdef ENABLE_KSTATS
+		if (now - last_lat_report > KSTATS_LAT_INTERVAL_US * cycles_per_us) {
+			kstats_lat_report();
+			last_lat_report = now;
+		}
+#endif
+#ifdef MCACHE_DEBUG
+		if (now - last_leak_check > MCACHE_LEAK_CHECK_US * cycles_per_us) {
+			mcache_report_leaks(MCACHE_LEAK_AGE_US);
+			last_leak_check = now;
+		}
+#endif
+		if (idle_dwell && (ret = idle_signal_poll(rdtsc(), idle_dwell, idle_interval))) {
+			STATS_ADD(IDLE_SIGNALS, ret);
+			eth_process_reclaim();
+			eth_process_send();
 		}
 		eth_process_poll();
 		num_recv = eth_process_recv();
+		stats_rx_batch[num_recv < STATS_RX_BATCH_SLOTS ?
+			       num_recv : STATS_RX_BATCH_SLOTS - 1]++;
 		if (num_recv == 0)
 			continue;
-		while (networker_pointers.cnt != 0)
-			;
+		busy = true;
+		STATS_ADD(RX_PKTS, num_recv);
+		STATS_INC(RX_BATCHES);
+		if (unlikely(trace_sample))
+			rx_tsc = rdtsc();
+		if (networker_pointers.cnt != 0) {
+			wait = rdtsc();
+			while (networker_pointers.cnt != 0)
+				;
+			STATS_ADD(NET_WAIT_CYCLES, rdtsc() - wait);
+		}
 		for (i = 0; i < networker_pointers.free_cnt; i++)
 		{
 			struct request *req = networker_pointers.reqs[i];
@@ -164,7 +283,7 @@ void do_networking(void)
 			{
 				mbuf_free(req->mbufs[j]);
 			}
-			mempool_free(&request_mempool, req);
+			mcache_free(&request_cache, req);
 		}
 		networker_pointers.free_cnt = 0;
 		j = 0;
@@ -175,15 +294,40 @@ void do_networking(void)
 			struct request *req = rq_update(&rqueue, recv_mbufs[i], &core_id, &place_in_worker_queue);
 			if (req)
 			{
+				request_describe(req);
+				req->batch_id = 0;
+				req->batch_next = NULL;
+				if (batching && likely(req->data)) {
+					struct message *msg = req->data;
+
+					req->batch_id = app_batch_id(msg,
+							SWAP_UINT16(msg->client_id));
+				}
+#ifdef ENABLE_KSTATS
+				req->lat_class = 0;
+				if (likely(req->data)) {
+					struct message *msg = req->data;
+
+					req->lat_class = app_classify(msg,
+							SWAP_UINT16(msg->client_id));
+				}
+#endif
+				req->trace_id = trace_next_id();
+				if (unlikely(req->trace_id)) {
+					trace_emit(req->trace_id, TRACE_RX, rx_tsc, 0);
+					trace_emit(req->trace_id, TRACE_REASM, rdtsc(), 0);
+				}
 				networker_pointers.reqs[j] = req;
 				networker_pointers.types[j] = core_id; // core_id makes task to be queued in its dedicated queue (each worker has its queue)
 				//log_info("core_id: %u\n", (unsigned int) core_id);
 				j++;
 			} else if (!place_in_worker_queue) // Ctrl pkt for worker IDs
 			{
+				STATS_INC(CTRL_PKTS);
 				send_worker_id_ack();
 			}
 		}
+		STATS_ADD(RX_REQUESTS, j);
 		networker_pointers.cnt = j;
 	}
 }
@@ -26,23 +26,32 @@
 
 #include <ix/mem.h>
 #include <ix/stddef.h>
+#include <ix/cfg.h>
 #include <ix/mempool.h>
+#include <ix/mcache.h>
 #include <ix/dispatch.h>
 
-#define REQUEST_CAPACITY    (768*1024)
-#define RQ_CAPACITY   (768*1024)
-
-static int request_init_mempool(void)
+#ifdef MCACHE_DEBUG
+/* leak reports list the mbufs held by a request */
+static void request_describe_leak(void *obj, void *owner)
 {
-	struct mempool *m = &request_mempool;
-	return mempool_create(m, &request_datastore, MEMPOOL_SANITY_GLOBAL, 0);
+	struct request *req = obj;
+	int i;
+
+	log_warn("mcache:   request type %u pkts %u\n", req->type,
+		 req->pkts_length);
+	for (i = 0; i < req->pkts_length && i < ARRAY_SIZE(req->mbufs); i++)
+		log_warn("mcache:     mbuf %p\n", req->mbufs[i]);
 }
 
-static int rq_init_mempool(void)
+static void rq_cell_describe_leak(void *obj, void *owner)
 {
-	struct mempool *m = &rq_mempool;
-	return mempool_create(m, &rq_datastore, MEMPOOL_SANITY_GLOBAL, 0);
+	struct request_cell *rc = obj;
+
+	log_warn("mcache:   rq_cell client %u req %u pkts remaining %u\n",
+		 rc->client_id, rc->req_id, rc->pkts_remaining);
 }
+#endif
 
 /**
  * request_init - allocate request mempool
@@ -55,26 +64,38 @@ int request_init(void)
 	struct mempool_datastore *req = &request_datastore;
 	struct mempool_datastore *rq = &rq_datastore;
 
-	ret = mempool_create_datastore(req, REQUEST_CAPACITY, sizeof(struct request),
-                                       1, MEMPOOL_DEFAULT_CHUNKSIZE, "request");
+	ret = mempool_create_datastore_onnode(req, CFG.pool_size[CFG_POOL_REQUEST],
+                                              sizeof(struct request), 1,
+                                              MEMPOOL_DEFAULT_CHUNKSIZE,
+                                              cfg_pool_name(CFG_POOL_REQUEST),
+                                              cfg_pool_numa_node(CFG_POOL_REQUEST));
 	if (ret) {
 		return ret;
 	}
 
-        ret = request_init_mempool();
+        ret = mcache_create(&request_cache, &request_datastore);
         if (ret) {
                 return ret;
         }
+#ifdef MCACHE_DEBUG
+        request_cache.describe = request_describe_leak;
+#endif
 
-	ret = mempool_create_datastore(rq, RQ_CAPACITY, sizeof(struct request_cell),
-                                       1, MEMPOOL_DEFAULT_CHUNKSIZE, "rq_cell");
+	ret = mempool_create_datastore_onnode(rq, CFG.pool_size[CFG_POOL_RQ_CELL],
+                                              sizeof(struct request_cell), 1,
+                                              MEMPOOL_DEFAULT_CHUNKSIZE,
+                                              cfg_pool_name(CFG_POOL_RQ_CELL),
+                                              cfg_pool_numa_node(CFG_POOL_RQ_CELL));
 	if (ret) {
 		return ret;
 	}
 
-        ret = rq_init_mempool();
+        ret = mcache_create(&rq_cache, &rq_datastore);
         if (ret) {
                 return ret;
         }
+#ifdef MCACHE_DEBUG
+        rq_cache.describe = rq_cell_describe_leak;
+#endif
         return 0;
 }
@@ -0,0 +1,193 @@
+/*
+ * stats.c - runtime statistics exported through shared memory
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <ix/stddef.h>
+#include <ix/cfg.h>
+#include <ix/dispatch.h>
+#include <ix/errno.h>
+#include <ix/kstats.h>
+#include <ix/log.h>
+#include <ix/mcache.h>
+#include <ix/mem.h>
+#include <ix/stats.h>
+#include <ix/timer.h>
+
+__thread uint64_t stats_counters[STATS_NR_COUNTERS];
+__thread uint64_t stats_next_publish;
+__thread uint64_t stats_rx_batch[STATS_RX_BATCH_SLOTS];
+
+static struct stats_shm *stats_shm;
+
+static const char *stats_counter_names[STATS_NR_COUNTERS] = {
+	[STATS_RX_PKTS]		= "rx_pkts",
+	[STATS_RX_BATCHES]	= "rx_batches",
+	[STATS_RX_REQUESTS]	= "rx_requests",
+	[STATS_CTRL_PKTS]	= "ctrl_pkts",
+	[STATS_KEEP_ALIVES]	= "keep_alives",
+	[STATS_IDLE_SIGNALS]	= "idle_signals",
+	[STATS_NET_BUSY_CYCLES]	= "net_busy_cycles",
+	[STATS_NET_IDLE_CYCLES]	= "net_idle_cycles",
+	[STATS_NET_WAIT_CYCLES]	= "net_wait_cycles",
+	[STATS_ENQUEUED]	= "enqueued",
+	[STATS_DISPATCHED]	= "dispatched",
+	[STATS_REQUEUED]	= "requeued",
+	[STATS_COMPLETED]	= "completed",
+	[STATS_DROPS]		= "drops",
+	[STATS_BATCHES]		= "batches",
+	[STATS_BATCHED]		= "batched",
+	[STATS_DISP_BUSY_LOOPS]	= "disp_busy_loops",
+	[STATS_DISP_IDLE_LOOPS]	= "disp_idle_loops",
+	[STATS_DISP_NET_CYCLES]	= "disp_net_cycles",
+	[STATS_DISP_WORKER_CYCLES] = "disp_worker_cycles",
+	[STATS_DISP_IDLE_CYCLES] = "disp_idle_cycles",
+	[STATS_TASKS]		= "tasks",
+	[STATS_PREEMPTIONS]	= "preemptions",
+	[STATS_YIELDS]		= "yields",
+	[STATS_PARKS]		= "parks",
+	[STATS_CACHE_HITS]	= "cache_hits",
+	[STATS_CACHE_MISSES]	= "cache_misses",
+	[STATS_CACHE_HIT_CYCLES] = "cache_hit_cycles",
+	[STATS_CACHE_MISS_CYCLES] = "cache_miss_cycles",
+	[STATS_SHARD_LOCAL]	= "shard_local",
+	[STATS_SHARD_REMOTE]	= "shard_remote",
+	[STATS_UNKNOWN_CLIENT]	= "unknown_client",
+	[STATS_TX_ERRORS]	= "tx_errors",
+	[STATS_ALLOCS]		= "allocs",
+};
+
+static void *stats_map(size_t len)
+{
+	void *addr = MAP_FAILED;
+	int fd;
+
+	fd = shm_open(STATS_SHM_NAME, O_CREAT | O_RDWR, 0644);
+	if (fd >= 0) {
+		/* drop what an earlier run left behind */
+		if (!ftruncate(fd, 0) && !ftruncate(fd, len))
+			addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+				    MAP_SHARED, fd, 0);
+		close(fd);
+	}
+	if (addr != MAP_FAILED)
+		return addr;
+
+	log_warn("stats: cannot map %s, statistics are not exported\n",
+		 STATS_SHM_NAME);
+	return mmap(NULL, len, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+}
+
+/**
+ * stats_init - creates the shared memory statistics region
+ *
+ * Must run after app, which names the request classes.
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int stats_init(void)
+{
+	struct stats_shm *shm;
+	size_t len = align_up(sizeof(struct stats_shm), PGSIZE_4KB);
+	size_t hist_stride = 0;
+	int i, nr_workers = CFG.num_cpus - 2;
+
+#ifdef ENABLE_KSTATS
+	hist_stride = align_up(sizeof(struct kstats_lat), PGSIZE_4KB);
+#endif
+	shm = stats_map(len + nr_workers * hist_stride);
+	if (shm == MAP_FAILED)
+		return -ENOMEM;
+
+	shm->version = STATS_SHM_VERSION;
+	shm->size = len + nr_workers * hist_stride;
+	shm->cycles_per_us = cycles_per_us;
+	shm->nr_cpus = CFG.num_cpus;
+	shm->nr_workers = nr_workers;
+	shm->nr_counters = STATS_NR_COUNTERS;
+	shm->nr_classes = app_nr_classes;
+	shm->cores_off = offsetof(struct stats_shm, cores);
+	shm->core_size = sizeof(struct stats_core);
+	shm->rx_batch_off = offsetof(struct stats_core, rx_batch);
+	shm->rx_batch_slots = STATS_RX_BATCH_SLOTS;
+	if (hist_stride) {
+		shm->hist_off = len;
+		shm->hist_stride = hist_stride;
+		shm->hist_metrics = KSTATS_LAT_NR;
+		shm->hist_classes = KSTATS_LAT_CLASSES;
+		shm->hist_buckets = KSTATS_HIST_BUCKETS;
+		shm->hist_sub_bits = KSTATS_HIST_SUB_BITS;
+		shm->pmc_off = offsetof(struct kstats_lat, pmc);
+		shm->pmc_events = KSTATS_PMC_NR;
+	}
+	strncpy(shm->pools_shm, MCACHE_SHM_NAME, sizeof(shm->pools_shm) - 1);
+	for (i = 0; i < STATS_NR_COUNTERS; i++)
+		strncpy(shm->counter_names[i], stats_counter_names[i],
+			STATS_NAME_LEN - 1);
+	for (i = 0; i < app_nr_classes; i++)
+		strncpy(shm->class_names[i], app_class_names[i],
+			STATS_CLASS_LEN - 1);
+
+	for (i = 0; i < CFG.num_cpus; i++) {
+		shm->cores[i].cpu = CFG.cpu[i];
+		if (i == 0) {
+			shm->cores[i].role = STATS_ROLE_DISPATCHER;
+			shm->cores[i].nr_queues = nr_workers < CFG_MAX_PORTS ?
+						  nr_workers : CFG_MAX_PORTS;
+		} else if (i == 1) {
+			shm->cores[i].role = STATS_ROLE_NETWORKER;
+		} else {
+			shm->cores[i].role = STATS_ROLE_WORKER;
+		}
+	}
+
+	/* readers check the magic last */
+	wmb();
+	shm->magic = STATS_SHM_MAGIC;
+	stats_shm = shm;
+	return 0;
+}
+
+/**
+ * stats_shm_hist - finds the latency histograms of a worker in the region
+ * @worker: the worker index
+ *
+ * The pages are not touched yet, so the caller can place them.
+ *
+ * Returns a pointer to the histograms, or NULL if the region has none.
+ */
+void *stats_shm_hist(int worker)
+{
+	if (!stats_shm->hist_off)
+		return NULL;
+	return (char *) stats_shm + stats_shm->hist_off +
+	       (size_t) worker * stats_shm->hist_stride;
+}
+
+/**
+ * stats_publish_slow - copies the calling core's counters to its slot
+ * @now: the current TSC
+ */
+void stats_publish_slow(uint64_t now)
+{
+	struct stats_core *s = &stats_shm->cores[percpu_get(cpu_nr)];
+	int i;
+
+	*(volatile uint32_t *) &s->seq = s->seq + 1;
+	asm volatile("" ::: "memory");
+	memcpy(s->counters, stats_counters, sizeof(s->counters));
+	for (i = 0; i < s->nr_queues; i++)
+		s->queue_length[i] = queue_length[i];
+	if (s->role == STATS_ROLE_NETWORKER)
+		memcpy(s->rx_batch, stats_rx_batch, sizeof(s->rx_batch));
+	s->tsc = now;
+	asm volatile("" ::: "memory");
+	*(volatile uint32_t *) &s->seq = s->seq + 1;
+
+	stats_next_publish = now + STATS_PUBLISH_US * cycles_per_us;
+}
@@ -26,24 +26,11 @@
 
 #include <ix/mem.h>
 #include <ix/stddef.h>
+#include <ix/cfg.h>
 #include <ix/mempool.h>
+#include <ix/mcache.h>
 #include <ix/dispatch.h>
 
-#define TASK_CAPACITY    (768*1024)
-#define MCELL_CAPACITY   (768*1024)
-
-static int task_init_mempool(void)
-{
-	struct mempool *m = &task_mempool;
-	return mempool_create(m, &task_datastore, MEMPOOL_SANITY_GLOBAL, 0);
-}
-
-static int fini_request_cell_init_mempool(void)
-{
-	struct mempool *m = &fini_request_cell_mempool;
-	return mempool_create(m, &fini_request_cell_datastore, MEMPOOL_SANITY_GLOBAL, 0);
-}
-
 /**
  * taskqueue_init - allocate global task mempool
  *
@@ -55,24 +42,30 @@ int taskqueue_init(void)
 	struct mempool_datastore *t = &task_datastore;
 	struct mempool_datastore *m = &fini_request_cell_datastore;
 
-	ret = mempool_create_datastore(t, TASK_CAPACITY, sizeof(struct task),
-                                       1, MEMPOOL_DEFAULT_CHUNKSIZE, "task");
+	ret = mempool_create_datastore_onnode(t, CFG.pool_size[CFG_POOL_TASK],
+                                              sizeof(struct task), 1,
+                                              MEMPOOL_DEFAULT_CHUNKSIZE,
+                                              cfg_pool_name(CFG_POOL_TASK),
+                                              cfg_pool_numa_node(CFG_POOL_TASK));
 	if (ret) {
 		return ret;
 	}
 
-        ret = task_init_mempool();
+        ret = mcache_create(&task_cache, &task_datastore);
         if (ret) {
                 return ret;
         }
 
-	ret = mempool_create_datastore(m, MCELL_CAPACITY, sizeof(struct fini_request_cell),
-                                       1, MEMPOOL_DEFAULT_CHUNKSIZE, "frcell");
+	ret = mempool_create_datastore_onnode(m, CFG.pool_size[CFG_POOL_FRCELL],
+                                              sizeof(struct fini_request_cell), 1,
+                                              MEMPOOL_DEFAULT_CHUNKSIZE,
+                                              cfg_pool_name(CFG_POOL_FRCELL),
+                                              cfg_pool_numa_node(CFG_POOL_FRCELL));
 	if (ret) {
 		return ret;
 	}
 
-        ret = fini_request_cell_init_mempool();
+        ret = mcache_create(&fini_request_cell_cache, &fini_request_cell_datastore);
         if (ret) {
                 return ret;
         }
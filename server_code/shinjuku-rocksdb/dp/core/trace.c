@@ -0,0 +1,145 @@
+/*
+ * trace.c - sampled per-request lifecycle tracing
+ *
+ * The rings are drained by a plain (non data plane) thread that runs at the
+ * lowest priority on the CPUs not listed in the "cpu" configuration, and
+ * appends the raw events to CFG.trace_file behind a struct trace_file_hdr.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <ix/stddef.h>
+#include <ix/cfg.h>
+#include <ix/cpu.h>
+#include <ix/errno.h>
+#include <ix/log.h>
+#include <ix/mem.h>
+#include <ix/timer.h>
+#include <ix/trace.h>
+
+#define TRACE_DRAIN_BATCH	4096
+#define TRACE_DRAIN_SLEEP_US	1000
+
+uint32_t trace_sample;
+struct trace_ring trace_rings[CFG_MAX_CPU];
+
+static FILE *trace_file;
+static int trace_nr_rings;
+
+static size_t trace_drain_ring(struct trace_ring *r, struct trace_event *buf)
+{
+	uint64_t head, tail = r->tail;
+	size_t n, pos, total = 0;
+
+	head = *(volatile uint64_t *) &r->head;
+	/* read the events only after the head that covers them */
+	asm volatile("" ::: "memory");
+
+	while (tail != head) {
+		pos = tail & (TRACE_RING_SIZE - 1);
+		n = head - tail;
+		if (n > TRACE_RING_SIZE - pos)
+			n = TRACE_RING_SIZE - pos;
+		if (n > TRACE_DRAIN_BATCH)
+			n = TRACE_DRAIN_BATCH;
+		memcpy(buf, &r->events[pos], n * sizeof(*buf));
+		asm volatile("" ::: "memory");
+		tail += n;
+		*(volatile uint64_t *) &r->tail = tail;
+		if (fwrite(buf, sizeof(*buf), n, trace_file) != n)
+			log_warn("trace: short write, events lost\n");
+		total += n;
+	}
+	return total;
+}
+
+static void *trace_drain(void *arg)
+{
+	struct trace_event *buf = arg;
+	uint64_t drops, reported = 0;
+	size_t drained;
+	int i;
+
+	if (cpu_pin_spare())
+		log_warn("trace: no spare CPU, the drainer shares the data plane cores\n");
+
+	while (true) {
+		drained = 0;
+		drops = 0;
+		for (i = 0; i < trace_nr_rings; i++) {
+			drained += trace_drain_ring(&trace_rings[i], buf);
+			drops += trace_rings[i].drops;
+		}
+		if (drops != reported) {
+			log_warn("trace: %lu events dropped, rings full\n",
+				 drops - reported);
+			reported = drops;
+		}
+		if (!drained) {
+			fflush(trace_file);
+			usleep(TRACE_DRAIN_SLEEP_US);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * trace_init - allocates the per-core rings and starts the drainer
+ *
+ * Does nothing unless trace_sample is set in the configuration.
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int trace_init(void)
+{
+	struct trace_file_hdr hdr;
+	struct trace_event *buf;
+	pthread_t tid;
+	size_t len = TRACE_RING_SIZE * sizeof(struct trace_event);
+	int i;
+
+	if (!CFG.trace_sample)
+		return 0;
+
+	for (i = 0; i < CFG.num_cpus; i++) {
+		trace_rings[i].events =
+			mem_alloc_pages_onnode(div_up(len, PGSIZE_2MB), PGSIZE_2MB,
+					       cpu_numa_node_of(CFG.cpu[i]),
+					       MPOL_PREFERRED);
+		if (trace_rings[i].events == MAP_FAILED || !trace_rings[i].events)
+			return -ENOMEM;
+	}
+	trace_nr_rings = CFG.num_cpus;
+
+	trace_file = fopen(CFG.trace_file, "w");
+	if (!trace_file) {
+		log_err("trace: cannot open %s\n", CFG.trace_file);
+		return -EIO;
+	}
+	memcpy(hdr.magic, TRACE_FILE_MAGIC, sizeof(hdr.magic));
+	hdr.version = TRACE_FILE_VERSION;
+	hdr.event_size = sizeof(struct trace_event);
+	hdr.cycles_per_us = cycles_per_us;
+	if (fwrite(&hdr, sizeof(hdr), 1, trace_file) != 1)
+		return -EIO;
+
+	buf = malloc(TRACE_DRAIN_BATCH * sizeof(*buf));
+	if (!buf)
+		return -ENOMEM;
+	if (pthread_create(&tid, NULL, trace_drain, buf)) {
+		log_err("trace: unable to create the drainer thread\n");
+		return -EAGAIN;
+	}
+
+	trace_sample = CFG.trace_sample;
+	log_info("trace: tracing 1 of %u requests to %s\n", CFG.trace_sample,
+		 CFG.trace_file);
+	return 0;
+}
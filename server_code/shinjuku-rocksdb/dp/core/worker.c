@@ -24,11 +24,10 @@
  * worker.c - Worker core functionality
  *
  * Poll dispatcher CPU to get request to execute. The request is in the form
- * of ucontext_t. If interrupted, swap to main context and poll for next
+ * of a context (coroutine). If interrupted, swap to main context and poll for next
  * request.
  */
 
-#include <ucontext.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -39,7 +38,8 @@
 #include <sys/types.h>
 #include <sys/resource.h>
 
-#include <ix/rocksdb.h>
+#include <ix/app.h>
+#include <ix/atomic.h>
 #include <ix/hijack.h>
 #include <ix/cpu.h>
 #include <ix/log.h>
@@ -47,8 +47,11 @@
 #include <asm/cpu.h>
 #include <ix/context.h>
 #include <ix/dispatch.h>
+#include <ix/kstats.h>
+#include <ix/probe.h>
+#include <ix/stats.h>
 #include <ix/transmit.h>
-#include <ix/intersection.h>
+#include <ix/trace.h>
 
 #include <c.h>
 #include <dune.h>
@@ -62,20 +65,23 @@
 #define TYPE_REQ 1
 #define TYPE_RES 0
 #define PREEMPT_VECTOR 0xf2
+#define TASK_STARTUP_REPORT_INTERVAL (1 << 20) // tasks between two startup reports
 
-__thread ucontext_t uctx_main;
-__thread ucontext_t * cont;
+__thread struct context ctx_main;
+__thread struct context * cont;
 __thread int cpu_nr_;
 __thread volatile uint8_t finished;
+__thread uint8_t yielded;
+__thread volatile bool * parked_on; // the event of worker_park(), if parked
+__thread uint64_t task_pickup; // HORUS: TSC when the current new packet was picked up
+#ifdef ENABLE_KSTATS
+__thread uint64_t slice_start; // TSC when the current task got the core
+#endif
 
 extern uint8_t flag;
 
 DEFINE_PERCPU(struct mempool, response_pool __attribute__((aligned(64))));
 
-extern int getcontext_fast(ucontext_t *ucp);
-extern int swapcontext_fast(ucontext_t *ouctx, ucontext_t *uctx);
-extern int swapcontext_very_fast(ucontext_t *ouctx, ucontext_t *uctx);
-
 extern void dune_apic_eoi();
 extern int dune_register_intr_handler(int vector, dune_intr_cb cb);
 
@@ -84,10 +90,12 @@ extern int dune_register_intr_handler(int vector, dune_intr_cb cb);
  */
 int response_init(void)
 {
-        return mempool_create_datastore(&response_datastore, 128000,
-                                        sizeof(struct message), 1,
-                                        MEMPOOL_DEFAULT_CHUNKSIZE,
-                                        "response");
+        return mempool_create_datastore_onnode(&response_datastore,
+                                               CFG.pool_size[CFG_POOL_RESPONSE],
+                                               sizeof(struct message), 1,
+                                               MEMPOOL_DEFAULT_CHUNKSIZE,
+                                               cfg_pool_name(CFG_POOL_RESPONSE),
+                                               cfg_pool_numa_node(CFG_POOL_RESPONSE));
 }
 
 /**
@@ -100,154 +108,229 @@ int response_init_cpu(void)
                               percpu_get(cpu_id));
 }
 
-static void test_handler(struct dune_tf *tf)
+/*
+ * HORUS: Prefetch pipeline for the next new packet of this worker. At task
+ * start only the request (descriptor) is prefetched; by the time the task
+ * finishes it is cached, so its payload pointer can be read cheaply and the
+ * payload prefetched before the worker returns to the dispatcher.
+ */
+static inline void prefetch_next_request(void)
 {
-    asm volatile ("cli":::);
-    dune_apic_eoi();
-    swapcontext_fast_to_control(cont, &uctx_main);   
+        struct request * next = dispatcher_requests[cpu_nr_].next;
+
+        if (next) {
+                prefetch0(next);
+                prefetch0((char *) next + 64);
+        }
 }
 
-static void rocksdb_work(struct message * req) {
-    rocksdb_readoptions_t * readoptions = rocksdb_readoptions_create();
-    rocksdb_iterator_t * iter = rocksdb_create_iterator(db, readoptions);
-    int counter = 0;
+static inline void prefetch_next_payload(void)
+{
+        struct request * next = dispatcher_requests[cpu_nr_].next;
+        char * data;
 
-    /*
-    * @parham: different tasks at worker based on runNs (set by client). 
-    * Client sends runNs 500 for GET and 0 for SCAN functions.
-    */
-    if (req->runNs > 0) {
-        //log_info("\nRUNS 0\n");
-        size_t long_size;
-        char long_key[8];
-                snprintf(long_key, 8, "long_key");
-        for (int i = 0; i < 60; i++) {
-            char * long_val = rocksdb_get(db, readoptions, long_key, 8,
-                                                      &long_size, NULL);
-            //log_info("got string from DB %s \n", long_val);
-            //log_info("str size %d \n", strlen(long_val));
-            free(long_val);
-        }
-    } else {
-        //log_info("\nRUNS 1\n");
-        for (rocksdb_iter_seek_to_first(iter); rocksdb_iter_valid(iter); rocksdb_iter_next(iter)) {
-            char * retr_key;
-            size_t klen;
-            retr_key = rocksdb_iter_key(iter, &klen);
-            if (req->runNs > 0 && ++counter > 5000)
-                break;
-        }
-    }
-    rocksdb_iter_destroy(iter);
-    rocksdb_readoptions_destroy(readoptions);
+        if (!next || !(data = next->data))
+                return;
+        prefetch0(data);
+        prefetch0(data + 64);
+        prefetch0(data + 128);
 }
 
-uint64_t * search_work(struct message * req) {
-    uint64_t query_word_ids[MAX_QUERY_WORDS];
-    uint64_t *intersection_res, *intermediate_res;
-    uint64_t intersection_tmp[2][1 + MAX_INSERSECTION_DOCS];
-    uint64_t query_word_cnt = req->runNs;
-    
-    for (unsigned i = 0; i < query_word_cnt; i++) {
-        query_word_ids[i] = req->app_data[i];
-    }
-    uint32_t word_id_ofst = query_word_ids[0]-1;
-    intersection_res = word_to_docids[word_id_ofst];
+static inline void account_task_startup(void)
+{
+        struct task_startup_stats * s = &task_startup[cpu_nr_];
+        uint64_t cycles = rdtsc() - task_pickup;
 
-    for (unsigned intersection_opr_cnt = 1; intersection_opr_cnt < query_word_cnt; intersection_opr_cnt++) {
-      word_id_ofst = query_word_ids[intersection_opr_cnt]-1;
-      intermediate_res = intersection_tmp[intersection_opr_cnt % 2];
+        s->count++;
+        s->cycles += cycles;
+        if (cycles > s->max_cycles)
+                s->max_cycles = cycles;
+}
 
-      compute_intersection(intersection_res, word_to_docids[word_id_ofst], intermediate_res);
-      intersection_res = intermediate_res;
+/*
+ * Latency histograms: a task's service time is the sum of its slices on the
+ * workers, its sojourn time runs from its enqueue at the dispatcher to the
+ * return of the application handler. Each slice also charges its CPU
+ * counters to the request class.
+ */
+static inline void account_slice_start(struct request * req, bool first)
+{
+#ifdef ENABLE_KSTATS
+        slice_start = first ? task_pickup : rdtsc();
+        if (first)
+                req->run_cycles = 0;
+        kstats_pmc_slice_start();
+#endif
+}
 
-      if (intersection_res[0] == 0) // stop if the intersection is empty
-        break;
-    }
-    return intersection_res;
+static inline void account_slice_end(struct request * req)
+{
+#ifdef ENABLE_KSTATS
+        uint64_t cycles = rdtsc() - slice_start;
+
+        req->run_cycles += cycles;
+        kstats_pmc_slice_end(cpu_nr_, req->lat_class, cycles, false);
+#endif
 }
 
+static inline void account_finish(struct request * req)
+{
+#ifdef ENABLE_KSTATS
+        uint64_t now = rdtsc();
+
+        kstats_pmc_slice_end(cpu_nr_, req->lat_class, now - slice_start, true);
+        KSTATS_LAT_RECORD(KSTATS_LAT_SERVICE, cpu_nr_, req->lat_class,
+                          req->run_cycles + now - slice_start);
+        KSTATS_LAT_RECORD(KSTATS_LAT_SOJOURN, cpu_nr_, req->lat_class,
+                          now - dispatcher_requests[cpu_nr_].timestamp);
+#endif
+}
 
-/**
- * generic_work - generic function acting as placeholder for application-level
- *                work
- * @msw: the top 32-bits of the pointer containing the data
- * @lsw: the bottom 32 bits of the pointer containing the data
+/*
+ * Every request of a batch is charged the whole batch as service time, the
+ * CPU counters of the slice are split among them by task count.
  */
-static void generic_work(uint32_t msw, uint32_t lsw, uint32_t msw_id,
-                         uint32_t lsw_id)
+static inline void account_finish_batch(struct request ** tasks, int n)
 {
-    asm volatile ("sti":::);
+#ifdef ENABLE_KSTATS
+        uint64_t now = rdtsc();
+        uint64_t service = tasks[0]->run_cycles + now - slice_start;
+        int i;
+
+        kstats_pmc_slice_end(cpu_nr_, tasks[0]->lat_class, now - slice_start,
+                             n);
+        KSTATS_LAT_RECORD(KSTATS_LAT_SERVICE, cpu_nr_, tasks[0]->lat_class,
+                          service);
+        KSTATS_LAT_RECORD(KSTATS_LAT_SOJOURN, cpu_nr_, tasks[0]->lat_class,
+                          now - dispatcher_requests[cpu_nr_].timestamp);
+        for (i = 1; i < n; i++) {
+                KSTATS_LAT_RECORD(KSTATS_LAT_SERVICE, cpu_nr_,
+                                  tasks[i]->lat_class, service);
+                KSTATS_LAT_RECORD(KSTATS_LAT_SOJOURN, cpu_nr_,
+                                  tasks[i]->lat_class,
+                                  now - tasks[i]->enqueued);
+        }
+#endif
+}
 
-    struct ip_tuple * id = (struct ip_tuple *) ((uint64_t) msw_id << 32 | lsw_id);
-    void * data = (void *)((uint64_t) msw << 32 | lsw);
-    int ret;
+static void report_task_startup(void)
+{
+        struct task_startup_stats * s = &task_startup[cpu_nr_];
 
-    struct message * req = (struct message *) data;
-    uint64_t *intersection_res;
-    // log_info("Generic work being executed on %d\n", cpu_nr_);
-    // log_info("queue_length %d: %d\n", cpu_nr_, queue_length[cpu_nr_]);
-    // log_info("worker_state %d: %d\n", cpu_nr_, worker_state[cpu_nr_]);
-    uint16_t client_id = SWAP_UINT16(req->client_id);
-    if (client_id == ROCKSDB_CLIENT) {
-        rocksdb_work(req);
-    } else if (client_id == SEARCH_CLIENT) {
-        intersection_res = search_work(req);
-    } else {
-        log_info("Unknown Client ID %d\n", client_id);
-    }
-    
+        log_info("worker %d: task startup avg %lu max %lu cycles (%lu tasks)\n",
+                 cpu_nr_, s->cycles / s->count, s->max_cycles, s->count);
+        s->count = 0;
+        s->cycles = 0;
+        s->max_cycles = 0;
+}
 
-	/* 
-     * For synthetic workloads (generate different service times) use below:
-        uint64_t i = 0;
-        do {
-                asm volatile ("nop");
-                i++;
-        } while ( i / 0.233 < req->runNs);
-    */
+static void test_handler(struct dune_tf *tf)
+{
+    asm volatile ("cli":::);
+    dune_apic_eoi();
+    // The interrupt frame on the task stack keeps the caller-saved registers
+    context_switch(cont, &ctx_main);
+}
 
-    
+/**
+ * worker_yield - lets the worker serve other requests of its queue
+ *
+ * A handler of a long request calls it between two chunks of work. The
+ * request goes back to the tail of the worker queue with its context, and
+ * resumes here once the dispatcher hands it back. This bounds the delay of
+ * short requests without IPI preemption. Does nothing if no other request
+ * can run meanwhile: the requests in worker_park() only wait.
+ *
+ * Returns true if the request yielded.
+ */
+bool worker_yield(void)
+{
+    // HORUS: the running request counts in the queue length, as do parked ones
+    if (queue_length[cpu_nr_] - park_length[cpu_nr_] <= 1)
+        return false;
     asm volatile ("cli":::);
-    struct message resp;
-    if (client_id == SEARCH_CLIENT) { // Write additional search result data to pkt
-        uint64_t intersection_size = intersection_res[0];
-        resp.runNs = intersection_size;
-        for (unsigned i = 0; i < intersection_size; i++) {
-            resp.app_data[i] = intersection_res[1+i];
-        }
-        
-    } else {
-        resp.runNs = req->runNs;    
+    yielded = true;
+    context_switch(cont, &ctx_main);
+    asm volatile ("sti":::);
+    return true;
+}
+
+/**
+ * worker_park - waits for an event without holding the worker
+ * @done: set by another thread once the request can go on
+ *
+ * A handler that waits for a helper thread (a group commit, a read on an
+ * I/O thread) calls it instead of spinning. Like worker_yield(), the request
+ * leaves the worker with its context, but the dispatcher keeps it aside and
+ * only puts it back in the worker queue once *@done is set. Meanwhile the
+ * worker serves the other requests of its queue, or idles. Returns at once
+ * if *@done is already set.
+ */
+void worker_park(volatile bool * done)
+{
+    // Also covers an early resume, see handle_parked()
+    while (!*done) {
+        asm volatile ("cli":::);
+        parked_on = done;
+        context_switch(cont, &ctx_main);
+        asm volatile ("sti":::);
     }
-	resp.genNs = req->genNs;
+}
+
+/*
+ * Stores the reply path for idle_signal_poll() (networker.c), which retries
+ * its copy while @sig->seq is odd or changed under it.
+ */
+static inline void idle_signal_publish(struct idle_signal * sig,
+                                       struct message * resp,
+                                       struct ip_tuple * dst)
+{
+    sig->seq++;
+    wmb();
+    sig->cluster_id = resp->cluster_id;
+    sig->src_id = resp->src_id;
+    sig->dst = *dst;
+    wmb();
+    sig->seq++;
+}
+
+/*
+ * Fills the Horus header of a reply and sends it. @new_qlen is the length of
+ * the worker queue once the request is done. Runs with interrupts off.
+ */
+static void send_reply(struct request * task, struct message * req,
+                       struct message * resp, uint16_t new_qlen)
+{
+    struct ip_tuple * id = &task->id;
+    int ret;
+
+	resp->genNs = req->genNs;
 	
-    resp.cluster_id = req->cluster_id;
-	resp.client_id = req->client_id;
-	resp.req_id = req->req_id;
-    uint16_t new_qlen;
+    resp->cluster_id = req->cluster_id;
+	resp->client_id = req->client_id;
+	resp->req_id = req->req_id;
     // HORUS: Set the latest worker qlen of the worker core in header field
-    new_qlen = queue_length[cpu_nr_] - 1;
-    resp.qlen = new_qlen;
+    resp->qlen = new_qlen;
 
     // HORUS: Sending reply back to the client:
-    resp.src_id = (req->dst_id);
-    resp.dst_id = (req->client_id);
+    resp->src_id = (req->dst_id);
+    resp->dst_id = (req->client_id);
     
     // HORUS: Leaf does not have this worker in its idle list and it became idle;
     // use PKT_TYPE_TASK_DONE_IDLE so that leaf add the worker to idle list. 
     if (new_qlen == 0 && (worker_state[cpu_nr_] > 0)) { 
-        resp.pkt_type = PKT_TYPE_TASK_DONE_IDLE; 
+        resp->pkt_type = PKT_TYPE_TASK_DONE_IDLE; 
+        idle_signals[cpu_nr_].announced = 1;
         //log_info("worker IDLE %d: %d\n", cpu_nr_, worker_state[cpu_nr_]);
         // sent_idles += 1;
         // log_info("sent_idles: %u", sent_idles); 
     } else {
-        resp.pkt_type = PKT_TYPE_TASK_DONE;
+        resp->pkt_type = PKT_TYPE_TASK_DONE;
     }
-    // if (resp.qlen > 0) {
-    //     resp.pkt_type = PKT_TYPE_TASK_DONE;
-    // } else if (resp.qlen == 0 && req->qlen==0){
-    //     resp.pkt_type = PKT_TYPE_TASK_DONE_IDLE;
+    // if (resp->qlen > 0) {
+    //     resp->pkt_type = PKT_TYPE_TASK_DONE;
+    // } else if (resp->qlen == 0 && req->qlen==0){
+    //     resp->pkt_type = PKT_TYPE_TASK_DONE_IDLE;
     // }
 
     struct ip_tuple new_id = {
@@ -257,40 +340,122 @@ static void generic_work(uint32_t msw, uint32_t lsw, uint32_t msw_id,
             .dst_port = id->src_port
     };
 
-    resp.qlen = SWAP_UINT16(resp.qlen); 
-    ret = udp_send_one((void *)&resp, sizeof(struct message), &new_id); // HORUS: Send reply
-    if (ret)
+    // HORUS: Remember the reply path so the networker can signal idleness for us
+    idle_signal_publish(&idle_signals[cpu_nr_], resp, &new_id);
+
+    resp->qlen = SWAP_UINT16(resp->qlen); 
+    ret = udp_send_one((void *)resp, sizeof(struct message), &new_id); // HORUS: Send reply
+    if (ret) {
         log_warn("udp_send failed with error %d\n", ret);
+        STATS_INC(TX_ERRORS);
+    }
+    if (unlikely(task->trace_id))
+        trace_emit(task->trace_id, TRACE_TX, rdtsc(), cpu_nr_);
+    PROBE(work_done, task, req->req_id, cpu_nr_, new_qlen);
+}
 
-    finished = true;
-    swapcontext_very_fast(cont, &uctx_main);
+/*
+ * Serves the requests chained to @task by the dispatcher with one call of
+ * their handler, then replies to each of them in queue order.
+ */
+static void batch_work(struct request * task)
+{
+    struct request * tasks[CFG_MAX_BATCH];
+    struct message * reqs[CFG_MAX_BATCH];
+    struct message resps[CFG_MAX_BATCH];
+    struct app_handler * app;
+    void * state;
+    int i, n = 0;
+
+    for (; task && n < CFG_MAX_BATCH; task = task->batch_next, n++) {
+        tasks[n] = task;
+        reqs[n] = task->data;
+        PROBE(work_start, task, reqs[n]->req_id, cpu_nr_);
+        if (unlikely(task->trace_id) && n)
+            trace_emit(task->trace_id, TRACE_START, task_pickup, cpu_nr_);
+    }
+    // The networker only batches requests of handlers that can serve them
+    app = app_lookup(SWAP_UINT16(reqs[0]->client_id), &state);
+    account_task_startup();
+    prefetch_next_request();
+    app->handle_batch(state, reqs, resps, n);
+    account_finish_batch(tasks, n);
+    for (i = 0; i < n; i++)
+        if (unlikely(tasks[i]->trace_id))
+            trace_emit(tasks[i]->trace_id, TRACE_FINISH, rdtsc(), cpu_nr_);
+    prefetch_next_payload();
+
+    asm volatile ("cli":::);
+    // HORUS: every request of the batch still counts in the queue length
+    for (i = 0; i < n; i++)
+        send_reply(tasks[i], reqs[i], &resps[i],
+                   queue_length[cpu_nr_] - 1 - i);
 }
 
-static inline void parse_packet(struct mbuf * pkt, void ** data_ptr,
-                                struct ip_tuple ** id_ptr)
+/*
+ * Serves a single request and replies to it.
+ */
+static void single_work(struct request * task)
 {
-        // Quickly parse packet without doing checks
-        struct eth_hdr * ethhdr = mbuf_mtod(pkt, struct eth_hdr *);
-        struct ip_hdr *  iphdr = mbuf_nextd(ethhdr, struct ip_hdr *);
-        int hdrlen = iphdr->header_len * sizeof(uint32_t);
-        struct udp_hdr * udphdr = mbuf_nextd_off(iphdr, struct udp_hdr *,
-                                                 hdrlen);
-        // Get data and udp header
-        (*data_ptr) = mbuf_nextd(udphdr, void *);
-        uint16_t len = ntoh16(udphdr->len);
-
-        if (unlikely(!mbuf_enough_space(pkt, udphdr, len))) {
-                log_warn("worker: not enough space in mbuf\n");
-                (*data_ptr) = NULL;
-                return;
-        }
+    void * data = task->data;
 
-        (*id_ptr) = mbuf_mtod(pkt, struct ip_tuple *);
-        (*id_ptr)->src_ip = ntoh32(iphdr->src_addr.addr);
-        (*id_ptr)->dst_ip = ntoh32(iphdr->dst_addr.addr);
-        (*id_ptr)->src_port = ntoh16(udphdr->src_port);
-        (*id_ptr)->dst_port = ntoh16(udphdr->dst_port);
-        pkt->done = (void *) 0xDEADBEEF;
+    struct message * req = (struct message *) data;
+    struct message resp;
+    struct app_handler * app;
+    void * state;
+    // log_info("Generic work being executed on %d\n", cpu_nr_);
+    // log_info("queue_length %d: %d\n", cpu_nr_, queue_length[cpu_nr_]);
+    // log_info("worker_state %d: %d\n", cpu_nr_, worker_state[cpu_nr_]);
+    uint16_t client_id = SWAP_UINT16(req->client_id);
+    PROBE(work_start, task, req->req_id, cpu_nr_);
+    app = app_lookup(client_id, &state);
+    account_task_startup();
+    prefetch_next_request();
+    if (likely(app)) {
+        app->handle(state, req, &resp);
+    } else {
+        log_info("Unknown Client ID %d\n", client_id);
+        STATS_INC(UNKNOWN_CLIENT);
+        resp.runNs = req->runNs;
+    }
+    account_finish(task);
+    if (unlikely(task->trace_id))
+        trace_emit(task->trace_id, TRACE_FINISH, rdtsc(), cpu_nr_);
+    prefetch_next_payload();
+    
+
+	/* 
+     * For synthetic workloads (generate different service times) use below:
+        uint64_t i = 0;
+        do {
+                asm volatile ("nop");
+                i++;
+        } while ( i / 0.233 < req->runNs);
+    */
+
+    
+    asm volatile ("cli":::);
+    send_reply(task, req, &resp, queue_length[cpu_nr_] - 1);
+}
+
+/**
+ * generic_work - generic function acting as placeholder for application-level
+ *                work
+ * @arg: the request, with its descriptor filled by the networker
+ */
+static void generic_work(void * arg)
+{
+    asm volatile ("sti":::);
+
+    struct request * task = (struct request *) arg;
+
+    if (task->batch_next)
+        batch_work(task);
+    else
+        single_work(task);
+
+    finished = true;
+    context_switch(cont, &ctx_main);
 }
 
 static inline void init_worker(void)
@@ -298,11 +463,14 @@ static inline void init_worker(void)
         cpu_nr_ = percpu_get(cpu_nr) - 2;
         worker_responses[cpu_nr_].flag = PROCESSED;
         worker_state[cpu_nr_] = 0; // HORUS: Initial state of all workers are 0 (in idle list of leaf)
-        if (cpu_nr_ == 0) {
-            // Initialize search app requirements
-            load_docs();
-            log_info("Search App init: Loaded %d words.\n", word_cnt);
-        }
+        idle_signals[cpu_nr_].announced = 1;
+#ifdef ENABLE_KSTATS
+        kstats_pmc_init_worker(cpu_nr_);
+#endif
+        // Preallocate and warm the per-core application state before traffic
+        if (app_init_cpu())
+                panic("worker %d: could not initialize applications\n", cpu_nr_);
+        app_warmup();
         dune_register_intr_handler(PREEMPT_VECTOR, test_handler);
         eth_process_reclaim();
         asm volatile ("cli":::);
@@ -310,29 +478,14 @@ static inline void init_worker(void)
 
 static inline void handle_new_packet(void)
 {
-        int ret;
-        void * data;
-        struct ip_tuple * id;
-        struct mbuf * pkt = (struct mbuf *) dispatcher_requests[cpu_nr_].req->mbufs[0];
-        
-        parse_packet(pkt, &data, &id);
-        
-        if (data) {
-                uint32_t msw = ((uint64_t) data & 0xFFFFFFFF00000000) >> 32;
-                uint32_t lsw = (uint64_t) data & 0x00000000FFFFFFFF;
-                uint32_t msw_id = ((uint64_t) id & 0xFFFFFFFF00000000) >> 32;
-                uint32_t lsw_id = (uint64_t) id & 0x00000000FFFFFFFF;
+        struct request * req = dispatcher_requests[cpu_nr_].req;
+
+        // HORUS: headers were parsed by the networker (request_describe)
+        if (req->data) {
                 cont = dispatcher_requests[cpu_nr_].rnbl;
-                getcontext_fast(cont);
-                set_context_link(cont, &uctx_main);
-                makecontext(cont, (void (*)(void)) generic_work, 4, msw, lsw,
-                            msw_id, lsw_id);
+                context_make(cont, generic_work, req);
                 finished = false;
-                ret = swapcontext_very_fast(&uctx_main, cont);
-                if (ret) {
-                        log_err("Failed to do swap into new context\n");
-                        exit(-1);
-                }
+                context_switch(&ctx_main, cont);
         } else {
                 log_info("OOPS No Data\n");
                 finished = true;
@@ -341,15 +494,14 @@ static inline void handle_new_packet(void)
 
 static inline void handle_context(void)
 {
-        int ret;
+        struct request * req = dispatcher_requests[cpu_nr_].req;
+
+        if (unlikely(req->trace_id))
+                trace_emit(req->trace_id, TRACE_RESUME, rdtsc(), cpu_nr_);
+        account_slice_start(req, false);
         finished = false;
         cont = dispatcher_requests[cpu_nr_].rnbl;
-        set_context_link(cont, &uctx_main);
-        ret = swapcontext_fast(&uctx_main, cont);
-        if (ret) {
-                log_err("Failed to swap to existing context\n");
-                exit(-1);
-        }
+        context_switch(&ctx_main, cont);
 }
 
 static inline void handle_request(void)
@@ -357,7 +509,11 @@ static inline void handle_request(void)
         while (dispatcher_requests[cpu_nr_].flag == WAITING);
         dispatcher_requests[cpu_nr_].flag = WAITING;
         if (dispatcher_requests[cpu_nr_].category == PACKET){
-                
+                task_pickup = rdtsc();
+                if (unlikely(dispatcher_requests[cpu_nr_].req->trace_id))
+                        trace_emit(dispatcher_requests[cpu_nr_].req->trace_id,
+                                   TRACE_START, task_pickup, cpu_nr_);
+                account_slice_start(dispatcher_requests[cpu_nr_].req, true);
                 handle_new_packet();
         }
         else{
@@ -377,9 +533,31 @@ static inline void finish_request(void)
         worker_responses[cpu_nr_].rnbl = cont;
         worker_responses[cpu_nr_].category = CONTEXT;
         if (finished) {
+                struct request * req = dispatcher_requests[cpu_nr_].req;
+
+                for (; req; req = req->batch_next)
+                        STATS_INC(TASKS);
                 worker_responses[cpu_nr_].flag = FINISHED;
         } else {
-                worker_responses[cpu_nr_].flag = PREEMPTED;
+                struct request * req = dispatcher_requests[cpu_nr_].req;
+
+                account_slice_end(req);
+                if (parked_on)
+                        STATS_INC(PARKS);
+                else if (yielded)
+                        STATS_INC(YIELDS);
+                else
+                        STATS_INC(PREEMPTIONS);
+                if (unlikely(req->trace_id))
+                        trace_emit(req->trace_id, TRACE_PREEMPT, rdtsc(),
+                                   cpu_nr_);
+                worker_responses[cpu_nr_].wake = parked_on;
+                if (parked_on)
+                        worker_responses[cpu_nr_].flag = PARKED;
+                else
+                        worker_responses[cpu_nr_].flag = yielded ? YIELDED : PREEMPTED;
+                parked_on = NULL;
+                yielded = false;
         }
 }
 
@@ -393,6 +571,9 @@ void do_work(void)
                 eth_process_send();
                 handle_request();
                 finish_request();
+                stats_publish(rdtsc());
+                if (unlikely(task_startup[cpu_nr_].count == TASK_STARTUP_REPORT_INTERVAL))
+                        report_task_startup();
         }
 }
 
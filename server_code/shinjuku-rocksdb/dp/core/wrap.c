@@ -3,6 +3,7 @@
 #include <dlfcn.h>
 #include <stdlib.h>
 #include <ix/hijack.h>
+#include <ix/stats.h>
 
 __thread volatile uint8_t clear_ints = 0;
 
@@ -16,6 +17,7 @@ void *__wrap_malloc(size_t size)
     if (clear_ints)
         asm volatile("cli":::);
     void *p = __real_malloc(size);
+    STATS_INC(ALLOCS);
     if (clear_ints)
         asm volatile("sti":::);
     return p;
@@ -35,6 +37,7 @@ void *__wrap_calloc(size_t nmemb, size_t size)
     if (clear_ints)
         asm volatile("cli":::);
     void * foo = __real_calloc(nmemb, size);
+    STATS_INC(ALLOCS);
     if (clear_ints)
         asm volatile("sti":::);
     return foo;
@@ -45,7 +48,17 @@ void *__wrap_realloc(void *ptr, size_t size)
     if (clear_ints)
         asm volatile("cli":::);
     void * foo = __real_realloc(ptr, size);
+    STATS_INC(ALLOCS);
     if (clear_ints)
         asm volatile("sti":::);
     return foo;
 }
+
+/*
+ * operator new of the preloaded deps/opnew library calls malloc past the
+ * wrappers, so it counts its allocations through this hook.
+ */
+void wrap_count_new(void)
+{
+    STATS_INC(ALLOCS);
+}
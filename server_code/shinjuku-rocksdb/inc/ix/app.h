@@ -0,0 +1,130 @@
+/*
+ * app.h - application handler registry
+ *
+ * Every application served by the workers registers a struct app_handler.
+ * The handlers enabled in shinjuku.conf ("apps") are initialized once at
+ * startup, then once per worker core, and warmed up before the worker
+ * starts polling the dispatcher. Requests are routed to a handler by the
+ * client_id carried in the Horus header.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <ix/stddef.h>
+
+#define APP_MAX_HANDLERS	8
+#define APP_NAME_LEN		32
+#define APP_MAX_CLASSES		8	/* request classes of all handlers */
+
+struct message;
+
+struct app_handler {
+	const char *name;
+	/* client_id (host order) of requests served by this handler */
+	uint16_t client_id;
+	/* global initialization, runs once before worker cores start */
+	int (*init)(void);
+	/* per-core initialization, stores the core private state in @state */
+	int (*init_cpu)(void **state);
+	/* touches the per-core state and application data before traffic */
+	void (*warmup)(void *state);
+	/* serves @req and fills the application fields of @resp */
+	void (*handle)(void *state, struct message *req, struct message *resp);
+	/* optional request kinds (NULL terminated) and @req's index in them */
+	const char * const *classes;
+	int (*classify)(struct message *req);
+	/* optional batching: whether @req can be served with others, and
+	 * serves @n such requests, filling @resps[i] for @reqs[i] */
+	bool (*batchable)(struct message *req);
+	void (*handle_batch)(void *state, struct message **reqs,
+			     struct message *resps, int n);
+	/* first global class id of this handler, set by app_init() */
+	int class_base;
+};
+
+extern struct app_handler *app_handlers[APP_MAX_HANDLERS];
+extern int app_count;
+extern const char *app_class_names[APP_MAX_CLASSES];
+extern int app_nr_classes;
+extern __thread void *app_state[APP_MAX_HANDLERS];
+
+/**
+ * app_lookup - finds the handler serving a client
+ * @client_id: the client id in host order
+ * @state: a pointer to store the per-core state of the handler
+ *
+ * Returns the handler, or NULL if no enabled handler serves @client_id.
+ */
+static inline struct app_handler *app_lookup(uint16_t client_id, void **state)
+{
+	int i;
+
+	for (i = 0; i < app_count; i++) {
+		if (app_handlers[i]->client_id == client_id) {
+			*state = app_state[i];
+			return app_handlers[i];
+		}
+	}
+	return NULL;
+}
+
+extern int app_init(void);
+extern int app_init_cpu(void);
+extern void app_warmup(void);
+
+/* for handlers of long requests, see worker.c */
+extern bool worker_yield(void);
+extern void worker_park(volatile bool *done);
+
+/**
+ * app_classify - finds the request class of a request, for statistics
+ * @req: the request
+ * @client_id: the client id of @req in host order
+ *
+ * Class 0 stands for requests of unknown clients. Every handler owns the
+ * classes from its class_base, one per entry of its classes array or a
+ * single one named after the handler.
+ *
+ * Returns the class, below app_nr_classes.
+ */
+static inline int app_classify(struct message *req, uint16_t client_id)
+{
+	int i;
+
+	for (i = 0; i < app_count; i++) {
+		if (app_handlers[i]->client_id != client_id)
+			continue;
+		if (app_handlers[i]->classify)
+			return app_handlers[i]->class_base +
+			       app_handlers[i]->classify(req);
+		return app_handlers[i]->class_base;
+	}
+	return 0;
+}
+
+/**
+ * app_batch_id - finds the batch a request can join
+ * @req: the request
+ * @client_id: the client id of @req in host order
+ *
+ * Requests with the same non-zero id are served by the same handler and can
+ * be passed together to its handle_batch.
+ *
+ * Returns the batch id, or 0 if @req must be served alone.
+ */
+static inline int app_batch_id(struct message *req, uint16_t client_id)
+{
+	int i;
+
+	for (i = 0; i < app_count; i++) {
+		if (app_handlers[i]->client_id != client_id)
+			continue;
+		if (app_handlers[i]->handle_batch &&
+		    app_handlers[i]->batchable(req))
+			return i + 1;
+		return 0;
+	}
+	return 0;
+}
@@ -34,10 +34,34 @@
 #define CFG_MAX_PORTS    16
 #define CFG_MAX_CPU     128
 #define CFG_MAX_ETHDEV   16
+#define CFG_MAX_APPS      8
+#define CFG_MAX_BATCH    16
+#define CFG_MAX_IO_THREADS 64
+#define CFG_MAX_SHARDS   16
 
 #define CFG_CPU_DISPATCHER_INDEX 0
 #define CFG_CPU_NETWORKER_INDEX 1
 
+/* scheduler datastores whose capacity is set by the "pools" group */
+enum {
+	CFG_POOL_TASK,
+	CFG_POOL_FRCELL,
+	CFG_POOL_REQUEST,
+	CFG_POOL_RQ_CELL,
+	CFG_POOL_CONTEXT,
+	CFG_POOL_STACK,
+	CFG_POOL_RESPONSE,
+	CFG_POOL_KA_RESPONSE,
+	CFG_NR_POOLS,
+};
+
+/* WAL of the RocksDB writes ("rocksdb.wal") */
+enum {
+	CFG_WAL_SYNC,		/* synced before the write is acknowledged */
+	CFG_WAL_ASYNC,		/* written, synced by the OS */
+	CFG_WAL_OFF,
+};
+
 struct cfg_ip_addr {
 	uint32_t addr;
 };
@@ -58,6 +82,8 @@ struct cfg_parameters {
 	uint64_t keep_alive_interval_us;
 	uint16_t parent_leaf_id;
 	uint16_t server_id;
+	uint64_t idle_signal_dwell_us;
+	uint64_t idle_signal_interval_us;
 	int num_ports;
 	uint16_t ports[CFG_MAX_PORTS];
 
@@ -68,8 +94,33 @@ struct cfg_parameters {
 	bool queue_settings[CFG_MAX_PORTS];
 
 	uint64_t preemption_delay;
+	int batch_size;
 
 	char loader_path[256];
+
+	int num_apps;
+	char apps[CFG_MAX_APPS][32];
+
+	uint32_t pool_size[CFG_NR_POOLS];
+
+	uint32_t trace_sample;
+	char trace_file[256];
+
+	uint64_t rocksdb_session_refresh_us;
+	uint32_t rocksdb_scan_chunk;
+	/* tuning profile and overrides, "" or -1 if not set */
+	char rocksdb_profile[32];
+	int64_t rocksdb_block_cache_mb;
+	int rocksdb_bloom_bits;
+	int rocksdb_pin_l0;
+	int rocksdb_mmap_reads;
+	char rocksdb_compression[16];
+	char rocksdb_memtable[16];
+	bool rocksdb_group_commit;
+	int rocksdb_wal;
+	uint32_t rocksdb_io_threads;
+	uint32_t rocksdb_hot_cache_kb;
+	uint32_t rocksdb_shards;
 };
 
 extern struct cfg_parameters CFG;
@@ -78,4 +129,6 @@ extern struct cfg_parameters CFG;
 
 
 extern int cfg_init(int argc, char *argv[], int *args_parsed);
+extern const char *cfg_pool_name(int pool);
+extern int cfg_pool_numa_node(int pool);
 
@@ -20,71 +20,115 @@
  * THE SOFTWARE.
  */
 
+
 /*
  * context.h - context management
+ *
+ * A context is a coroutine with its own stack. Switching saves only the
+ * callee-saved registers on the outgoing stack (see context_fast.S), so a
+ * context is little more than a stack pointer.
  */
 
 #pragma once
 
 #include <stdint.h>
-#include <ucontext.h>
 
+#include <ix/stddef.h>
 #include <ix/mempool.h>
+#include <ix/mcache.h>
+
+#define CONTEXT_STACK_SIZE	16384
+
+#ifdef CONTEXT_GUARD_PAGES
+/* an unmapped page below every stack catches overflows */
+#define CONTEXT_GUARD_SIZE	PGSIZE_4KB
+#endif
+
+struct context {
+	void *sp;		/* saved stack pointer, must be first */
+	void *stack;		/* lowest usable address of the stack */
+	size_t stack_size;
+};
 
 struct mempool_datastore context_datastore;
-struct mempool context_pool __attribute((aligned(64)));
+struct mcache context_cache;
 struct mempool_datastore stack_datastore;
-struct mempool stack_pool __attribute((aligned(64)));
+struct mcache stack_cache;
 
-extern int getcontext_fast(ucontext_t *ucp);
+extern void context_switch(struct context *from, struct context *to);
+extern void context_entry(void);
+
+static inline void *context_stack_alloc(void)
+{
+	return mcache_alloc(&stack_cache);
+}
+
+static inline void context_stack_free(void *stack)
+{
+	mcache_free(&stack_cache, stack);
+}
 
 /**
- * context_alloc - allocates a ucontext_t and its stack
+ * context_alloc - allocates a context and its stack
  * @cont: pointer to the pointer of the allocated context
  *
+ * Only the dispatcher allocates and frees contexts.
+ *
  * Returns 0 on success, -1 if failure.
  */
-static inline int context_alloc(ucontext_t ** cont)
+static inline int context_alloc(struct context **cont)
 {
-    (*cont) = mempool_alloc(&context_pool);
-    if (unlikely(!(*cont)))
-        return -1;
-
-    void * stack = mempool_alloc(&stack_pool);
-    if (unlikely(!stack)) {
-        mempool_free(&context_pool, (*cont));
-        return -1;
-    }
-
-    (*cont)->uc_stack.ss_sp = stack;
-    (*cont)->uc_stack.ss_size = sizeof(stack);
-    return 0;
+	void *stack;
+
+	(*cont) = mcache_alloc(&context_cache);
+	if (unlikely(!(*cont)))
+		return -1;
+
+	stack = context_stack_alloc();
+	if (unlikely(!stack)) {
+		mcache_free(&context_cache, (*cont));
+		return -1;
+	}
+
+	(*cont)->stack = stack;
+	(*cont)->stack_size = CONTEXT_STACK_SIZE;
+	return 0;
 }
 
 /**
  * context_free - frees a context and the associated stack
  * @c: the context
  */
-static inline void context_free(ucontext_t *c)
+static inline void context_free(struct context *c)
 {
-    mempool_free(&stack_pool, c->uc_stack.ss_sp);
-    mempool_free(&context_pool, c);
+	context_stack_free(c->stack);
+	mcache_free(&context_cache, c);
 }
 
 /**
- * set_context_link - sets the return context of a ucontext_t
+ * context_make - prepares a context to run a function on its stack
  * @c: the context
- * @uc_link: the return context of c
+ * @fn: the function, must leave the context with context_switch()
+ * @arg: the argument of fn
+ *
+ * The first context_switch() to c calls fn(arg) through context_entry with a
+ * 16 byte aligned stack. The initial frame mirrors what context_switch()
+ * pushes: MXCSR and x87 control word, r15, r14, r13 (arg), r12 (fn), rbx,
+ * rbp and the return address.
  */
-static inline void set_context_link(ucontext_t *c, ucontext_t *uc_link)
+static inline void context_make(struct context *c, void (*fn)(void *),
+				void *arg)
 {
-    uintptr_t *sp;
-    /* Set up the sp pointer so that we save uc_link in the correct address. */
-    sp = ((uintptr_t *) c->uc_stack.ss_sp + c->uc_stack.ss_size);
-    /* We assume that we have less than 6 arguments here. */
-    sp -= 1;
-    sp = (uintptr_t *) ((((uintptr_t) sp) & -16L) - 8);
-
-    c->uc_link = uc_link;
-    sp[1] = (uintptr_t) c->uc_link;
+	uintptr_t top = ((uintptr_t) c->stack + c->stack_size) & ~0xfUL;
+	uint64_t *sp = (uint64_t *) (top - 16) - 8;
+
+	sp[0] = 0x037f00001f80UL;	/* default x87 control word and MXCSR */
+	sp[1] = 0;			/* r15 */
+	sp[2] = 0;			/* r14 */
+	sp[3] = (uint64_t) arg;		/* r13 */
+	sp[4] = (uint64_t) fn;		/* r12 */
+	sp[5] = 0;			/* rbx */
+	sp[6] = 0;			/* rbp */
+	sp[7] = (uint64_t) context_entry;
+	c->sp = sp;
 }
@@ -122,4 +122,7 @@ extern int cpu_run_on_one(cpu_func_t func, void *data,
 
 extern int cpu_init_one(unsigned int cpu);
 extern int cpu_init(void);
+extern int cpu_numa_node_of(unsigned int cpu);
+extern int cpu_pin_spare_nice(int nice);
+extern int cpu_pin_spare(void);
 
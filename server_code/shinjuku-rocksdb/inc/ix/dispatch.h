@@ -22,14 +22,16 @@
 
 #include <limits.h>
 #include <stdint.h>
-#include <ucontext.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <ix/cfg.h>
 #include <ix/mempool.h>
+#include <ix/mcache.h>
 #include <ix/ethqueue.h>
 #include <ix/log.h>
+#include <ix/probe.h>
+#include <ix/syscall.h>
 #include <net/ip.h>
 #include <net/udp.h>
 
@@ -42,6 +44,8 @@
 #define FINISHED    0x01
 #define PREEMPTED   0x02
 #define PROCESSED   0x03
+#define YIELDED     0x04
+#define PARKED      0x05
 
 #define NOCONTENT   0x00
 #define PACKET      0x01
@@ -75,18 +79,20 @@
 #define SWAP_UINT16(x) (((x) >> 8) | ((x) << 8))
 
 struct mempool_datastore task_datastore;
-struct mempool task_mempool __attribute((aligned(64)));
+struct mcache task_cache;
 struct mempool_datastore fini_request_cell_datastore;
-struct mempool fini_request_cell_mempool __attribute((aligned(64)));
+struct mcache fini_request_cell_cache;
 struct mempool_datastore request_datastore;
-struct mempool request_mempool __attribute((aligned(64)));
+struct mcache request_cache;
 struct mempool_datastore rq_datastore;
-struct mempool rq_mempool __attribute((aligned(64)));
+struct mcache rq_cache;
 
 uint32_t got_idles;
 uint32_t sent_idles;
 uint32_t max_queue_wait;
 volatile uint32_t queue_length[CFG_MAX_PORTS];
+// HORUS: tasks of each queue in worker_park(), they count in queue_length
+volatile uint32_t park_length[CFG_MAX_PORTS];
 
 /*
  * HORUS: def
@@ -111,11 +117,32 @@ struct message {
     uint64_t app_data[16];
 } __attribute__((__packed__));
 
+/*
+ * data and id form the task descriptor. The networker fills them from the
+ * first packet once the request is complete (request_describe()), so the
+ * worker does not parse cold headers when it starts the task. Both fit in the
+ * padding of the 128 byte element, as does trace_id (non-zero if the request
+ * is sampled for lifecycle tracing, see ix/trace.h). lat_class and
+ * run_cycles feed the latency histograms of kstats (ENABLE_KSTATS only).
+ *
+ * batch_id is non-zero if the application can serve the request together
+ * with others of the same batch_id (see app_batch_id()). The dispatcher
+ * chains the requests of a batch from the first through batch_next, and
+ * keeps the enqueue time of the others in enqueued.
+ */
 struct request
 {
     uint32_t pkts_length;
     uint16_t type;
     void * mbufs[8];
+    void * data;
+    struct ip_tuple id;
+    uint32_t trace_id;
+    uint8_t lat_class;
+    uint64_t run_cycles;
+    uint8_t batch_id;
+    struct request * batch_next;
+    uint64_t enqueued;
 } __attribute__((packed, aligned(64)));
 
 struct request_cell
@@ -142,7 +169,8 @@ struct worker_response
         uint64_t timestamp;
         uint8_t type;
         uint8_t category;
-        char make_it_64_bytes[30];
+        volatile bool * wake; // PARKED: set once the task can go on
+        char make_it_64_bytes[22];
 } __attribute__((packed, aligned(64)));
 
 struct dispatcher_request
@@ -153,7 +181,8 @@ struct dispatcher_request
         uint8_t type;
         uint8_t category;
         uint64_t timestamp;
-        char make_it_64_bytes[30];
+        struct request * next; // HORUS: next new packet in this worker's queue, prefetch hint
+        char make_it_64_bytes[22];
 } __attribute__((packed, aligned(64)));
 
 struct networker_pointers_t
@@ -183,6 +212,33 @@ struct fini_request_queue frqueue;
  */
 volatile uint32_t worker_state[CFG_MAX_PORTS];
 
+/*
+ * HORUS: Standalone idle signalling. The piggybacked TASK_DONE_IDLE only
+ * covers a worker that the leaf popped from its idle list by idle selection.
+ * When a worker stays idle for CFG.idle_signal_dwell_us the networker sends a
+ * PKT_TYPE_IDLE_SIGNAL on its behalf, unless the leaf already holds it in its
+ * idle list, and at most once per CFG.idle_signal_interval_us per worker.
+ *
+ * idle_since: TSC when the worker queue drained, 0 while it has work (dispatcher)
+ * announced: the leaf holds the worker as idle, set initially and by any idle
+ *            signal, cleared when the leaf pops it (WORKER_STATE_IDLE request)
+ * seq: odd while the worker rewrites the reply fields below, see
+ *      idle_signal_publish()
+ * cluster_id, src_id, dst: header fields and 4-tuple of the last reply (worker)
+ * last_sent: TSC of the last standalone signal (networker)
+ */
+struct idle_signal {
+        volatile uint64_t idle_since;
+        volatile uint8_t announced;
+        volatile uint32_t seq;
+        uint16_t cluster_id;
+        uint16_t src_id;
+        struct ip_tuple dst;
+        uint64_t last_sent;
+} __attribute__((aligned(64)));
+
+struct idle_signal idle_signals[CFG_MAX_PORTS];
+
 
 
 /*
@@ -198,7 +254,7 @@ static inline struct request * request_dequeue(struct fini_request_queue * frq)
 
         req = frq->head->req;
         tmp = frq->head;
-        mempool_free(&fini_request_cell_mempool, tmp);
+        mcache_free(&fini_request_cell_cache, tmp);
         frq->head = frq->head->next;
 
         return req;
@@ -211,7 +267,8 @@ static inline void request_enqueue(struct fini_request_queue * frq, struct reque
 {
         if (unlikely(!req))
                 return;
-        struct fini_request_cell * frcell = mempool_alloc(&fini_request_cell_mempool);
+        struct fini_request_cell * frcell = mcache_alloc(&fini_request_cell_cache);
+        mcache_tag(&fini_request_cell_cache, frcell, req);
         frcell->req = req;
         frcell->next = frq->head;
         frq->head = frcell;
@@ -223,6 +280,7 @@ struct task {
         uint8_t type;
         uint8_t category;
         uint64_t timestamp;
+        volatile bool * wake; // parked tasks only, see worker_park()
         struct task * next;
 };
 
@@ -238,7 +296,8 @@ static inline void tskq_enqueue_head(struct task_queue * tq, void * rnbl,
                                      struct request * req, uint8_t type,
                                      uint8_t category, uint64_t timestamp)
 {
-        struct task * tsk = mempool_alloc(&task_mempool);
+        struct task * tsk = mcache_alloc(&task_cache);
+        mcache_tag(&task_cache, tsk, req);
         tsk->runnable = rnbl;
         tsk->req = req;
         tsk->type = type;
@@ -259,9 +318,10 @@ static inline void tskq_enqueue_tail(struct task_queue * tq, void * rnbl,
                                      struct request * req, uint8_t type,
                                      uint8_t category, uint64_t timestamp)
 {
-        struct task * tsk = mempool_alloc(&task_mempool);
+        struct task * tsk = mcache_alloc(&task_cache);
         if (!tsk)
                 return;
+        mcache_tag(&task_cache, tsk, req);
         tsk->runnable = rnbl;
         tsk->req = req;
         tsk->type = type;
@@ -291,12 +351,36 @@ static inline int tskq_dequeue(struct task_queue * tq, void ** rnbl_ptr,
         (*timestamp) = tq->head->timestamp;
         struct task * tsk = tq->head;
         tq->head = tq->head->next;
-        mempool_free(&task_mempool, tsk);
+        mcache_free(&task_cache, tsk);
         if (tq->head == NULL)
                 tq->tail = NULL;
         return 0;
 }
 
+/*
+ * HORUS: Returns the request at the head of the queue if it is a new packet
+ * of batch @batch_id, used to extend a batch. Does not dequeue.
+ */
+static inline struct request * tskq_peek_batch(struct task_queue * tq,
+                                               uint8_t batch_id)
+{
+        if (tq->head == NULL || tq->head->category != PACKET ||
+            tq->head->req->batch_id != batch_id)
+                return NULL;
+        return tq->head->req;
+}
+
+/*
+ * HORUS: Returns the request at the head of the queue if it is a new packet,
+ * used as a prefetch hint for the worker. Does not dequeue.
+ */
+static inline struct request * tskq_peek_packet(struct task_queue * tq)
+{
+        if (tq->head == NULL || tq->head->category != PACKET)
+                return NULL;
+        return tq->head->req;
+}
+
 static inline uint64_t get_queue_timestamp(struct task_queue * tq, uint64_t * timestamp)
 {
         if (tq->head == NULL)
@@ -423,26 +507,28 @@ static inline struct request * rq_update(struct request_queue * rq, struct mbuf
     }
     
     if (pkts_length == 1) {
-        struct request * req = mempool_alloc(&request_mempool);
+        struct request * req = mcache_alloc(&request_cache);
         req->type = type;
         req->pkts_length = 1;
         req->mbufs[0] = pkt;
+        PROBE(rq_update, req, req_id, *core_id, 1);
         return req;
     }
 
     if (!rq->head) {
-            struct request_cell * rc = mempool_alloc(&rq_mempool);
+            struct request_cell * rc = mcache_alloc(&rq_cache);
             rc->pkts_remaining = pkts_length - 1;
             rc->client_id = client_id;
             rc->req_id = req_id;
-            rc->req = mempool_alloc(&request_mempool);
+            rc->req = mcache_alloc(&request_cache);
+            mcache_tag(&rq_cache, rc, rc->req);
             rc->req->mbufs[seq_num] = pkt;
             rc->req->pkts_length = pkts_length;
             rc->req->type = type;
             rc->next = NULL;
             rc->prev = NULL;
             rq->head = rc;
-            log_info("!rq->head NULL\n");
+            log_debug("!rq->head NULL\n");
             return NULL;
     }
     struct request_cell * cur = rq->head;
@@ -461,21 +547,23 @@ static inline struct request * rq_update(struct request_queue * rq, struct mbuf
                     if (cur->next != NULL)
                         cur->next->prev = cur->prev;
                 }
-                mempool_free(&rq_mempool, cur);
+                mcache_free(&rq_cache, cur);
+                PROBE(rq_update, req, req_id, *core_id, pkts_length);
                 return req;
             }
-            log_info("in while ret NULL\n");
+            log_debug("in while ret NULL\n");
             return NULL;
         }
         cur = cur->next;
         }
 
         if (cur == NULL) {
-                struct request_cell * rc = mempool_alloc(&rq_mempool);
+                struct request_cell * rc = mcache_alloc(&rq_cache);
                 rc->pkts_remaining = pkts_length - 1;
                 rc->client_id = client_id;
                 rc->req_id = req_id;
-                rc->req = mempool_alloc(&request_mempool);
+                rc->req = mcache_alloc(&request_cache);
+                mcache_tag(&rq_cache, rc, rc->req);
                 rc->req->mbufs[seq_num] = pkt;
                 rc->req->pkts_length = pkts_length;
                 rc->req->type = type;
@@ -483,13 +571,53 @@ static inline struct request * rq_update(struct request_queue * rq, struct mbuf
         rc->next->prev = rc;
         rc->prev = NULL;
                 rq->head = rc;
-                log_info("cur==NULL\n");
+                log_debug("cur==NULL\n");
                 return NULL;
         }
-        log_info("last null\n");
+        log_debug("last null\n");
         return NULL;
 }
 
+/*
+ * HORUS: Fills the task descriptor of a complete request from its first
+ * packet: the payload pointer and the reply 4-tuple in host byte order.
+ * data is NULL if the packet is truncated.
+ */
+static inline void request_describe(struct request * req)
+{
+    struct mbuf * pkt = (struct mbuf *) req->mbufs[0];
+    struct eth_hdr * ethhdr = mbuf_mtod(pkt, struct eth_hdr *);
+    struct ip_hdr *  iphdr = mbuf_nextd(ethhdr, struct ip_hdr *);
+    int hdrlen = iphdr->header_len * sizeof(uint32_t);
+    struct udp_hdr * udphdr = mbuf_nextd_off(iphdr, struct udp_hdr *,
+                                             hdrlen);
+    uint16_t len = ntoh16(udphdr->len);
+
+    if (unlikely(!mbuf_enough_space(pkt, udphdr, len))) {
+        log_warn("networker: not enough space in mbuf\n");
+        req->data = NULL;
+        return;
+    }
+    req->data = mbuf_nextd(udphdr, void *);
+    req->id.src_ip = ntoh32(iphdr->src_addr.addr);
+    req->id.dst_ip = ntoh32(iphdr->dst_addr.addr);
+    req->id.src_port = ntoh16(udphdr->src_port);
+    req->id.dst_port = ntoh16(udphdr->dst_port);
+    pkt->done = (void *) 0xDEADBEEF;
+}
+
+/*
+ * HORUS: Cycles from the worker picking up a new packet to the application
+ * handler starting on it. Written by the owning worker only.
+ */
+struct task_startup_stats {
+        uint64_t count;
+        uint64_t cycles;
+        uint64_t max_cycles;
+} __attribute__((aligned(64)));
+
+struct task_startup_stats task_startup[MAX_WORKERS];
+
 uint64_t timestamps[MAX_WORKERS];
 uint8_t preempt_check[MAX_WORKERS];
 
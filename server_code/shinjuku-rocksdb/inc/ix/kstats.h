@@ -25,8 +25,11 @@
 #pragma once
 
 #include <stdlib.h>
+#include <linux/perf_event.h>
 
 #include <ix/stddef.h>
+#include <ix/app.h>
+#include <ix/cfg.h>
 #include <ix/cpu.h>
 #include <ix/log.h>
 
@@ -55,6 +58,92 @@ typedef struct kstats {
 #include "kstatvectors.h"
 } kstats;
 
+/*
+ * Request latency histograms (queueing, service and sojourn time) per worker
+ * and per request class (see app_classify()), in TSC cycles.
+ *
+ * The histograms are log-linear: values below 2 * KSTATS_HIST_SUB are counted
+ * exactly, larger ones in KSTATS_HIST_SUB buckets per power of two, so a
+ * percentile is off by less than 1 / KSTATS_HIST_SUB. Every histogram has a
+ * single writer and its counters only grow: a reader merges any set of them
+ * and subtracts an earlier snapshot to get percentiles over any interval.
+ */
+#define KSTATS_HIST_SUB_BITS	5
+#define KSTATS_HIST_SUB		(1 << KSTATS_HIST_SUB_BITS)
+#define KSTATS_HIST_MAX_BITS	36	/* larger values land in the last bucket */
+#define KSTATS_HIST_BUCKETS \
+	((KSTATS_HIST_MAX_BITS - KSTATS_HIST_SUB_BITS + 1) << KSTATS_HIST_SUB_BITS)
+
+struct kstats_hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t buckets[KSTATS_HIST_BUCKETS];
+};
+
+enum {
+	KSTATS_LAT_QUEUE = 0,	/* enqueue to first dispatch (dispatcher) */
+	KSTATS_LAT_SERVICE,	/* cycles on a worker, all slices (worker) */
+	KSTATS_LAT_SOJOURN,	/* enqueue to handler return (worker) */
+	KSTATS_LAT_NR,
+};
+
+#define KSTATS_LAT_CLASSES	APP_MAX_CLASSES
+#define KSTATS_LAT_INTERVAL_US	(5 * 1000 * 1000)
+
+/*
+ * CPU counters of the worker tasks per request class. Where the PMU can be
+ * read from user space (rdpmc), every slice of a task adds its instructions,
+ * core cycles and LLC load misses to its class. Otherwise, e.g. in a VM
+ * without a virtual PMU, only the tasks and their TSC cycles are counted.
+ */
+enum {
+	KSTATS_PMC_INSTRUCTIONS = 0,
+	KSTATS_PMC_CYCLES,
+	KSTATS_PMC_LLC_MISSES,
+	KSTATS_PMC_NR,
+};
+
+struct kstats_pmc {
+	uint64_t tasks;
+	uint64_t tsc;
+	uint64_t events[KSTATS_PMC_NR];
+};
+
+/* everything a worker records, with a single writer */
+struct kstats_lat {
+	struct kstats_hist h[KSTATS_LAT_NR][KSTATS_LAT_CLASSES];
+	struct kstats_pmc pmc[KSTATS_LAT_CLASSES];
+	uint32_t pmc_hw;	/* the events are counted */
+};
+
+static inline int kstats_hist_bucket(uint64_t v)
+{
+	int shift;
+
+	if (v < 2 * KSTATS_HIST_SUB)
+		return v;
+	shift = 63 - __builtin_clzll(v) - KSTATS_HIST_SUB_BITS;
+	if (shift > KSTATS_HIST_MAX_BITS - 1 - KSTATS_HIST_SUB_BITS)
+		return KSTATS_HIST_BUCKETS - 1;
+	return (shift << KSTATS_HIST_SUB_BITS) + (v >> shift);
+}
+
+static inline uint64_t kstats_hist_value(int bucket)
+{
+	int shift;
+
+	if (bucket < 2 * KSTATS_HIST_SUB)
+		return bucket;
+	shift = (bucket >> KSTATS_HIST_SUB_BITS) - 1;
+	return (uint64_t) (bucket - (shift << KSTATS_HIST_SUB_BITS)) << shift;
+}
+
+extern void kstats_hist_merge(struct kstats_hist *dst,
+			      const struct kstats_hist *src);
+extern void kstats_hist_sub(struct kstats_hist *dst,
+			    const struct kstats_hist *src);
+extern uint64_t kstats_hist_percentile(const struct kstats_hist *h, double p);
+
 #ifdef ENABLE_KSTATS
 
 DECLARE_PERCPU(kstats, _kstats);
@@ -111,6 +200,106 @@ static inline void kstats_backlog_inc(int count)
 
 extern int kstats_init_cpu(void);
 
+extern struct kstats_lat *kstats_lat[CFG_MAX_CPU];
+
+extern int kstats_lat_init(void);
+extern void kstats_lat_report(void);
+
+/**
+ * kstats_lat_record - adds a latency sample
+ * @metric: KSTATS_LAT_QUEUE, KSTATS_LAT_SERVICE or KSTATS_LAT_SOJOURN
+ * @worker: the worker index
+ * @class: the request class
+ * @cycles: the latency
+ *
+ * Each (metric, worker) row must only be written by one core.
+ */
+static inline void kstats_lat_record(int metric, int worker, int class,
+				     uint64_t cycles)
+{
+	struct kstats_hist *h = &kstats_lat[worker]->h[metric][class];
+
+	h->count++;
+	h->sum += cycles;
+	h->buckets[kstats_hist_bucket(cycles)]++;
+}
+
+#define KSTATS_LAT_RECORD(_metric, _worker, _class, _cycles) \
+	kstats_lat_record(_metric, _worker, _class, _cycles)
+
+extern __thread struct perf_event_mmap_page *kstats_pmc_page[KSTATS_PMC_NR];
+extern __thread uint64_t kstats_pmc_start[KSTATS_PMC_NR];
+extern __thread bool kstats_pmc_hw;
+
+extern void kstats_pmc_init_worker(int worker);
+
+/**
+ * kstats_pmc_read - reads a hardware counter of the calling thread
+ * @event: the KSTATS_PMC_ event
+ *
+ * Uses rdpmc, no system call. Only valid if kstats_pmc_hw is set.
+ *
+ * Returns the counter value.
+ */
+static inline uint64_t kstats_pmc_read(int event)
+{
+	struct perf_event_mmap_page *pc = kstats_pmc_page[event];
+	uint32_t seq, idx, lo, hi;
+	uint64_t count;
+	int64_t pmc;
+
+	do {
+		seq = *(volatile uint32_t *) &pc->lock;
+		asm volatile("" ::: "memory");
+		idx = pc->index;
+		count = pc->offset;
+		if (idx) {
+			asm volatile("rdpmc" : "=a"(lo), "=d"(hi) : "c"(idx - 1));
+			/* sign extend from the width of the counter */
+			pmc = (uint64_t) hi << 32 | lo;
+			pmc <<= 64 - pc->pmc_width;
+			pmc >>= 64 - pc->pmc_width;
+			count += pmc;
+		}
+		asm volatile("" ::: "memory");
+	} while (*(volatile uint32_t *) &pc->lock != seq);
+	return count;
+}
+
+/**
+ * kstats_pmc_slice_start - notes the counters as a task gets the core
+ */
+static inline void kstats_pmc_slice_start(void)
+{
+	int i;
+
+	if (!kstats_pmc_hw)
+		return;
+	for (i = 0; i < KSTATS_PMC_NR; i++)
+		kstats_pmc_start[i] = kstats_pmc_read(i);
+}
+
+/**
+ * kstats_pmc_slice_end - charges a slice of a task to its class
+ * @worker: the worker index
+ * @class: the request class
+ * @tsc: the TSC cycles of the slice
+ * @done: the number of tasks that finished in the slice
+ */
+static inline void kstats_pmc_slice_end(int worker, int class, uint64_t tsc,
+					unsigned int done)
+{
+	struct kstats_pmc *p = &kstats_lat[worker]->pmc[class];
+	int i;
+
+	p->tasks += done;
+	p->tsc += tsc;
+	if (!kstats_pmc_hw)
+		return;
+	for (i = 0; i < KSTATS_PMC_NR; i++)
+		p->events[i] += kstats_pmc_read(i) - kstats_pmc_start[i];
+}
+
 #else /* ENABLE_KSTATS */
 
 #define KSTATS_PUSH(TYPE, _save)
@@ -120,6 +309,7 @@ extern int kstats_init_cpu(void);
 #define KSTATS_PACKETS_INC(_count)
 #define KSTATS_BATCH_INC(_count)
 #define KSTATS_BACKLOG_INC(_count)
+#define KSTATS_LAT_RECORD(_metric, _worker, _class, _cycles)
 
 
 #endif /* ENABLE_KSTATS */
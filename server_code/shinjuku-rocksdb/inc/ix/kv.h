@@ -0,0 +1,75 @@
+/*
+ * kv.h - key-value protocol of the RocksDB application
+ *
+ * A KV request is a Horus message for ROCKSDB_CLIENT whose app_data holds a
+ * struct kv_request, the reply carries a struct kv_response in app_data.
+ * Integers are in the host order of client and server (little endian).
+ *
+ *	op		request buf			reply buf
+ *	GET		key				value
+ *	PUT		key, value			-
+ *	DELETE		key				-
+ *	MULTIGET	nr_keys x (u8 len, key)		per key: u16 len, value
+ *	SCAN		start key [, end key]		per entry: u8 key len,
+ *							key, u16 len, value
+ *
+ * A SCAN visits up to limit entries from the start key (the first key if
+ * key_len is 0) and before the end key (val_len bytes after the start key,
+ * no bound if 0). When the reply cannot hold everything KV_F_TRUNCATED is
+ * set: a GET returns the start of the value and its full length in len,
+ * MULTIGET and SCAN pack whole entries until one does not fit and report the
+ * bytes used in len. A MULTIGET key that does not exist (or failed) has
+ * length KV_ABSENT and no value.
+ *
+ * Messages without KV_MAGIC get the legacy synthetic workload selected by
+ * runNs (see rocksdb_legacy_work()).
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <ix/stddef.h>
+
+#define KV_MAGIC		0x4b56	/* "KV" */
+#define KV_BUF_LEN		118	/* app_data minus the fixed fields */
+#define KV_ABSENT		0xffff
+#define KV_MULTIGET_MAX		16
+#define KV_SCAN_LIMIT		100	/* when the request has no limit */
+#define KV_SCAN_MAX		5000
+
+enum {
+	KV_OP_GET = 1,
+	KV_OP_PUT,
+	KV_OP_DELETE,
+	KV_OP_MULTIGET,
+	KV_OP_SCAN,
+};
+
+enum {
+	KV_OK = 0,
+	KV_NOT_FOUND,
+	KV_INVALID,		/* malformed request */
+	KV_ERROR,		/* RocksDB failed */
+};
+
+#define KV_F_TRUNCATED		0x01
+
+struct kv_request {
+	uint16_t magic;
+	uint8_t op;
+	uint8_t nr_keys;	/* MULTIGET */
+	uint16_t key_len;	/* GET, PUT, DELETE, SCAN */
+	uint16_t val_len;	/* PUT value, SCAN end key */
+	uint16_t limit;		/* SCAN, 0 for KV_SCAN_LIMIT */
+	uint8_t buf[KV_BUF_LEN];
+} __packed;
+
+struct kv_response {
+	uint16_t magic;
+	uint8_t status;
+	uint8_t flags;
+	uint16_t count;		/* MULTIGET keys found, SCAN entries visited */
+	uint32_t len;		/* GET value length, otherwise bytes in buf */
+	uint8_t buf[KV_BUF_LEN];
+} __packed;
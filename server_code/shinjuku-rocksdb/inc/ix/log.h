@@ -32,6 +32,8 @@
 extern __thread bool log_is_early_boot;
 
 extern void logk(int level, const char *fmt, ...);
+extern int log_init(void);
+extern int log_init_cpu(void);
 
 extern int max_loglevel;
 
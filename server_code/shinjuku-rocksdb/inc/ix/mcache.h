@@ -0,0 +1,216 @@
+/*
+ * mcache.h - per-core magazine caches over a shared object store
+ *
+ * Every core owns two magazines (arrays of free objects) per cache and
+ * allocates and frees from them without synchronization. Only when both are
+ * empty (alloc) or full (free) does it exchange a whole magazine with the
+ * depot, a pair of lock-free stacks of full and empty magazines shared by
+ * all cores.
+ *
+ * Every cache has a single allocating core (the networker for requests, the
+ * dispatcher for tasks and contexts), which claims it on its first
+ * allocation. Other cores may only free: their objects fill their own
+ * magazines, and once those are full the whole magazine goes to the shared
+ * depot, where only the allocating core picks it up. So remote frees return
+ * to their owner one magazine at a time, without a per-owner route, and the
+ * fast path never touches a cache line written by another core.
+ * mcache_free() asserts that no core both frees remotely and allocates.
+ *
+ * The magazines and the per-core slots pointing to them stay in private
+ * memory. Only the per-core usage counters live in a shared memory page
+ * (MCACHE_SHM_NAME), so that external tools can aggregate them without
+ * stopping the data plane and cannot corrupt the allocator. Building with
+ * MCACHE_DEBUG additionally tags every allocated object with its allocating
+ * core, its allocation time and an owner (usually the request it belongs
+ * to) to attribute leaks.
+ */
+
+#pragma once
+
+#include <assert.h>
+
+#include <ix/stddef.h>
+#include <ix/atomic.h>
+#include <ix/cfg.h>
+#include <ix/cpu.h>
+#include <ix/mempool.h>
+
+#define MCACHE_MAG_ROUNDS	62	/* objects per magazine, 512 bytes */
+#define MCACHE_MAX		16
+
+#define MCACHE_SHM_NAME		"/horus.pools"
+#define MCACHE_SHM_MAGIC	0x6d636163	/* "mcac" */
+
+struct mcache_mag {
+	struct mcache_mag *next;
+	int rounds;
+	void *objs[MCACHE_MAG_ROUNDS];
+} __aligned(64);
+
+/* depot stacks carry an ABA tag in the unused upper 16 bits of the pointer */
+#define MCACHE_TAG_SHIFT	48
+#define MCACHE_PTR_MASK		((1UL << MCACHE_TAG_SHIFT) - 1)
+
+struct mcache_depot {
+	atomic64_t head;
+} __aligned(64);
+
+/* usage counters of a core, only written by that core */
+struct mcache_counters {
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t failed;
+	int64_t hwm;		/* highest allocs - frees seen on this core */
+} __aligned(64);
+
+struct mcache_cpu {
+	struct mcache_mag *loaded;
+	struct mcache_mag *prev;
+	struct mcache_counters *cnt;	/* this core's slot in the stats page */
+} __aligned(64);
+
+/* layout of the shared memory stats page */
+struct mcache_shm_cache {
+	char name[32];
+	uint32_t nr_objs;
+	uint32_t nr_mags;
+	struct mcache_counters cpu[CFG_MAX_CPU];
+} __aligned(64);
+
+struct mcache_shm {
+	uint32_t magic;
+	uint32_t nr_caches;
+	uint32_t nr_cpus;
+	struct mcache_shm_cache caches[MCACHE_MAX];
+};
+
+#ifdef MCACHE_DEBUG
+/* the networker looks for objects older than MCACHE_LEAK_AGE_US */
+#define MCACHE_LEAK_CHECK_US	(10 * 1000 * 1000)
+#define MCACHE_LEAK_AGE_US	(5 * 1000 * 1000)
+
+struct mcache_tag {
+	void *owner;
+	uint64_t tsc;
+	uint16_t cpu;
+	uint16_t live;
+};
+#endif
+
+struct mcache {
+	struct mcache_cpu cpu[CFG_MAX_CPU];
+	struct mcache_shm_cache *shm;	/* the cache's counters in the stats page */
+	struct mcache_depot full;
+	struct mcache_depot empty;
+	struct mcache_mag *mags;
+	int nr_mags;
+	int mag_pages;			/* 2MB pages holding the magazines */
+	int numa_node;
+	size_t own_len;			/* objects not backed by a datastore */
+	uint32_t nr_objs;
+	int alloc_cpu;			/* the allocating core, -1 until it allocates */
+	const char *name;
+#ifdef MCACHE_DEBUG
+	/* object layout, to map an object to its tag */
+	uintptr_t base;
+	size_t stride;
+	int per_page;
+	struct mcache_tag *tags;
+	void (*describe)(void *obj, void *owner);
+#endif
+};
+
+struct mcache_stats {
+	uint32_t nr_objs;
+	uint64_t allocated;
+	uint64_t hwm;
+	uint64_t failed;
+	uint64_t remote_frees;
+};
+
+extern int mcache_create(struct mcache *c, struct mempool_datastore *mds);
+extern int mcache_init(struct mcache *c, uint32_t nr_objs, const char *name,
+		       int numa_node);
+extern void mcache_seed(struct mcache *c, void *obj);
+extern void mcache_claim(struct mcache *c, struct mcache_cpu *cc);
+extern void *mcache_alloc_slow(struct mcache *c, struct mcache_cpu *cc);
+extern void mcache_free_slow(struct mcache *c, struct mcache_cpu *cc,
+			     void *obj);
+extern void mcache_shm_stats(const struct mcache_shm_cache *sc, int nr_cpus,
+			     struct mcache_stats *st);
+extern void mcache_get_stats(struct mcache *c, struct mcache_stats *st);
+extern size_t mcache_print_budget(void);
+
+#ifdef MCACHE_DEBUG
+extern void mcache_set_layout(struct mcache *c, void *base, size_t stride,
+			      int per_page);
+extern void mcache_debug_alloc(struct mcache *c, void *obj);
+extern void mcache_debug_free(struct mcache *c, void *obj);
+extern void mcache_tag(struct mcache *c, void *obj, void *owner);
+extern void mcache_report_leaks(uint64_t min_age_us);
+#else
+static inline void mcache_set_layout(struct mcache *c, void *base,
+				     size_t stride, int per_page) { }
+static inline void mcache_tag(struct mcache *c, void *obj, void *owner) { }
+static inline void mcache_report_leaks(uint64_t min_age_us) { }
+#endif
+
+static inline struct mcache_cpu *mcache_this_cpu(struct mcache *c)
+{
+	return &c->cpu[percpu_get(cpu_nr)];
+}
+
+/**
+ * mcache_alloc - allocates an object from the calling core's magazines
+ * @c: the cache
+ *
+ * Returns a pointer to the object or NULL if the cache is exhausted.
+ */
+static inline void *mcache_alloc(struct mcache *c)
+{
+	struct mcache_cpu *cc = mcache_this_cpu(c);
+	struct mcache_counters *cnt = cc->cnt;
+	struct mcache_mag *m = cc->loaded;
+	int64_t used;
+	void *obj;
+
+	if (likely(m && m->rounds))
+		obj = m->objs[--m->rounds];
+	else if (unlikely(!(obj = mcache_alloc_slow(c, cc))))
+		return NULL;
+
+	if (unlikely(++cnt->allocs == 1))
+		mcache_claim(c, cc);
+	used = cnt->allocs - cnt->frees;
+	if (unlikely(used > cnt->hwm))
+		cnt->hwm = used;
+#ifdef MCACHE_DEBUG
+	mcache_debug_alloc(c, obj);
+#endif
+	return obj;
+}
+
+/**
+ * mcache_free - returns an object to the calling core's magazines
+ * @c: the cache
+ * @obj: the object, may have been allocated by any core
+ *
+ * A core other than the allocating one must never allocate from @c.
+ */
+static inline void mcache_free(struct mcache *c, void *obj)
+{
+	struct mcache_cpu *cc = mcache_this_cpu(c);
+	struct mcache_mag *m = cc->loaded;
+
+	assert(!cc->cnt->allocs || cc == &c->cpu[c->alloc_cpu]);
+
+#ifdef MCACHE_DEBUG
+	mcache_debug_free(c, obj);
+#endif
+	cc->cnt->frees++;
+	if (likely(m && m->rounds < MCACHE_MAG_ROUNDS)) {
+		m->objs[m->rounds++] = obj;
+		return;
+	}
+	mcache_free_slow(c, cc, obj);
+}
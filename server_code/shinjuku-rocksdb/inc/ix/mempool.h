@@ -71,6 +71,7 @@ struct mempool_datastore {
 	int                     num_chunks;
 	int                     free_chunks;
 	int64_t                 num_locks;
+	int                     numa_node;
 	const char             *prettyname;
 	struct mempool_datastore *next_ds;
 #ifdef __KERNEL__
@@ -206,6 +207,8 @@ static inline uintptr_t mempool_ptr_to_idx(struct mempool *m, void *p, int elem_
 
 
 extern int mempool_create_datastore(struct mempool_datastore *m, int nr_elems, size_t elem_len, int nostraddle, int chunk_size, const char *prettyname);
+extern int mempool_create_datastore_onnode(struct mempool_datastore *m, int nr_elems, size_t elem_len, int nostraddle, int chunk_size, const char *prettyname, int numa_node);
+extern int mempool_print_budget(void);
 extern int mempool_create(struct mempool *m, struct mempool_datastore *mds, int16_t sanity_type, int16_t sanity_id);
 extern void mempool_destroy(struct mempool *m);
 
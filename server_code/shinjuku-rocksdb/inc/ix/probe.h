@@ -0,0 +1,47 @@
+/*
+ * probe.h - USDT static probes for bpftrace and perf
+ *
+ * PROBE(name, args...) marks a scheduler event as the probe horus:name. Until
+ * a tracer attaches, a probe is a single nop plus an ELF note, so the probes
+ * stay in regular builds and can be enabled on a running server, e.g.
+ *
+ *	bpftrace -p $(pidof shinjuku) tools/queue_wait.bt
+ *
+ * The arguments are evaluated even when nobody listens: only pass values the
+ * code already has at hand, never add loads for a probe. Requests are
+ * identified by the address of their struct request, which is unique while
+ * they are in flight. Probes compile to nothing without <sys/sdt.h>
+ * (systemtap-sdt-dev) or with NO_USDT=1.
+ *
+ *	rq_update	(req, req_id, worker, pkts)	request reassembled
+ *	enqueue		(req, worker, qlen)		in the worker's queue
+ *	dispatch	(req, worker, qlen, wait, category)	to a worker
+ *	finished	(req, worker, qlen)		task done
+ *	preempted	(req, worker, qlen)		task back in a queue
+ *	work_start	(req, req_id, worker)		generic_work() entry
+ *	work_done	(req, req_id, worker, qlen)	reply sent, exit
+ *	udp_send	(data, len, dst_ip, dst_port, ret)
+ *
+ * qlen is the worker's queue length after the event, counting the running
+ * task. work_start has none: queue_length[] is written by the dispatcher,
+ * so reading it on the worker would cost a miss on every request, and the
+ * length at dispatch is in the preceding dispatch probe. wait is the time
+ * since the request was enqueued, in TSC cycles; for a preempted task being
+ * resumed (category CONTEXT) it counts from its first enqueue. req_id is the
+ * raw field of the request header.
+ */
+
+#pragma once
+
+#if !defined(NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_USDT
+#endif
+#endif
+
+#ifdef HAVE_USDT
+#define PROBE(_name, ...)	STAP_PROBEV(horus, _name, ##__VA_ARGS__)
+#else
+#define PROBE(_name, ...)	do { } while (0)
+#endif
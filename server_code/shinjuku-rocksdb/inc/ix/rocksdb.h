@@ -22,10 +22,280 @@
 
 /*
  * rocksdb.h - rocksdb-related structures
+ *
+ * HORUS: tuning profiles. A profile bundles the table format, block cache,
+ * bloom filters, compression and memtable of the database, the server
+ * picks one in shinjuku.conf ("rocksdb.profile") and db/load_db builds the
+ * database with the same one (-P), since plain table and block based files
+ * cannot be read with each other's options.
+ *
+ * HORUS: sharding. With rocksdb.shards the keyspace is split by a hash of
+ * the key prefix into that many database instances, <path>.0 and on, which
+ * load_db builds with -D.
  */
 
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
 #include <c.h>
 
-rocksdb_t *db;
+#define ROCKSDB_PREFIX_LEN	8	/* the id prefix of the keys */
+/* ix/stddef.h is not available to the tools in db/ */
+#define ROCKSDB_NR(arr)		((int) (sizeof(arr) / sizeof((arr)[0])))
+
+enum {
+	ROCKSDB_MEMTABLE_SKIPLIST,
+	ROCKSDB_MEMTABLE_HASH_SKIPLIST,
+	ROCKSDB_MEMTABLE_HASH_LINKLIST,
+};
+
+struct rocksdb_profile {
+	const char *name;
+	/* plain table: mmap reads, no block cache or compression */
+	bool plain_table;
+	/* block based table only, 0 for no cache */
+	uint64_t block_cache_mb;
+	bool pin_l0;
+	int bloom_bits;		/* per key, 0 for none */
+	bool mmap_reads;
+	int compression;	/* rocksdb_*_compression */
+	int memtable;		/* ROCKSDB_MEMTABLE_* */
+};
+
+/*
+ * plain: the historic setup, an in-memory friendly plain table over mmap,
+ *        in total order (see rocksdb_profile_prefix()).
+ * point: block based with a large cache and bloom filters, for GETs.
+ * scan: block based without filters, as they do not help range reads.
+ */
+static const struct rocksdb_profile rocksdb_profiles[] = {
+	{ "plain", true, 0, false, 10, true, rocksdb_no_compression,
+	  ROCKSDB_MEMTABLE_SKIPLIST },
+	{ "point", false, 1024, true, 10, false, rocksdb_lz4_compression,
+	  ROCKSDB_MEMTABLE_SKIPLIST },
+	{ "scan", false, 1024, true, 0, false, rocksdb_lz4_compression,
+	  ROCKSDB_MEMTABLE_SKIPLIST },
+};
+
+static const char * const rocksdb_compression_names[] = {
+	[rocksdb_no_compression] = "none",
+	[rocksdb_snappy_compression] = "snappy",
+	[rocksdb_zlib_compression] = "zlib",
+	[rocksdb_bz2_compression] = "bz2",
+	[rocksdb_lz4_compression] = "lz4",
+	[rocksdb_lz4hc_compression] = "lz4hc",
+	[rocksdb_xpress_compression] = "xpress",
+	[rocksdb_zstd_compression] = "zstd",
+};
+
+static const char * const rocksdb_memtable_names[] = {
+	[ROCKSDB_MEMTABLE_SKIPLIST] = "skiplist",
+	[ROCKSDB_MEMTABLE_HASH_SKIPLIST] = "hash_skiplist",
+	[ROCKSDB_MEMTABLE_HASH_LINKLIST] = "hash_linklist",
+};
+
+/* the index of @name in @names, or -1 */
+static inline int rocksdb_name_index(const char * const *names, int n,
+				     const char *name)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (names[i] && !strcmp(names[i], name))
+			return i;
+	return -1;
+}
+
+#define rocksdb_compression_parse(name)					\
+	rocksdb_name_index(rocksdb_compression_names,			\
+			   ROCKSDB_NR(rocksdb_compression_names), name)
+#define rocksdb_memtable_parse(name)					\
+	rocksdb_name_index(rocksdb_memtable_names,			\
+			   ROCKSDB_NR(rocksdb_memtable_names), name)
+
+/**
+ * rocksdb_profile_find - copies a profile
+ * @name: the profile name
+ * @p: the profile to fill, the caller may then override settings
+ *
+ * Returns 0 if successful, or -1 if there is no profile @name.
+ */
+static inline int rocksdb_profile_find(const char *name,
+				       struct rocksdb_profile *p)
+{
+	int i;
+
+	for (i = 0; i < ROCKSDB_NR(rocksdb_profiles); i++) {
+		if (!strcmp(rocksdb_profiles[i].name, name)) {
+			*p = rocksdb_profiles[i];
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/**
+ * rocksdb_profile_prefix - whether a profile uses the key prefix extractor
+ * @p: the profile
+ *
+ * A plain table with a prefix extractor indexes keys by a prefix hash and
+ * rejects total order seeks, so scans could not cross prefixes. Plain tables
+ * go without it, in total order mode (a binary search index and a bloom
+ * filter of whole keys), unless a hash memtable needs it.
+ */
+static inline bool rocksdb_profile_prefix(const struct rocksdb_profile *p)
+{
+	return !p->plain_table || p->memtable != ROCKSDB_MEMTABLE_SKIPLIST;
+}
+
+/**
+ * rocksdb_profile_options - creates the database options of a profile
+ * @p: the profile
+ * @threads: background threads, 0 for the RocksDB default
+ *
+ * The hash memtables only order keys within a prefix, scans that cross
+ * prefixes are left to the SST files, so they suit GET-only workloads.
+ *
+ * Returns the options, to destroy after opening the database.
+ */
+static inline rocksdb_options_t *
+rocksdb_profile_options(const struct rocksdb_profile *p, int threads)
+{
+	rocksdb_options_t *o = rocksdb_options_create();
+	rocksdb_block_based_table_options_t *t;
+	rocksdb_cache_t *cache;
+
+	if (rocksdb_profile_prefix(p))
+		rocksdb_options_set_prefix_extractor(o,
+			rocksdb_slicetransform_create_fixed_prefix(ROCKSDB_PREFIX_LEN));
+	if (p->plain_table) {
+		/* plain table files are only read through mmap */
+		rocksdb_options_set_allow_mmap_reads(o, 1);
+		rocksdb_options_set_allow_mmap_writes(o, 1);
+		/* no prefix hash table in total order mode */
+		rocksdb_options_set_plain_table_factory(o, 0, p->bloom_bits,
+			rocksdb_profile_prefix(p) ? 0.75 : 0, 3);
+		rocksdb_options_set_compression(o, rocksdb_no_compression);
+	} else {
+		t = rocksdb_block_based_options_create();
+		if (p->block_cache_mb) {
+			cache = rocksdb_cache_create_lru(p->block_cache_mb << 20);
+			rocksdb_block_based_options_set_block_cache(t, cache);
+			/* the table options hold a reference */
+			rocksdb_cache_destroy(cache);
+		} else {
+			rocksdb_block_based_options_set_no_block_cache(t, 1);
+		}
+		if (p->bloom_bits)
+			rocksdb_block_based_options_set_filter_policy(t,
+				rocksdb_filterpolicy_create_bloom(p->bloom_bits));
+		if (p->pin_l0 && p->block_cache_mb) {
+			rocksdb_block_based_options_set_cache_index_and_filter_blocks(t, 1);
+			rocksdb_block_based_options_set_pin_l0_filter_and_index_blocks_in_cache(t, 1);
+		}
+		rocksdb_options_set_block_based_table_factory(o, t);
+		rocksdb_block_based_options_destroy(t);
+		rocksdb_options_set_allow_mmap_reads(o, p->mmap_reads);
+		rocksdb_options_set_compression(o, p->compression);
+	}
+
+	switch (p->memtable) {
+	case ROCKSDB_MEMTABLE_HASH_SKIPLIST:
+		rocksdb_options_set_hash_skip_list_rep(o, 1000000, 4, 4);
+		rocksdb_options_set_allow_concurrent_memtable_write(o, 0);
+		break;
+	case ROCKSDB_MEMTABLE_HASH_LINKLIST:
+		rocksdb_options_set_hash_link_list_rep(o, 1000000);
+		rocksdb_options_set_allow_concurrent_memtable_write(o, 0);
+		break;
+	}
+
+	rocksdb_options_increase_parallelism(o, threads);
+	rocksdb_options_optimize_level_style_compaction(o, 0);
+	rocksdb_options_set_create_if_missing(o, 1);
+	return o;
+}
+
+/**
+ * rocksdb_shard - the shard of a key
+ * @key: the key
+ * @len: the key length
+ * @nr: the number of shards, 0 or 1 if not sharded
+ *
+ * Hashes (FNV-1a) the id prefix of the key only, so a scan between two keys
+ * that share the prefix stays in one shard.
+ */
+static inline int rocksdb_shard(const char *key, size_t len, int nr)
+{
+	uint32_t h = 2166136261u;
+	size_t i;
+
+	if (nr <= 1)
+		return 0;
+	for (i = 0; i < len && i < ROCKSDB_PREFIX_LEN; i++)
+		h = (h ^ (uint8_t) key[i]) * 16777619u;
+	return h % nr;
+}
+
+/* the path of shard @shard of @nr, @path itself if not sharded */
+static inline void rocksdb_shard_path(char *buf, size_t len, const char *path,
+				      int shard, int nr)
+{
+	if (nr <= 1)
+		snprintf(buf, len, "%s", path);
+	else
+		snprintf(buf, len, "%s.%d", path, shard);
+}
+
+/* a write of a worker, applied by the committer, see apps/rocksdb_commit.c */
+struct rocksdb_commit {
+	struct rocksdb_commit *next;
+	rocksdb_t *db;		/* the shard of the key */
+	bool delete;
+	const char *key, *val;
+	size_t key_len, val_len;
+	/* set by the committer once the write is durable */
+	volatile bool done;
+	bool failed;
+};
+
+extern int rocksdb_commit_init(void);
+extern void rocksdb_commit_options(rocksdb_writeoptions_t *wo);
+extern void rocksdb_commit_write(struct rocksdb_commit *c);
+
+/* a GET that missed the block cache, read by an I/O thread, see
+ * apps/rocksdb_io.c */
+struct rocksdb_io {
+	struct rocksdb_io *next;
+	rocksdb_t *db;
+	const char *key;
+	size_t key_len;
+	/* the value (NULL if absent, to free) or the error, once done */
+	char *val;
+	size_t val_len;
+	char *err;
+	volatile bool done;
+};
+
+extern int rocksdb_io_init(void);
+extern bool rocksdb_io_miss(char *err);
+extern void rocksdb_io_submit(struct rocksdb_io *io);
+extern void rocksdb_io_wait(struct rocksdb_io *io);
+
+/* per-worker cache of hot keys, see apps/kv_cache.c */
+struct kv_cache;
+
+extern int kv_cache_init(void);
+extern struct kv_cache *kv_cache_create(void);
+extern uint32_t kv_cache_gen(const char *key, size_t len);
+extern uint64_t kv_cache_epoch(void);
+extern const char *kv_cache_get(struct kv_cache *c, const char *key,
+				size_t len, size_t *val_len);
+extern void kv_cache_put(struct kv_cache *c, const char *key, size_t len,
+			 const char *val, size_t val_len, uint32_t gen);
+extern void kv_cache_invalidate(const char *key, size_t len);
@@ -0,0 +1,145 @@
+/*
+ * stats.h - runtime statistics exported through shared memory
+ *
+ * Every data plane core counts events in private memory and, at most every
+ * STATS_PUBLISH_US, copies its counters into its slot of a shared memory
+ * region (STATS_SHM_NAME) under a sequence lock. External readers (see
+ * tools/horus_stats.py) retry a slot whose sequence is odd or changed while
+ * they copied it, so they never stall or perturb the data plane.
+ *
+ * The region is self-describing: the header carries the layout version, the
+ * slot size and the names of the counters and request classes. It also holds
+ * the kstats latency histograms and per class CPU counters (ENABLE_KSTATS
+ * only), which are updated in place by their single writer. Pool counters
+ * live in the region named in the header (see ix/mcache.h).
+ */
+
+#pragma once
+
+#include <ix/stddef.h>
+#include <ix/app.h>
+#include <ix/cfg.h>
+#include <ix/cpu.h>
+#include <ix/ethqueue.h>
+
+#define STATS_SHM_NAME		"/horus.stats"
+#define STATS_SHM_MAGIC		0x68737473	/* "hsts" */
+#define STATS_SHM_VERSION	3
+
+#define STATS_PUBLISH_US	10000
+
+enum {
+	/* networker */
+	STATS_RX_PKTS = 0,
+	STATS_RX_BATCHES,
+	STATS_RX_REQUESTS,
+	STATS_CTRL_PKTS,
+	STATS_KEEP_ALIVES,
+	STATS_IDLE_SIGNALS,
+	STATS_NET_BUSY_CYCLES,	/* loop iterations that received packets */
+	STATS_NET_IDLE_CYCLES,	/* empty polls */
+	STATS_NET_WAIT_CYCLES,	/* part of busy, waiting for the dispatcher */
+	/* dispatcher */
+	STATS_ENQUEUED,
+	STATS_DISPATCHED,
+	STATS_REQUEUED,		/* preempted tasks put back in a queue */
+	STATS_COMPLETED,
+	STATS_DROPS,		/* requests dropped, no context */
+	STATS_BATCHES,		/* dispatches of more than one request */
+	STATS_BATCHED,		/* requests in those */
+	STATS_DISP_BUSY_LOOPS,
+	STATS_DISP_IDLE_LOOPS,
+	STATS_DISP_NET_CYCLES,	/* in handle_networker() with new requests */
+	STATS_DISP_WORKER_CYCLES, /* handling workers, in busy iterations */
+	STATS_DISP_IDLE_CYCLES,	/* iterations with nothing to do */
+	/* workers */
+	STATS_TASKS,
+	STATS_PREEMPTIONS,
+	STATS_YIELDS,
+	STATS_PARKS,		/* tasks waiting in worker_park() */
+	STATS_CACHE_HITS,	/* GETs served by the hot key cache */
+	STATS_CACHE_MISSES,
+	STATS_CACHE_HIT_CYCLES,	/* service time of those */
+	STATS_CACHE_MISS_CYCLES,
+	STATS_SHARD_LOCAL,	/* keys of the worker's own shard */
+	STATS_SHARD_REMOTE,	/* keys of the other shards */
+	STATS_UNKNOWN_CLIENT,
+	STATS_TX_ERRORS,
+	/* all cores */
+	STATS_ALLOCS,		/* malloc, calloc, realloc and new calls */
+	STATS_NR_COUNTERS,
+};
+
+#define STATS_NAME_LEN		24
+/* networker receive batch sizes: slot 0 counts empty polls, the last one
+ * full batches */
+#define STATS_RX_BATCH_SLOTS	(ETH_RX_MAX_BATCH + 1)
+#define STATS_CLASS_LEN		16
+
+enum {
+	STATS_ROLE_DISPATCHER = 0,
+	STATS_ROLE_NETWORKER,
+	STATS_ROLE_WORKER,
+};
+
+struct stats_core {
+	uint32_t seq;		/* odd while the owner updates the slot */
+	uint32_t role;
+	uint32_t cpu;		/* physical CPU */
+	uint32_t nr_queues;
+	uint64_t tsc;		/* time of the last publish */
+	uint64_t counters[STATS_NR_COUNTERS];
+	uint32_t queue_length[CFG_MAX_PORTS];	/* dispatcher only */
+	uint64_t rx_batch[STATS_RX_BATCH_SLOTS];	/* networker only */
+} __aligned(64);
+
+/* fixed part of the header, followed by the name tables */
+struct stats_shm {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size;		/* of the whole region */
+	uint64_t cycles_per_us;
+	uint32_t nr_cpus;
+	uint32_t nr_workers;
+	uint32_t nr_counters;
+	uint32_t nr_classes;
+	uint32_t cores_off;
+	uint32_t core_size;
+	/* latency histograms, hist_off is 0 without ENABLE_KSTATS */
+	uint32_t hist_off;
+	uint32_t hist_stride;	/* bytes per worker */
+	uint32_t hist_metrics;
+	uint32_t hist_classes;
+	uint32_t hist_buckets;
+	uint32_t hist_sub_bits;
+	uint32_t rx_batch_off;	/* in a core slot */
+	uint32_t rx_batch_slots;
+	/* per class CPU counters, in the histogram area of each worker */
+	uint32_t pmc_off;
+	uint32_t pmc_events;
+	char pools_shm[32];
+	char counter_names[STATS_NR_COUNTERS][STATS_NAME_LEN];
+	char class_names[APP_MAX_CLASSES][STATS_CLASS_LEN];
+	struct stats_core cores[CFG_MAX_CPU];
+};
+
+extern __thread uint64_t stats_counters[STATS_NR_COUNTERS];
+extern __thread uint64_t stats_next_publish;
+extern __thread uint64_t stats_rx_batch[STATS_RX_BATCH_SLOTS];
+
+extern int stats_init(void);
+extern void *stats_shm_hist(int worker);
+extern void stats_publish_slow(uint64_t now);
+
+#define STATS_ADD(_c, _n)	(stats_counters[STATS_##_c] += (_n))
+#define STATS_INC(_c)		STATS_ADD(_c, 1)
+
+/**
+ * stats_publish - exports the calling core's counters if they are due
+ * @now: the current TSC
+ */
+static inline void stats_publish(uint64_t now)
+{
+	if (unlikely(now >= stats_next_publish))
+		stats_publish_slow(now);
+}
@@ -0,0 +1,115 @@
+/*
+ * trace.h - sampled per-request lifecycle tracing
+ *
+ * The networker picks one request out of every CFG.trace_sample and gives it
+ * a non-zero trace id. Every core that handles a traced request appends TSC
+ * stamped events to its own single-writer ring; a drainer thread outside the
+ * data plane empties the rings into a binary trace file (see
+ * tools/trace_decode.py). Untraced requests cost one predictable branch per
+ * stage. A full ring drops events rather than stalling its core.
+ */
+
+#pragma once
+
+#include <ix/stddef.h>
+#include <ix/cpu.h>
+
+#include <asm/cpu.h>
+
+enum {
+	TRACE_RX = 1,		/* receive batch of the completing packet */
+	TRACE_REASM,		/* request complete (rq_update) */
+	TRACE_ENQUEUE,		/* task queued by the dispatcher */
+	TRACE_DISPATCH,		/* handed to a worker */
+	TRACE_START,		/* worker picked up a new task */
+	TRACE_PREEMPT,		/* task left its worker unfinished */
+	TRACE_RESUME,		/* preempted task picked up again */
+	TRACE_FINISH,		/* application handler returned */
+	TRACE_TX,		/* response handed to the NIC queue */
+};
+
+struct trace_event {
+	uint64_t tsc;
+	uint32_t id;
+	uint8_t type;
+	uint8_t cpu;
+	uint16_t arg;		/* worker index for dispatcher events */
+} __packed;
+
+#define TRACE_FILE_MAGIC	"HORUSTRC"
+#define TRACE_FILE_VERSION	1
+
+struct trace_file_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t event_size;
+	uint64_t cycles_per_us;
+} __packed;
+
+#define TRACE_RING_SIZE		(1 << 16)	/* events per core */
+
+struct trace_ring {
+	/* producer */
+	uint64_t head;
+	uint64_t tail_cache;
+	uint64_t drops;
+	/* drainer */
+	uint64_t tail __aligned(64);
+	struct trace_event *events __aligned(64);
+} __aligned(64);
+
+extern uint32_t trace_sample;
+extern struct trace_ring trace_rings[];
+
+extern int trace_init(void);
+
+/**
+ * trace_emit - appends an event to the calling core's ring
+ * @id: the trace id of the request
+ * @type: the event (TRACE_*)
+ * @tsc: the time stamp
+ * @arg: event specific argument
+ */
+static inline void trace_emit(uint32_t id, uint8_t type, uint64_t tsc,
+			      uint16_t arg)
+{
+	struct trace_ring *r = &trace_rings[percpu_get(cpu_nr)];
+	struct trace_event *e;
+
+	if (unlikely(r->head - r->tail_cache >= TRACE_RING_SIZE)) {
+		r->tail_cache = *(volatile uint64_t *) &r->tail;
+		if (r->head - r->tail_cache >= TRACE_RING_SIZE) {
+			r->drops++;
+			return;
+		}
+	}
+
+	e = &r->events[r->head & (TRACE_RING_SIZE - 1)];
+	e->tsc = tsc;
+	e->id = id;
+	e->type = type;
+	e->cpu = percpu_get(cpu_nr);
+	e->arg = arg;
+	/* the drainer must see the event before the new head */
+	asm volatile("" ::: "memory");
+	*(volatile uint64_t *) &r->head = r->head + 1;
+}
+
+/**
+ * trace_next_id - decides whether the next request is traced
+ *
+ * Only called by the networker.
+ *
+ * Returns the trace id, or 0 if the request is not sampled.
+ */
+static inline uint32_t trace_next_id(void)
+{
+	static uint32_t count, id;
+
+	if (likely(!trace_sample) || ++count < trace_sample)
+		return 0;
+	count = 0;
+	if (unlikely(++id == 0))
+		id = 1;
+	return id;
+}
@@ -30,6 +30,7 @@
 #include <ix/log.h>
 #include <ix/mbuf.h>
 #include <ix/ethdev.h>
+#include <ix/probe.h>
 
 #include <asm/chksum.h>
 
@@ -139,9 +140,11 @@ static inline int udp_send_one(void * data, size_t len, struct ip_tuple * id)
 	if (ret)
         	goto out;
 
+	PROBE(udp_send, data, len, id->dst_ip, id->dst_port, 0);
 	return 0;
 
 out:
+	PROBE(udp_send, data, len, id->dst_ip, id->dst_port, ret);
 	mbuf_free(pkt);
 	return ret;
 }
@@ -0,0 +1,378 @@
+#!/usr/bin/python3
+
+# horus_stats.py - dumps the shared memory statistics of a running server
+#
+# Maps the region published by dp/core/stats.c (layout in inc/ix/stats.h)
+# and the pool counters of dp/core/mcache.c (inc/ix/mcache.h) read-only and
+# prints the per-core counters, the dispatcher queue lengths, the loop
+# utilization of the dispatcher and networker, the receive batch sizes, the
+# pools and, for a server built with ENABLE_KSTATS, the latency percentiles
+# and the CPU counters per task of each request class. With --interval the
+# counters are shown as rates and the percentiles cover the interval only.
+# Reading never blocks or slows down the server.
+#
+# usage: horus_stats.py [--json] [--interval MS] [--count N]
+
+import argparse
+import json
+import mmap
+import struct
+import sys
+import time
+
+STATS_SHM = '/dev/shm/horus.stats'
+STATS_MAGIC = 0x68737473
+STATS_VERSION = 3
+HDR = struct.Struct('<IIQQ16I32s')
+NAME_LEN = 24
+CLASS_LEN = 16
+MAX_PORTS = 16
+ROLES = ['dispatcher', 'networker', 'worker']
+METRICS = ['queue', 'service', 'sojourn']
+PMC_EVENTS = ['instructions', 'cycles', 'llc_misses']
+PERCENTILES = [50, 99, 99.9]
+
+POOLS_MAGIC = 0x6d636163
+POOLS_MAX_CPU = 128
+POOL_CACHE = 64 + POOLS_MAX_CPU * 64
+POOL_CPU = struct.Struct('<QQQQQq')
+
+
+def cstr(b):
+    return b.split(b'\0', 1)[0].decode()
+
+
+def map_file(path):
+    with open(path, 'rb') as f:
+        return mmap.mmap(f.fileno(), 0, prot=mmap.PROT_READ)
+
+
+class Region:
+    def __init__(self, path):
+        self.m = map_file(path)
+        (magic, version, self.size, self.cycles_per_us, self.nr_cpus,
+         self.nr_workers, self.nr_counters, self.nr_classes, self.cores_off,
+         self.core_size, self.hist_off, self.hist_stride, self.hist_metrics,
+         self.hist_classes, self.hist_buckets, self.hist_sub_bits,
+         self.rx_batch_off, self.rx_batch_slots, self.pmc_off,
+         self.pmc_events, pools) = HDR.unpack_from(self.m, 0)
+        if magic != STATS_MAGIC or version != STATS_VERSION:
+            sys.exit('%s: not a version %d stats region' %
+                     (path, STATS_VERSION))
+        self.pools = cstr(pools)
+        off = HDR.size
+        self.counters = [cstr(self.m[off + i * NAME_LEN:
+                                     off + (i + 1) * NAME_LEN])
+                         for i in range(self.nr_counters)]
+        off += self.nr_counters * NAME_LEN
+        self.classes = [cstr(self.m[off + i * CLASS_LEN:
+                                    off + (i + 1) * CLASS_LEN])
+                        for i in range(self.nr_classes)]
+
+    def core(self, i):
+        """Reads one slot under its sequence lock."""
+        off = self.cores_off + i * self.core_size
+        n = self.nr_counters
+        while True:
+            seq = struct.unpack_from('<I', self.m, off)[0]
+            if seq & 1:
+                continue
+            raw = self.m[off:off + self.core_size]
+            if struct.unpack_from('<I', self.m, off)[0] == seq:
+                break
+        _, role, cpu, nr_queues, tsc = struct.unpack_from('<IIIIQ', raw, 0)
+        counters = struct.unpack_from('<%dQ' % n, raw, 24)
+        queues = struct.unpack_from('<%dI' % MAX_PORTS, raw, 24 + 8 * n)
+        batch = struct.unpack_from('<%dQ' % self.rx_batch_slots, raw,
+                                   self.rx_batch_off)
+        return {'role': ROLES[role] if role < len(ROLES) else str(role),
+                'cpu': cpu, 'tsc': tsc,
+                'counters': dict(zip(self.counters, counters)),
+                'queue_length': list(queues[:nr_queues]),
+                'rx_batch': list(batch) if any(batch) else []}
+
+    def hist(self, worker, metric, cls):
+        """Returns the buckets of one histogram (no lock, they only grow)."""
+        per_hist = 16 + 8 * self.hist_buckets
+        off = (self.hist_off + worker * self.hist_stride +
+               (metric * self.hist_classes + cls) * per_hist + 16)
+        return list(struct.unpack_from('<%dQ' % self.hist_buckets, self.m,
+                                       off))
+
+    def pmc(self, worker, cls):
+        """Returns tasks, TSC cycles and events of a class on a worker."""
+        n = 2 + self.pmc_events
+        base = self.hist_off + worker * self.hist_stride + self.pmc_off
+        vals = struct.unpack_from('<%dQ' % n, self.m, base + cls * n * 8)
+        # pmc_hw follows the counters of all the classes
+        hw = struct.unpack_from('<I', self.m,
+                                base + self.hist_classes * n * 8)[0]
+        return vals, hw
+
+    def bucket_value(self, b):
+        sub = 1 << self.hist_sub_bits
+        if b < 2 * sub:
+            return b
+        shift = (b >> self.hist_sub_bits) - 1
+        return (b - (shift << self.hist_sub_bits)) << shift
+
+
+def read_pools(path):
+    try:
+        m = map_file(path)
+    except OSError:
+        return {}
+    magic, nr_caches, nr_cpus = struct.unpack_from('<III', m, 0)
+    if magic != POOLS_MAGIC:
+        return {}
+    pools = {}
+    for c in range(nr_caches):
+        off = 64 + c * POOL_CACHE
+        name = cstr(m[off:off + 32])
+        nr_objs = struct.unpack_from('<I', m, off + 32)[0]
+        allocs = frees = remote = hwm = failed = 0
+        for i in range(min(nr_cpus, POOLS_MAX_CPU)):
+            _, _, a, f, fl, h = POOL_CPU.unpack_from(m, off + 64 + i * 64)
+            allocs += a
+            frees += f
+            remote += max(0, f - a)
+            hwm += max(0, h)
+            failed += fl
+        pools[name] = {'objs': nr_objs,
+                       'allocated': max(0, allocs - frees),
+                       'hwm': min(hwm, nr_objs), 'failed': failed,
+                       'remote_frees': remote}
+    return pools
+
+
+def snapshot(r):
+    snap = {'cores': [r.core(i) for i in range(r.nr_cpus)],
+            'pools': read_pools('/dev/shm' + r.pools), 'hist': {},
+            'pmc': {}, 'pmc_hw': r.nr_workers > 0}
+    if r.hist_off:
+        for m in range(min(r.hist_metrics, len(METRICS))):
+            for w in range(r.nr_workers):
+                for c in range(r.nr_classes):
+                    snap['hist'][(m, w, c)] = r.hist(w, m, c)
+        for w in range(r.nr_workers):
+            for c in range(r.nr_classes):
+                snap['pmc'][(w, c)], hw = r.pmc(w, c)
+                snap['pmc_hw'] = snap['pmc_hw'] and hw
+    return snap
+
+
+def percentiles(r, buckets):
+    total = sum(buckets)
+    if not total:
+        return None
+    res = {'count': total}
+    for p in PERCENTILES:
+        rank = min(total - 1, int(total * p / 100.0))
+        seen = 0
+        for b, n in enumerate(buckets):
+            seen += n
+            if seen > rank:
+                break
+        res['p%g' % p] = round(r.bucket_value(b) / r.cycles_per_us, 3)
+    last = max(b for b, n in enumerate(buckets) if n)
+    res['max'] = round(r.bucket_value(last) / r.cycles_per_us, 3)
+    return res
+
+
+def latencies(r, cur, prev):
+    out = {}
+    for m in range(min(r.hist_metrics, len(METRICS))):
+        rows = {}
+        for label, sel in ([('all', lambda w, c: True)] +
+                           [('class ' + r.classes[k],
+                             lambda w, c, k=k: c == k)
+                            for k in range(r.nr_classes)] +
+                           [('worker %d' % k, lambda w, c, k=k: w == k)
+                            for k in range(r.nr_workers)]):
+            merged = [0] * r.hist_buckets
+            for (mm, w, c), b in cur['hist'].items():
+                if mm != m or not sel(w, c):
+                    continue
+                old = prev['hist'][(mm, w, c)] if prev else None
+                for i, n in enumerate(b):
+                    merged[i] += n - (old[i] if old else 0)
+            p = percentiles(r, merged)
+            if p:
+                rows[label] = p
+        if rows:
+            out[METRICS[m]] = rows
+    return out
+
+
+def cpu_counters(r, cur, prev):
+    """Per class CPU counters per task, as hardware counters allow."""
+    out = {}
+    for k in range(r.nr_classes):
+        tot = [0] * (2 + r.pmc_events)
+        for (w, c), v in cur['pmc'].items():
+            if c != k:
+                continue
+            old = prev['pmc'][(w, c)] if prev else None
+            for i, n in enumerate(v):
+                tot[i] += n - (old[i] if old else 0)
+        tasks, tsc, ev = tot[0], tot[1], dict(zip(PMC_EVENTS, tot[2:]))
+        if not tasks:
+            continue
+        row = {'tasks': tasks, 'tsc_per_task': round(tsc / tasks, 1)}
+        if cur['pmc_hw']:
+            row['instr_per_task'] = round(ev['instructions'] / tasks, 1)
+            row['llc_misses_per_task'] = round(ev['llc_misses'] / tasks, 2)
+            row['ipc'] = round(ev['instructions'] / max(ev['cycles'], 1), 2)
+        out[r.classes[k]] = row
+    return out
+
+
+def utilization(c, old):
+    """Loop utilization in percent from the cycle counters of a core."""
+    def d(k):
+        return c[k] - (old[k] if old else 0)
+
+    if c['role'] == 'networker':
+        total = d('net_busy_cycles') + d('net_idle_cycles')
+        parts = {'busy': d('net_busy_cycles'),
+                 'wait': d('net_wait_cycles')}
+    elif c['role'] == 'dispatcher':
+        total = (d('disp_net_cycles') + d('disp_worker_cycles') +
+                 d('disp_idle_cycles'))
+        parts = {'busy': d('disp_net_cycles') + d('disp_worker_cycles'),
+                 'networker': d('disp_net_cycles'),
+                 'workers': d('disp_worker_cycles')}
+    else:
+        return None
+    if not total:
+        return None
+    return {k: round(100.0 * v / total, 1) for k, v in parts.items()}
+
+
+def report(r, cur, prev, secs):
+    cores = []
+    for i, c in enumerate(cur['cores']):
+        counters = {k: v for k, v in c['counters'].items() if v}
+        if prev:
+            old = prev['cores'][i]['counters']
+            counters = {k: round((v - old[k]) / secs, 1)
+                        for k, v in c['counters'].items() if v - old[k]}
+        entry = {'index': i, 'role': c['role'], 'cpu': c['cpu'],
+                 'counters': counters}
+        if c['queue_length']:
+            entry['queue_length'] = c['queue_length']
+        old = prev['cores'][i] if prev else None
+        util = utilization(dict(c['counters'], role=c['role']),
+                           old['counters'] if old else None)
+        if util:
+            entry['util_pct'] = util
+        if c['role'] == 'worker':
+            tasks = c['counters']['tasks'] - (old['counters']['tasks']
+                                              if old else 0)
+            allocs = c['counters']['allocs'] - (old['counters']['allocs']
+                                                if old else 0)
+            if tasks:
+                entry['allocs_per_task'] = round(allocs / tasks, 2)
+            cache = {k: c['counters'].get(k, 0) -
+                     (old['counters'].get(k, 0) if old else 0)
+                     for k in ('cache_hits', 'cache_misses',
+                               'cache_hit_cycles', 'cache_miss_cycles')}
+            gets = cache['cache_hits'] + cache['cache_misses']
+            if gets:
+                entry['hot_cache'] = {
+                    'hit_pct': round(100.0 * cache['cache_hits'] / gets, 1),
+                    'hit_us': round(cache['cache_hit_cycles'] /
+                                    max(cache['cache_hits'], 1) /
+                                    r.cycles_per_us, 3),
+                    'miss_us': round(cache['cache_miss_cycles'] /
+                                     max(cache['cache_misses'], 1) /
+                                     r.cycles_per_us, 3)}
+            local, remote = (c['counters'].get(k, 0) -
+                             (old['counters'].get(k, 0) if old else 0)
+                             for k in ('shard_local', 'shard_remote'))
+            if local + remote:
+                entry['shard_remote_pct'] = round(
+                    100.0 * remote / (local + remote), 1)
+        if c['rx_batch']:
+            entry['rx_batch'] = [n - (old['rx_batch'][k] if old else 0)
+                                 for k, n in enumerate(c['rx_batch'])]
+        cores.append(entry)
+    return {'time': time.time(), 'rates': bool(prev), 'cores': cores,
+            'pools': cur['pools'], 'latency_us': latencies(r, cur, prev),
+            'cpu_per_class': cpu_counters(r, cur, prev)}
+
+
+def print_text(rep):
+    unit = '/s' if rep['rates'] else ''
+    for c in rep['cores']:
+        print('%-10s %2d cpu %3d  %s' %
+              (c['role'], c['index'], c['cpu'],
+               ' '.join('%s=%s%s' % (k, v, unit)
+                        for k, v in c['counters'].items())))
+        if 'queue_length' in c:
+            print('%-10s queue lengths %s' %
+                  ('', ' '.join(map(str, c['queue_length']))))
+        if 'util_pct' in c:
+            print('%-10s utilization %s' %
+                  ('', ' '.join('%s %.1f%%' % kv
+                                for kv in c['util_pct'].items())))
+        if 'allocs_per_task' in c:
+            print('%-10s allocs per task %.2f' % ('', c['allocs_per_task']))
+        if 'hot_cache' in c:
+            print('%-10s hot cache hits %.1f%%, GET %.3f us on a hit, '
+                  '%.3f us on a miss' %
+                  ('', c['hot_cache']['hit_pct'], c['hot_cache']['hit_us'],
+                   c['hot_cache']['miss_us']))
+        if 'shard_remote_pct' in c:
+            print('%-10s keys of other shards %.1f%%' %
+                  ('', c['shard_remote_pct']))
+        if 'rx_batch' in c:
+            b = c['rx_batch']
+            polls = sum(b[1:])
+            avg = sum(k * n for k, n in enumerate(b)) / polls if polls else 0
+            print('%-10s rx batches (size:count) %s  avg %.2f' %
+                  ('', ' '.join('%d:%d' % (k, n)
+                                for k, n in enumerate(b) if n), avg))
+    for name, p in rep['pools'].items():
+        print('pool %-16s %9d objs %9d allocated %9d hwm %6d failed '
+              '%9d remote frees' % (name, p['objs'], p['allocated'],
+                                    p['hwm'], p['failed'],
+                                    p['remote_frees']))
+    for metric, rows in rep['latency_us'].items():
+        for label, p in rows.items():
+            print('%-8s %-16s %9d  %s  (us)' %
+                  (metric, label, p['count'],
+                   ' '.join('%s %.2f' % (k, p[k])
+                            for k in list(p)[1:])))
+    for cls, p in rep['cpu_per_class'].items():
+        print('cpu      class %-10s %9d  %s' %
+              (cls, p['tasks'], ' '.join('%s %s' % (k, v)
+                                         for k, v in list(p.items())[1:])))
+    print()
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument('--json', action='store_true')
+    ap.add_argument('--interval', type=int, default=0,
+                    help='ms between two reports, show rates')
+    ap.add_argument('--count', type=int, default=1)
+    ap.add_argument('--file', default=STATS_SHM)
+    args = ap.parse_args()
+
+    r = Region(args.file)
+    prev = snapshot(r) if args.interval else None
+    for _ in range(args.count):
+        if args.interval:
+            time.sleep(args.interval / 1000.0)
+        cur = snapshot(r)
+        rep = report(r, cur, prev, args.interval / 1000.0)
+        if args.json:
+            print(json.dumps(rep), flush=True)
+        else:
+            print_text(rep)
+        prev = cur if args.interval else None
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,96 @@
+#!/usr/bin/python3
+
+# trace_decode.py - per-stage latency percentiles from a lifecycle trace
+#
+# Reads the binary file written by the trace drainer (dp/core/trace.c, format
+# in inc/ix/trace.h) and prints, for every stage of a request's life on the
+# server, the latency percentiles in microseconds. Only requests whose RX and
+# TX events are both in the trace are counted. A preempted request is
+# dispatched more than once: queueing uses its first dispatch and service
+# time spans from its first start to its finish.
+#
+# usage: trace_decode.py [--csv] TRACE_FILE
+
+import struct
+import sys
+
+HDR = struct.Struct('<8sIIQ')
+EVENT = struct.Struct('<QIBBH')
+MAGIC = b'HORUSTRC'
+
+(RX, REASM, ENQUEUE, DISPATCH, START, PREEMPT, RESUME, FINISH, TX) = range(1, 10)
+
+STAGES = [
+    ('rx->reassembled', RX, REASM),
+    ('reassembled->enqueue', REASM, ENQUEUE),
+    ('queueing', ENQUEUE, DISPATCH),
+    ('dispatch->start', DISPATCH, START),
+    ('service', START, FINISH),
+    ('finish->tx', FINISH, TX),
+    ('total', RX, TX),
+]
+
+PERCENTILES = [50, 90, 99, 99.9]
+
+
+def read_trace(path):
+    with open(path, 'rb') as f:
+        data = f.read()
+    magic, version, event_size, cycles_per_us = HDR.unpack_from(data, 0)
+    if magic != MAGIC or version != 1 or event_size != EVENT.size:
+        sys.exit('%s: not a version 1 trace file' % path)
+
+    requests = {}
+    preempts = {}
+    for off in range(HDR.size, len(data) - EVENT.size + 1, EVENT.size):
+        tsc, rid, etype, cpu, arg = EVENT.unpack_from(data, off)
+        events = requests.setdefault(rid, {})
+        if etype == PREEMPT:
+            preempts[rid] = preempts.get(rid, 0) + 1
+        # keep the first occurrence, rings are drained out of order
+        if etype not in events or tsc < events[etype]:
+            events[etype] = tsc
+    return cycles_per_us, requests, preempts
+
+
+def percentile(values, p):
+    idx = min(len(values) - 1, int(len(values) * p / 100.0))
+    return values[idx]
+
+
+def main():
+    args = sys.argv[1:]
+    csv = '--csv' in args
+    args = [a for a in args if a != '--csv']
+    if len(args) != 1:
+        sys.exit('usage: %s [--csv] TRACE_FILE' % sys.argv[0])
+
+    cycles_per_us, requests, preempts = read_trace(args[0])
+    complete = {rid: ev for rid, ev in requests.items()
+                if RX in ev and TX in ev}
+
+    cols = ['stage', 'count'] + ['p%g' % p for p in PERCENTILES] + ['max']
+    if csv:
+        print(','.join(cols))
+    else:
+        print('%d traced requests, %d complete, %d preempted' %
+              (len(requests), len(complete), len(preempts)))
+        print('%-22s %8s' % tuple(cols[:2]) +
+              ''.join('%10s' % c for c in cols[2:]) + '  (us)')
+
+    for name, a, b in STAGES:
+        lat = sorted((ev[b] - ev[a]) / float(cycles_per_us)
+                     for ev in complete.values()
+                     if a in ev and b in ev and ev[b] >= ev[a])
+        if not lat:
+            continue
+        row = [percentile(lat, p) for p in PERCENTILES] + [lat[-1]]
+        if csv:
+            print(','.join([name, str(len(lat))] + ['%.3f' % v for v in row]))
+        else:
+            print('%-22s %8d' % (name, len(lat)) +
+                  ''.join('%10.2f' % v for v in row))
+
+
+if __name__ == '__main__':
+    main()
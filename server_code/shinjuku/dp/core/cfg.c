@@ -47,6 +47,7 @@
 #include <net/ethernet.h>
 #include <net/ip.h>
 #include <ix/ethdev.h>
+#include <ix/synthetic.h>
 
 #define DEFAULT_CONF_FILE "./shinjuku.conf"
 
@@ -68,6 +69,8 @@ static int parse_arp(void);
 static int parse_devices(void);
 static int parse_cpu(void);
 static int parse_loader_path(void);
+static int parse_synthetic_profile(void);
+static int parse_synthetic_working_set(void);
 
 struct config_vector_t {
 	const char *name;
@@ -85,6 +88,8 @@ static struct config_vector_t config_tbl[] = {
 	{ "devices",      parse_devices},
 	{ "cpu",          parse_cpu},
 	{ "loader_path",  parse_loader_path},
+	{ "synthetic_profile", parse_synthetic_profile},
+	{ "synthetic_working_set", parse_synthetic_working_set},
 	{ NULL,           NULL}
 };
 
@@ -386,6 +391,61 @@ static int parse_loader_path(void)
 	return 0;
 }
 
+static int add_synthetic_profile(const char *name)
+{
+	int profile;
+
+	if (!name)
+		return -EINVAL;
+	profile = synthetic_parse_profile(name);
+	if (profile < 0) {
+		log_err("cfg: unknown synthetic profile '%s'\n", name);
+		return profile;
+	}
+	CFG.synthetic_profiles[CFG.num_synthetic_profiles] = profile;
+	++CFG.num_synthetic_profiles;
+	return 0;
+}
+
+static int parse_synthetic_profile(void)
+{
+	const config_setting_t *profiles = NULL;
+	int ret;
+
+	profiles = config_lookup(&cfg, "synthetic_profile");
+	if (!profiles)
+		return 0;
+	if (config_setting_type(profiles) == CONFIG_TYPE_STRING)
+		return add_synthetic_profile(config_setting_get_string(profiles));
+	CFG.num_synthetic_profiles = 0;
+	while (CFG.num_synthetic_profiles < CFG_MAX_PORTS && CFG.num_synthetic_profiles < config_setting_length(profiles)) {
+		ret = add_synthetic_profile(config_setting_get_string_elem(profiles, CFG.num_synthetic_profiles));
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int parse_synthetic_working_set(void)
+{
+	long long wss;
+
+	CFG.synthetic_wss_kb = SYNTHETIC_DEFAULT_WSS_KB;
+	CFG.synthetic_llc_wss_kb = SYNTHETIC_DEFAULT_LLC_WSS_KB;
+
+	if (config_lookup_int64(&cfg, "synthetic_working_set", &wss)) {
+		if (wss <= 0)
+			return -EINVAL;
+		CFG.synthetic_wss_kb = wss;
+	}
+	if (config_lookup_int64(&cfg, "synthetic_llc_working_set", &wss)) {
+		if (wss <= 0)
+			return -EINVAL;
+		CFG.synthetic_llc_wss_kb = wss;
+	}
+	return 0;
+}
+
 static int parse_conf_file(const char *path)
 {
 	int ret, i;
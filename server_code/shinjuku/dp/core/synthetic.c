@@ -0,0 +1,260 @@
+/*
+ * synthetic.c - calibrated synthetic work generator
+ *
+ * Each profile is a small kernel that runs a given number of iterations.
+ * At startup every worker measures the TSC cycles one iteration of each
+ * configured profile takes on its own core and working set, and converts a
+ * requested runNs into an iteration count with that ratio. Counting
+ * iterations rather than watching the clock keeps the requested service
+ * time exact across preemptions: a preempted task resumes where it left off
+ * and is not charged for the time it spent off the core.
+ *
+ * Calibration is serialized across workers so that the memory-bound
+ * profiles are measured without interference from the other cores.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <ix/stddef.h>
+#include <ix/cfg.h>
+#include <ix/cpu.h>
+#include <ix/log.h>
+#include <ix/mem.h>
+#include <ix/lock.h>
+#include <ix/errno.h>
+#include <ix/timer.h>
+#include <ix/synthetic.h>
+
+#include <asm/cpu.h>
+
+#define SYNTHETIC_CALIBRATION_TRIALS	5
+#define SYNTHETIC_LINE_WORDS		(64 / sizeof(uint64_t))
+
+struct synthetic_buf {
+	uint64_t *base;
+	size_t lines;
+	int nr_pages;
+};
+
+struct synthetic_cpu {
+	/* pointer chase ring and stream buffer (share the working set) */
+	struct synthetic_buf wss;
+	uint64_t *chase_pos;
+	size_t stream_pos;
+	/* LLC thrash buffer */
+	struct synthetic_buf llc;
+	uint64_t llc_seed;
+	/* iterations per ns of each profile, measured at startup */
+	double iters_per_ns[SYNTHETIC_NR_PROFILES];
+};
+
+static __thread struct synthetic_cpu syn;
+static DEFINE_SPINLOCK(synthetic_calibration_lock);
+
+static const char *synthetic_names[SYNTHETIC_NR_PROFILES] = {
+	[SYNTHETIC_SPIN]		= "spin",
+	[SYNTHETIC_POINTER_CHASE]	= "pointer_chase",
+	[SYNTHETIC_STREAM]		= "stream",
+	[SYNTHETIC_LLC_THRASH]		= "llc_thrash",
+};
+
+/* calibration run length of each profile, in iterations */
+static const uint64_t synthetic_calibration_iters[SYNTHETIC_NR_PROFILES] = {
+	[SYNTHETIC_SPIN]		= 1 << 20,
+	[SYNTHETIC_POINTER_CHASE]	= 1 << 16,
+	[SYNTHETIC_STREAM]		= 1 << 18,
+	[SYNTHETIC_LLC_THRASH]		= 1 << 16,
+};
+
+/**
+ * synthetic_parse_profile - maps a profile name to its id
+ * @name: the profile name
+ *
+ * Returns the profile id, or -EINVAL if unknown.
+ */
+int synthetic_parse_profile(const char *name)
+{
+	int i;
+
+	for (i = 0; i < SYNTHETIC_NR_PROFILES; i++) {
+		if (!strcmp(synthetic_names[i], name))
+			return i;
+	}
+	return -EINVAL;
+}
+
+static void synthetic_spin(uint64_t iters)
+{
+	while (iters--)
+		asm volatile ("nop");
+}
+
+static void synthetic_pointer_chase(uint64_t iters)
+{
+	uint64_t *p = syn.chase_pos;
+
+	while (iters--)
+		p = (uint64_t *) *p;
+	syn.chase_pos = p;
+}
+
+static void synthetic_stream(uint64_t iters)
+{
+	volatile uint64_t *buf = syn.wss.base;
+	size_t pos = syn.stream_pos;
+	size_t end = syn.wss.lines * SYNTHETIC_LINE_WORDS;
+
+	/* word 0 of each line holds the chase ring, so stream over word 1 */
+	while (iters--) {
+		buf[pos + 1] += pos;
+		pos += SYNTHETIC_LINE_WORDS;
+		if (unlikely(pos == end))
+			pos = 0;
+	}
+	syn.stream_pos = pos;
+}
+
+static void synthetic_llc_thrash(uint64_t iters)
+{
+	volatile uint64_t *buf = syn.llc.base;
+	uint64_t x = syn.llc_seed;
+
+	while (iters--) {
+		x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+		buf[((x >> 33) % syn.llc.lines) * SYNTHETIC_LINE_WORDS] += x;
+	}
+	syn.llc_seed = x;
+}
+
+static void (*const synthetic_kernels[SYNTHETIC_NR_PROFILES])(uint64_t) = {
+	[SYNTHETIC_SPIN]		= synthetic_spin,
+	[SYNTHETIC_POINTER_CHASE]	= synthetic_pointer_chase,
+	[SYNTHETIC_STREAM]		= synthetic_stream,
+	[SYNTHETIC_LLC_THRASH]		= synthetic_llc_thrash,
+};
+
+static int synthetic_buf_alloc(struct synthetic_buf *b, uint64_t kb)
+{
+	size_t len = kb * 1024;
+
+	b->nr_pages = div_up(len, PGSIZE_2MB);
+	b->base = mem_alloc_pages_onnode(b->nr_pages, PGSIZE_2MB,
+					 percpu_get(cpu_numa_node), MPOL_BIND);
+	if (b->base == MAP_FAILED || !b->base)
+		return -ENOMEM;
+	b->lines = len / 64;
+	return 0;
+}
+
+/* builds a single random cycle over all lines (Sattolo's algorithm) */
+static int synthetic_build_ring(struct synthetic_buf *b)
+{
+	uint64_t *line = b->base;
+	uint32_t *order;
+	uint64_t x = rdtsc() | 1;
+	size_t i, j, tmp;
+
+	order = malloc(b->lines * sizeof(*order));
+	if (!order)
+		return -ENOMEM;
+	for (i = 0; i < b->lines; i++)
+		order[i] = i;
+	for (i = b->lines - 1; i > 0; i--) {
+		x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+		j = (x >> 33) % i;
+		tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+	for (i = 0; i < b->lines; i++) {
+		j = (i + 1) % b->lines;
+		line[order[i] * SYNTHETIC_LINE_WORDS] =
+			(uint64_t) &line[order[j] * SYNTHETIC_LINE_WORDS];
+	}
+	free(order);
+	syn.chase_pos = b->base;
+	return 0;
+}
+
+static void synthetic_calibrate(int profile)
+{
+	uint64_t iters = synthetic_calibration_iters[profile];
+	uint64_t start, cycles, best = UINT64_MAX;
+	int i;
+
+	/* first run only warms the caches and TLB */
+	synthetic_kernels[profile](iters);
+	for (i = 0; i < SYNTHETIC_CALIBRATION_TRIALS; i++) {
+		start = rdtsc();
+		synthetic_kernels[profile](iters);
+		cycles = rdtscp(NULL) - start;
+		if (cycles < best)
+			best = cycles;
+	}
+
+	syn.iters_per_ns[profile] = (double) iters * cycles_per_us / (best * 1000.0);
+	log_info("synthetic: %-13s %6.2f cycles/iter\n",
+		 synthetic_names[profile], (double) best / iters);
+}
+
+static bool synthetic_profile_used(int profile)
+{
+	int i;
+
+	if (!CFG.num_synthetic_profiles)
+		return profile == SYNTHETIC_SPIN;
+	for (i = 0; i < CFG.num_synthetic_profiles; i++) {
+		if (CFG.synthetic_profiles[i] == profile)
+			return true;
+	}
+	return false;
+}
+
+/**
+ * synthetic_init_cpu - allocates the working sets and calibrates the
+ *                      profiles used by this worker
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int synthetic_init_cpu(void)
+{
+	int i, ret;
+
+	if (synthetic_profile_used(SYNTHETIC_POINTER_CHASE) ||
+	    synthetic_profile_used(SYNTHETIC_STREAM)) {
+		ret = synthetic_buf_alloc(&syn.wss, CFG.synthetic_wss_kb);
+		if (ret)
+			return ret;
+		ret = synthetic_build_ring(&syn.wss);
+		if (ret)
+			return ret;
+	}
+
+	if (synthetic_profile_used(SYNTHETIC_LLC_THRASH)) {
+		ret = synthetic_buf_alloc(&syn.llc, CFG.synthetic_llc_wss_kb);
+		if (ret)
+			return ret;
+		syn.llc_seed = rdtsc() | 1;
+	}
+
+	spin_lock(&synthetic_calibration_lock);
+	for (i = 0; i < SYNTHETIC_NR_PROFILES; i++) {
+		if (synthetic_profile_used(i))
+			synthetic_calibrate(i);
+	}
+	spin_unlock(&synthetic_calibration_lock);
+	return 0;
+}
+
+/**
+ * synthetic_work - executes run_ns nanoseconds worth of a profile
+ * @profile: the profile id
+ * @run_ns: the requested service time
+ */
+void synthetic_work(int profile, uint64_t run_ns)
+{
+	uint64_t iters = run_ns * syn.iters_per_ns[profile];
+
+	synthetic_kernels[profile](iters);
+}
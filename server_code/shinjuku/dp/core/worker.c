@@ -46,6 +46,8 @@
 #include <ix/context.h>
 #include <ix/dispatch.h>
 #include <ix/transmit.h>
+#include <ix/cfg.h>
+#include <ix/synthetic.h>
 
 #include <dune.h>
 
@@ -98,6 +100,19 @@ static void test_handler(struct dune_tf *tf)
         swapcontext_fast_to_control(cont, &uctx_main);
 }
 
+/**
+ * synthetic_profile - returns the synthetic profile serving a request type
+ * @type: the request type (index of the port it was received on)
+ */
+static inline int synthetic_profile(int type)
+{
+        if (!CFG.num_synthetic_profiles)
+                return SYNTHETIC_SPIN;
+        if (type >= CFG.num_synthetic_profiles)
+                type = CFG.num_synthetic_profiles - 1;
+        return CFG.synthetic_profiles[type];
+}
+
 /**
  * generic_work - generic function acting as placeholder for application-level
  *                work
@@ -115,14 +130,8 @@ static void generic_work(uint32_t msw, uint32_t lsw, uint32_t msw_id,
 
         struct message * req = (struct message *) data;
 
-        /* 
-        TODO: @parham "0.58" Hardcoded to match the runNs with number of nops should we change this?
-        */ 
-        uint64_t i = 0;
-        do {
-                asm volatile ("nop");
-                i++;
-        } while ( i / 0.58 < req->runNs);
+        synthetic_work(synthetic_profile(dispatcher_requests[cpu_nr_].type),
+                       req->runNs);
 
         /*
          * @parham: TODO: Modify these reply packet headers to match falcon headers.
@@ -192,6 +201,8 @@ static inline void init_worker(void)
         cpu_nr_ = percpu_get(cpu_nr) - 2;
         worker_responses[cpu_nr_].flag = PROCESSED;
         dune_register_intr_handler(PREEMPT_VECTOR, test_handler);
+        if (synthetic_init_cpu())
+                panic("worker: failed to initialize synthetic work\n");
         eth_process_reclaim();
         asm volatile ("cli":::);
 }
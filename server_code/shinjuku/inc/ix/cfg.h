@@ -65,6 +65,11 @@ struct cfg_parameters {
 
 	uint64_t preemption_delay;
 
+	int num_synthetic_profiles;
+	int synthetic_profiles[CFG_MAX_PORTS];
+	uint64_t synthetic_wss_kb;
+	uint64_t synthetic_llc_wss_kb;
+
 	char loader_path[256];
 };
 
@@ -0,0 +1,31 @@
+/*
+ * synthetic.h - calibrated synthetic work generator
+ *
+ * Replaces the hardcoded nop loop of the synthetic server. Every worker
+ * calibrates each configured profile against the TSC (cycles_per_us) at
+ * startup, so a request asking for runNs nanoseconds executes the number of
+ * work units that takes runNs on this host when the core runs alone.
+ * Memory-bound profiles still slow down under interference from the other
+ * workers, which is the point of using them.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+enum {
+	SYNTHETIC_SPIN = 0,	/* pure pipeline spin, no memory traffic */
+	SYNTHETIC_POINTER_CHASE,/* dependent loads over the working set */
+	SYNTHETIC_STREAM,	/* sequential read-modify-write bandwidth */
+	SYNTHETIC_LLC_THRASH,	/* random line writes over a buffer > LLC */
+	SYNTHETIC_NR_PROFILES,
+};
+
+/* default working set in KB of the memory-bound profiles */
+#define SYNTHETIC_DEFAULT_WSS_KB	(1024)
+#define SYNTHETIC_DEFAULT_LLC_WSS_KB	(64 * 1024)
+
+extern int synthetic_parse_profile(const char *name);
+
+extern int synthetic_init_cpu(void);
+extern void synthetic_work(int profile, uint64_t run_ns);